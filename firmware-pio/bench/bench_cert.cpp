@@ -0,0 +1,42 @@
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "credentials/korra_cert.h"
+
+/**
+ * Times `korra_cert_generate`, which runs on the device in the credentials task on first boot.
+ * Usage: bench_cert [iterations]
+ */
+int main(int argc, char **argv) {
+  const int iterations = argc > 1 ? atoi(argv[1]) : 20;
+  const char *devid = "keeper-bench-0001";
+
+  double total = 0, fastest = 0, slowest = 0;
+  size_t cert_len = 0, key_len = 0;
+  for (int i = 0; i < iterations; i++) {
+    uint8_t cert_der[1024], key_der[256];
+    size_t cert_der_len = sizeof(cert_der), key_der_len = sizeof(key_der);
+
+    auto started = std::chrono::steady_clock::now();
+    int ret = korra_cert_generate(devid, strlen(devid), "20241231235959", "20271231235959", cert_der, &cert_der_len,
+                                  key_der, &key_der_len);
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    if (ret != 0) {
+      fprintf(stderr, "Generation failed: -0x%04X\n", -ret);
+      return 1;
+    }
+
+    total += elapsed;
+    fastest = i == 0 || elapsed < fastest ? elapsed : fastest;
+    slowest = elapsed > slowest ? elapsed : slowest;
+    cert_len = cert_der_len;
+    key_len = key_der_len;
+  }
+
+  printf("korra_cert_generate: %d iterations, min %.2f ms, avg %.2f ms, max %.2f ms\n", iterations, fastest,
+         total / iterations, slowest);
+  printf("certificate %zu bytes, key %zu bytes (DER)\n", cert_len, key_len);
+  return 0;
+}
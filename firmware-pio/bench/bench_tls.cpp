@@ -0,0 +1,210 @@
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/platform.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+#include <psa/crypto.h>
+
+#include "credentials/korra_cert.h"
+#include "tls/korra_tls_profile.h"
+
+/**
+ * Compares the TLS profiles by running full handshakes against an in-memory server.
+ * Only the client side is timed and its allocations counted, which is what runs on the device.
+ * Usage: bench_tls [iterations]
+ */
+
+#define BENCH_HOST "bench.korra.local"
+
+// allocations made while `counting` is set are attributed to the client
+static bool counting = false;
+static size_t heap_current = 0, heap_peak = 0;
+
+struct allocation {
+  size_t size;
+  bool counted;
+  max_align_t align; // keeps the memory after the header aligned
+};
+
+static void *bench_calloc(size_t n, size_t size) {
+  struct allocation *a = (struct allocation *)calloc(1, sizeof(struct allocation) + n * size);
+  if (a == NULL) return NULL;
+  a->size = n * size;
+  a->counted = counting;
+  if (counting) {
+    heap_current += a->size;
+    if (heap_current > heap_peak) heap_peak = heap_current;
+  }
+  return &a->align;
+}
+
+static void bench_free(void *ptr) {
+  if (ptr == NULL) return;
+  struct allocation *a = (struct allocation *)((char *)ptr - offsetof(struct allocation, align));
+  if (a->counted) heap_current -= a->size;
+  free(a);
+}
+
+// one direction of the connection
+struct pipe {
+  std::vector<unsigned char> data;
+  size_t offset = 0;
+};
+
+struct endpoint {
+  pipe *in, *out;
+};
+
+static int bio_send(void *ctx, const unsigned char *buf, size_t len) {
+  pipe *out = ((endpoint *)ctx)->out;
+  out->data.insert(out->data.end(), buf, buf + len);
+  return len;
+}
+
+static int bio_recv(void *ctx, unsigned char *buf, size_t len) {
+  pipe *in = ((endpoint *)ctx)->in;
+  size_t available = in->data.size() - in->offset;
+  if (available == 0) return MBEDTLS_ERR_SSL_WANT_READ;
+  size_t n = len < available ? len : available;
+  memcpy(buf, in->data.data() + in->offset, n);
+  in->offset += n;
+  return n;
+}
+
+struct result {
+  double ms;
+  size_t heap_peak;
+  size_t bytes_sent, bytes_received;
+  const char *suite;
+};
+
+static int handshake(enum korra_tls_profile profile, mbedtls_x509_crt *cert, mbedtls_pk_context *key,
+                     mbedtls_ctr_drbg_context *ctr_drbg, struct result *dest) {
+  pipe to_server, to_client;
+  endpoint client_end = {&to_client, &to_server}, server_end = {&to_server, &to_client};
+  mbedtls_ssl_config client_conf, server_conf;
+  mbedtls_ssl_context client, server;
+  mbedtls_ssl_config_init(&server_conf);
+  mbedtls_ssl_init(&server);
+  int ret = mbedtls_ssl_config_defaults(&server_conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                        MBEDTLS_SSL_PRESET_DEFAULT);
+  mbedtls_ssl_conf_rng(&server_conf, mbedtls_ctr_drbg_random, ctr_drbg);
+  if (ret == 0) ret = mbedtls_ssl_conf_own_cert(&server_conf, cert, key);
+  if (ret == 0) ret = mbedtls_ssl_setup(&server, &server_conf);
+  mbedtls_ssl_set_bio(&server, &server_end, bio_send, bio_recv, NULL);
+
+  // the client is set up like KorraTlsClient::handshake() does
+  heap_current = heap_peak = 0;
+  counting = true;
+  auto started = std::chrono::steady_clock::now();
+  mbedtls_ssl_config_init(&client_conf);
+  mbedtls_ssl_init(&client);
+  if (ret == 0) {
+    ret = mbedtls_ssl_config_defaults(&client_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                      MBEDTLS_SSL_PRESET_DEFAULT);
+  }
+  mbedtls_ssl_conf_rng(&client_conf, mbedtls_ctr_drbg_random, ctr_drbg);
+  mbedtls_ssl_conf_max_tls_version(&client_conf, MBEDTLS_SSL_VERSION_TLS1_2); // TLS 1.3 is off in ESP-IDF by default
+  if (ret == 0) ret = korra_tls_profile_apply(&client_conf, profile);
+  mbedtls_ssl_conf_ca_chain(&client_conf, cert, NULL);
+  mbedtls_ssl_conf_authmode(&client_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  if (ret == 0) ret = mbedtls_ssl_setup(&client, &client_conf);
+  if (ret == 0) ret = mbedtls_ssl_set_hostname(&client, BENCH_HOST);
+  mbedtls_ssl_set_bio(&client, &client_end, bio_send, bio_recv, NULL);
+  counting = false;
+  double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+  // take turns until both sides are done, only the client turns are timed and counted
+  bool client_done = false, server_done = false;
+  while (ret == 0 && !(client_done && server_done)) {
+    if (!client_done) {
+      counting = true;
+      started = std::chrono::steady_clock::now();
+      int r = mbedtls_ssl_handshake(&client);
+      elapsed += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+      counting = false;
+      if (r == 0) client_done = true;
+      else if (r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE) ret = r;
+    }
+    if (ret == 0 && !server_done) {
+      int r = mbedtls_ssl_handshake(&server);
+      if (r == 0) server_done = true;
+      else if (r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE) ret = r;
+    }
+  }
+
+  if (ret == 0) {
+    dest->ms = elapsed;
+    dest->heap_peak = heap_peak;
+    dest->bytes_sent = to_server.data.size();
+    dest->bytes_received = to_client.data.size();
+    dest->suite = mbedtls_ssl_get_ciphersuite(&client);
+  }
+
+  counting = true; // so that the client frees are matched
+  mbedtls_ssl_free(&client);
+  mbedtls_ssl_config_free(&client_conf);
+  counting = false;
+  mbedtls_ssl_free(&server);
+  mbedtls_ssl_config_free(&server_conf);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  const int iterations = argc > 1 ? atoi(argv[1]) : 50;
+  mbedtls_platform_set_calloc_free(bench_calloc, bench_free);
+  psa_crypto_init();
+
+  // the server presents a self-signed certificate which the client trusts directly
+  uint8_t cert_der[1024], key_der[256];
+  size_t cert_der_len = sizeof(cert_der), key_der_len = sizeof(key_der);
+  int ret = korra_cert_generate(BENCH_HOST, strlen(BENCH_HOST), "20241231235959", "20991231235959", cert_der,
+                                &cert_der_len, key_der, &key_der_len);
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context ctr_drbg;
+  mbedtls_x509_crt cert;
+  mbedtls_pk_context key;
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&ctr_drbg);
+  mbedtls_x509_crt_init(&cert);
+  mbedtls_pk_init(&key);
+  if (ret == 0) ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0);
+  if (ret == 0) ret = mbedtls_x509_crt_parse_der(&cert, cert_der, cert_der_len);
+  if (ret == 0) ret = mbedtls_pk_parse_key(&key, key_der, key_der_len, NULL, 0, mbedtls_ctr_drbg_random, &ctr_drbg);
+  if (ret != 0) {
+    fprintf(stderr, "Setup failed: -0x%04X\n", -ret);
+    return 1;
+  }
+
+  const enum korra_tls_profile profiles[] = {KORRA_TLS_PROFILE_DEFAULT, KORRA_TLS_PROFILE_LOW_MEMORY};
+  const char *names[] = {"default", "low_memory"};
+  for (int p = 0; p < 2; p++) {
+    double total = 0;
+    size_t peak = 0;
+    struct result last = {0};
+    for (int i = 0; i < iterations; i++) {
+      ret = handshake(profiles[p], &cert, &key, &ctr_drbg, &last);
+      if (ret != 0) {
+        fprintf(stderr, "Handshake with the %s profile failed: -0x%04X\n", names[p], -ret);
+        return 1;
+      }
+      total += last.ms;
+      if (last.heap_peak > peak) peak = last.heap_peak;
+    }
+    printf("%-10s: %d handshakes, avg %.2f ms, heap peak %zu bytes, sent %zu bytes, received %zu bytes, %s\n",
+           names[p], iterations, total / iterations, peak, last.bytes_sent, last.bytes_received, last.suite);
+  }
+
+  mbedtls_pk_free(&key);
+  mbedtls_x509_crt_free(&cert);
+  mbedtls_ctr_drbg_free(&ctr_drbg);
+  mbedtls_entropy_free(&entropy);
+  return 0;
+}
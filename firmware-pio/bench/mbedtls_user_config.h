@@ -0,0 +1,7 @@
+#ifndef KORRA_BENCH_MBEDTLS_USER_CONFIG_H
+#define KORRA_BENCH_MBEDTLS_USER_CONFIG_H
+
+// allocations go through mbedtls_platform_set_calloc_free so that bench_tls can measure the heap used
+#define MBEDTLS_PLATFORM_MEMORY
+
+#endif // KORRA_BENCH_MBEDTLS_USER_CONFIG_H
@@ -0,0 +1,102 @@
+import base64
+import os
+import re
+
+CERT_FILES = [
+  "firmware-pio/src/credentials/ca_azure.cer",
+  "firmware-pio/src/credentials/user_trust_ecc.cer",
+  "firmware-pio/src/credentials/user_trust_rsa.cer",
+]
+OTA_SIGNING_KEY_FILE = "firmware-pio/src/credentials/ota_signing_key.pem"
+
+def read_certs(path):
+  # The files are C string literals of PEM certificates each preceded by a comment with the name
+  # e.g. /* Baltimore CyberTrust Root */ followed by "-----BEGIN CERTIFICATE-----\r\n" ...
+  certs = []
+  name = None
+  body = None
+  with open(path, "r") as f:
+    for line in f:
+      line = line.strip()
+      comment = re.match(r"^/\*\s*(.*?)\s*\*/$", line)
+      if comment:
+        name = comment.group(1)
+        continue
+      literal = re.match(r'^"(.*)"$', line)
+      if not literal:
+        continue
+      text = literal.group(1).replace("\\r", "").replace("\\n", "")
+      if text == "-----BEGIN CERTIFICATE-----":
+        body = ""
+      elif text == "-----END CERTIFICATE-----":
+        certs.append((name or "Unnamed", base64.b64decode(body)))
+        name = None
+        body = None
+      elif body is not None:
+        body += text
+  return certs
+
+def to_identifier(name):
+  return "ca_cert_" + re.sub(r"[^a-z0-9]+", "_", name.lower()).strip("_")
+
+def write_certs_header(certs, output_path="firmware-pio/include/ca_certs.h"):
+  os.makedirs(os.path.dirname(output_path), exist_ok=True)
+
+  with open(output_path, "w") as f:
+    f.write("// Auto-generated file, do not edit\n\n")
+    f.write("#ifndef _CA_CERTS_H_\n")
+    f.write("#define _CA_CERTS_H_\n\n")
+    f.write("#include <stdint.h>\n\n")
+
+    for name, der in certs:
+      f.write(f"/* {name} ({len(der)} bytes) */\n")
+      f.write(f"static const uint8_t {to_identifier(name)}[] = {{\n")
+      for i in range(0, len(der), 16):
+        f.write("  " + ", ".join(f"0x{b:02x}" for b in der[i:i + 16]) + ",\n")
+      f.write("};\n\n")
+
+    f.write(f"#define CA_CERTS_COUNT {len(certs)}\n\n")
+    f.write("// Entries in the form {data, length}\n")
+    f.write("#define CA_CERTS_LIST \\\n")
+    f.write(", \\\n".join(f"  {{{to_identifier(name)}, sizeof({to_identifier(name)})}}" for name, _ in certs))
+    f.write("\n\n")
+
+    f.write("#endif // _CA_CERTS_H_\n")
+
+def write_signing_key_header(path=OTA_SIGNING_KEY_FILE, output_path="firmware-pio/include/ota_signing_key.h"):
+  # The key is the PEM encoded public part of the ECDSA P-256 key that signs firmware images (see scripts/firmware.ts).
+  # Without it, the device refuses every image so release builds (tags) fail here instead of shipping such firmware.
+  if not os.path.exists(path) and os.environ.get("GITHUB_REF", "").startswith("refs/tags/"):
+    raise Exception(f"{path} is required for release builds")
+
+  os.makedirs(os.path.dirname(output_path), exist_ok=True)
+
+  with open(output_path, "w") as f:
+    f.write("// Auto-generated file, do not edit\n\n")
+    f.write("#ifndef _OTA_SIGNING_KEY_H_\n")
+    f.write("#define _OTA_SIGNING_KEY_H_\n\n")
+    f.write("#include <stdint.h>\n\n")
+
+    if os.path.exists(path):
+      with open(path, "r") as k:
+        body = "".join(line.strip() for line in k if not line.startswith("-----"))
+      der = base64.b64decode(body)
+      f.write(f"/* OTA signing key ({len(der)} bytes) */\n")
+      f.write("static const uint8_t ota_signing_key[] = {\n")
+      for i in range(0, len(der), 16):
+        f.write("  " + ", ".join(f"0x{b:02x}" for b in der[i:i + 16]) + ",\n")
+      f.write("};\n\n")
+      f.write("#define OTA_SIGNING_KEY ota_signing_key\n\n")
+    else:
+      f.write(f"// {path} does not exist, firmware updates are refused\n\n")
+
+    f.write("#endif // _OTA_SIGNING_KEY_H_\n")
+  return os.path.exists(path)
+
+certs = []
+for path in CERT_FILES:
+  certs += read_certs(path)
+write_certs_header(certs)
+print(f"Generated firmware-pio/include/ca_certs.h with {len(certs)} certificates")
+signed = write_signing_key_header()
+print(f"Generated firmware-pio/include/ota_signing_key.h {'with' if signed else 'without'} a signing key")
@@ -6,6 +6,7 @@ import { existsSync } from 'node:fs';
 import { copyFile, mkdir, readFile, rm, writeFile } from 'node:fs/promises';
 import { join } from 'node:path';
 import process from 'node:process';
+import zlib from 'node:zlib';
 import * as semver from 'semver';
 
 import packageJson from '../package.json' with { type: 'json' };
@@ -22,6 +23,9 @@ const KNOWN_ENVIRONMENTS = [
   // 'espidf-pot-esp32s3_devkitc',
 ];
 
+// bytes per ranged request suggested to devices, matches KORRA_OTA_CHUNK_SIZE_DEFAULT in korra_ota.h
+const MANIFEST_CHUNK_SIZE = 64 * 1024;
+
 const version = new Command('version')
   .description('Generate VERSION file for PlatformIO.')
   .option('--dev', 'Whether in dev mode.')
@@ -48,14 +52,22 @@ const collect = new Command('collect')
       .choices(KNOWN_ENVIRONMENTS)
       .default(KNOWN_ENVIRONMENTS),
   )
+  .addOption(new Option('--base <directory>', 'Binaries of the previous release to make delta images against.'))
   .action(async (...args) => {
     const [options /*, command*/] = args;
-    const { environment: environments } = options;
+    const { environment: environments, base } = options;
     console.log(`📦 Collecting build artifacts ...`);
     const outputDir = 'binaries';
     if (existsSync(outputDir)) await rm(outputDir, { recursive: true });
     await mkdir(outputDir, { recursive: true });
 
+    // deltas only apply on the version they are made against, avail publishes it with them
+    const baseVersionSrc = base ? join(base, 'version.txt') : undefined;
+    const baseVersion =
+      baseVersionSrc && existsSync(baseVersionSrc) ? (await readFile(baseVersionSrc, 'utf-8')).trim() : undefined;
+    if (base && !baseVersion) console.log(`⚠️ No version.txt in ${base}, delta images are skipped`);
+    if (baseVersion) await writeFile(join(outputDir, 'base-version.txt'), `${baseVersion}\n`, 'utf-8');
+
     for (const environment of environments) {
       const buildDir = `.pio//build/${environment}`;
       const binSrc = join(buildDir, 'firmware.bin');
@@ -68,11 +80,95 @@ const collect = new Command('collect')
 
       console.log(`🔹 Copying ${elfSrc} → ${elfDest}`);
       await copyFile(elfSrc, elfDest);
+
+      const image = await readFile(binSrc);
+      const zlibDest = join(outputDir, `${environment}.zlib`);
+      const compressed = zlib.deflateSync(image, { level: zlib.constants.Z_BEST_COMPRESSION });
+      console.log(`🔹 Compressing ${binSrc} → ${zlibDest} (${image.length} → ${compressed.length} bytes)`);
+      await writeFile(zlibDest, compressed);
+
+      const baseSrc = baseVersion ? join(base, `${environment}.bin`) : undefined;
+      if (baseSrc && existsSync(baseSrc)) {
+        const deltaDest = join(outputDir, `${environment}.delta`);
+        const delta = createDelta(await readFile(baseSrc), image);
+        console.log(`🔹 Diffing ${baseSrc} → ${deltaDest} (${image.length} → ${delta.length} bytes)`);
+        await writeFile(deltaDest, delta);
+      }
+
+      // the device fetches this before the image, conditionally, so it stays small
+      const manifestDest = join(outputDir, `${environment}.json`);
+      const manifest = {
+        version: { value: getAppVersionNumber(packageJson.version), semver: packageJson.version },
+        size: image.length,
+        hash: crypto.createHash('sha256').update(image).digest('hex'),
+        chunk_size: MANIFEST_CHUNK_SIZE,
+      };
+      console.log(`🔹 Describing ${binSrc} → ${manifestDest}`);
+      await writeFile(manifestDest, JSON.stringify(manifest, null, 2), 'utf-8');
     }
 
     console.log(`✅ Done collecting binaries in ${outputDir}/`);
   });
 
+/**
+ * Create a delta image that rebuilds `target` from `base` on the device (see `korra_ota.cpp`).
+ * It is zlib compressed operations, each a code followed by little-endian 32-bit numbers:
+ * 'A' {length} {bytes} adds bytes and 'C' {length} {offset} copies a range of the base.
+ */
+function createDelta(base: Buffer, target: Buffer, blockSize = 32) {
+  // index the blocks of the base by content, matches are then extended either way byte by byte
+  const index = new Map<string, number>();
+  for (let i = 0; i + blockSize <= base.length; i += blockSize) {
+    const key = base.toString('latin1', i, i + blockSize);
+    if (!index.has(key)) index.set(key, i);
+  }
+
+  const operations: Buffer[] = [];
+  const add = (bytes: Buffer) => {
+    const header = Buffer.alloc(5);
+    header.write('A', 0, 'latin1');
+    header.writeUInt32LE(bytes.length, 1);
+    operations.push(header, bytes);
+  };
+  const copy = (length: number, offset: number) => {
+    const header = Buffer.alloc(9);
+    header.write('C', 0, 'latin1');
+    header.writeUInt32LE(length, 1);
+    header.writeUInt32LE(offset, 5);
+    operations.push(header);
+  };
+
+  let pending = 0; // start of the bytes not yet covered by an operation
+  let i = 0;
+  while (i + blockSize <= target.length) {
+    const found = index.get(target.toString('latin1', i, i + blockSize));
+    if (found === undefined) {
+      i++;
+      continue;
+    }
+
+    let start = i;
+    let from = found;
+    while (start > pending && from > 0 && target[start - 1] === base[from - 1]) {
+      start--;
+      from--;
+    }
+    let end = i + blockSize;
+    let to = found + blockSize;
+    while (end < target.length && to < base.length && target[end] === base[to]) {
+      end++;
+      to++;
+    }
+
+    if (start > pending) add(target.subarray(pending, start));
+    copy(end - start, from);
+    i = pending = end;
+  }
+  if (pending < target.length) add(target.subarray(pending));
+
+  return zlib.deflateSync(Buffer.concat(operations), { level: zlib.constants.Z_BEST_COMPRESSION });
+}
+
 function getAppVersionNumber(value: string) {
   // we need to generate the same value as APP_VERSION_NUMBER in version.h generated by version.py
   const version = semver.parse(value);
@@ -83,12 +179,20 @@ function getAppVersionNumber(value: string) {
   return v;
 }
 
+type FirmwareImage = { format: 'raw' | 'zlib' | 'delta'; url: string; base?: { value: number; semver: string } };
+
 const avail = new Command('avail')
   .description('Avail firmware to backend.')
   .addOption(new Option('--endpoint <endpoint>', 'The base URL to send requests.').default('http://localhost:3000'))
   .addOption(new Option('--key, --api-key <api-key>', 'The api key for authentication.').makeOptionMandatory())
   .addOption(new Option('--attestation <attestation>', 'Attestation URL').makeOptionMandatory())
   .addOption(new Option('--tag <tag>', 'The release tag.').makeOptionMandatory())
+  .addOption(
+    // devices refuse images without a valid signature, so availing them unsigned would only fail later on each device
+    new Option('--signing-key <signing-key>', 'PEM encoded ECDSA P-256 private key for signing.')
+      .env('FIRMWARE_SIGNING_KEY')
+      .makeOptionMandatory(),
+  )
   .addOption(
     new Option('--environment [environment...]', 'The target(s) for which to avail.')
       .choices(KNOWN_ENVIRONMENTS)
@@ -96,7 +200,7 @@ const avail = new Command('avail')
   )
   .action(async (...args) => {
     const [options /*, command*/] = args;
-    const { endpoint, apiKey, tag, attestation, environment: environments } = options;
+    const { endpoint, apiKey, tag, attestation, signingKey, environment: environments } = options;
     console.log(`📦 Availing firmware ...`);
 
     // ensure the output directory exists, this is where the collected binaries are
@@ -113,6 +217,10 @@ const avail = new Command('avail')
     }
     const versionValue = getAppVersionNumber(versionSemver);
 
+    // written by collect when delta images were made against the previous release
+    const baseVersionPath = join(outputDir, 'base-version.txt');
+    const baseSemver = existsSync(baseVersionPath) ? (await readFile(baseVersionPath, 'utf-8')).trim() : undefined;
+
     for (const environment of environments) {
       const fileName = `${environment}.bin`;
       const filePath = join(outputDir, fileName);
@@ -124,8 +232,23 @@ const avail = new Command('avail')
       const buffer = await readFile(filePath);
       const hash = crypto.createHash('sha256').update(buffer).digest('hex');
 
+      // sign the same hash, r and s concatenated (64 bytes) in hex is what the firmware checks against its public key
+      const signature = crypto.sign('sha256', buffer, { key: signingKey, dsaEncoding: 'ieee-p1363' }).toString('hex');
+
       // e.g. https://github.com/mburumaxwell/korra/releases/download/firmware-pio%400.4.0/arduino-keeper-esp32s3_devkitc.bin
       const url = `https://github.com/mburumaxwell/korra/releases/download/${encodeURIComponent(tag)}/${fileName}`;
+      const manifest = `https://github.com/mburumaxwell/korra/releases/download/${encodeURIComponent(tag)}/${environment}.json`;
+
+      // the same image in the other formats the twin can select (format and base), the hash and signature are of the
+      // raw image in all of them
+      const images: FirmwareImage[] = [{ format: 'raw', url }];
+      if (existsSync(join(outputDir, `${environment}.zlib`))) {
+        images.push({ format: 'zlib', url: url.replace(/\.bin$/, '.zlib') });
+      }
+      if (baseSemver && existsSync(join(outputDir, `${environment}.delta`))) {
+        const base = { value: getAppVersionNumber(baseSemver), semver: baseSemver };
+        images.push({ format: 'delta', url: url.replace(/\.bin$/, '.delta'), base });
+      }
 
       const [framework, usage, board] = environment.split('-');
       const payload = {
@@ -134,9 +257,11 @@ const avail = new Command('avail')
         framework,
         version: { value: versionValue, semver: versionSemver },
         url,
+        images,
+        manifest,
         attestation,
         hash,
-        signature: 'tbd', // TODO: pull signature from attestation URL
+        signature,
       };
 
       console.log(
@@ -1,6 +1,7 @@
 #include <Arduino.h>
 
 #include "korra_actuator.h"
+#include "metrics/korra_metrics.h"
 
 #ifdef CONFIG_APP_KIND_KEEPER
 #define TARGET_UNIT_STR "moisture (%%)"
@@ -64,10 +65,12 @@ void KorraActuator::maintain() {
       struct korra_actuation actuation = {.timestamp = time(NULL), .duration = duration};
       Serial.printf("Actuating for %d sec, targeting %.2f " TARGET_UNIT_STR ", currently %.2f\n", duration,
                     current_config.target, current_value);
+      if (actuating_callback) actuating_callback(duration);
       actuate(duration);
       timepoint = millis(); // reset the timepoint (must be done after actuation)
       current_value_consumed = true;
       Serial.println(F("Actuation completed"));
+      KorraMetrics::increment(KORRA_METRICS_COUNTER_ACTUATIONS);
 
       // Record actuation
       if (actuated_callback) {
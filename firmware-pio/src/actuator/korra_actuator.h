@@ -72,6 +72,13 @@ public:
    */
   void set_config(const struct korra_actuator_config *value);
 
+  /**
+   * Registers callback that will be called each time the actuator is about to be switched on.
+   *
+   * @param callback
+   */
+  inline void onActuating(void (*callback)(uint16_t duration)) { actuating_callback = callback; }
+
   /**
    * Registers callback that will be called each time actuation happens.
    *
@@ -88,6 +95,7 @@ public:
 
 private:
   struct korra_actuator_config current_config = {0};
+  void (*actuating_callback)(uint16_t duration) = NULL;
   void (*actuated_callback)(const struct korra_actuation *value) = NULL;
 
   unsigned long timepoint = 0;
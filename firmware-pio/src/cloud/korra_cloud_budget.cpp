@@ -0,0 +1,86 @@
+#include <Arduino.h>
+
+#include "korra_cloud_budget.h"
+#include "metrics/korra_metrics.h"
+
+#define SECONDS_PER_DAY 86400
+
+// share of the budget kept for the twin, direct methods and metrics
+#define BUDGET_RESERVE_PERCENT 10
+
+// anything earlier means the clock has not been set yet (2024-01-01T00:00:00Z)
+#define BUDGET_MIN_VALID_TIME 1704067200
+
+#define BUDGET_RTC_MAGIC 0x4b425544 // KBUD
+
+// RTC memory is not cleared on restart (only on power loss), the daily reboot would otherwise reset the counts
+struct budget_rtc {
+  uint32_t magic;
+  uint32_t day; // days since the epoch (UTC)
+  uint32_t messages;
+  uint32_t chunks;
+};
+RTC_NOINIT_ATTR static struct budget_rtc state;
+
+void KorraCloudBudget::set_config(const struct korra_cloud_budget_config *config) {
+  roll();
+  daily_limit = config->daily_messages ? config->daily_messages : CONFIG_HUB_DAILY_MESSAGES;
+  report();
+}
+
+void KorraCloudBudget::record(size_t size) {
+  roll();
+  state.messages++;
+  state.chunks += chunks(size);
+  report();
+}
+
+uint8_t KorraCloudBudget::batch_size(uint32_t period_sec, uint8_t max) {
+  roll();
+  uint8_t size = 1;
+  time_t now = time(NULL);
+  if (daily_limit && now >= BUDGET_MIN_VALID_TIME) {
+    // readings still to come today against the chunks left for them
+    uint32_t readings = (SECONDS_PER_DAY - (now % SECONDS_PER_DAY)) / MAX(period_sec, 1) + 1;
+    uint32_t reserve = daily_limit * BUDGET_RESERVE_PERCENT / 100;
+    uint32_t spent = state.chunks + reserve;
+    uint32_t available = spent < daily_limit ? daily_limit - spent : 0;
+    size = available ? CLAMP((readings + available - 1) / available, 1, max) : max;
+  }
+
+  KorraMetrics::set(KORRA_METRICS_GAUGE_BUDGET_BATCH, size);
+  return size;
+}
+
+bool KorraCloudBudget::exhausted() {
+  roll();
+  return daily_limit && state.chunks >= daily_limit;
+}
+
+void KorraCloudBudget::roll() {
+  // until the clock is set, count into a placeholder day which becomes the actual day once it is known
+  time_t now = time(NULL);
+  uint32_t day = now < BUDGET_MIN_VALID_TIME ? 0 : now / SECONDS_PER_DAY;
+  if (state.magic == BUDGET_RTC_MAGIC && (state.day == day || day == 0)) return;
+  if (state.magic == BUDGET_RTC_MAGIC && state.day == 0) {
+    // what was sent before the clock was set (e.g. right after boot) is charged to the first actual day
+    state.day = day;
+    return;
+  }
+
+  if (state.magic == BUDGET_RTC_MAGIC && state.day != 0) {
+    Serial.printf("Budget: day %lu used %lu messages (%lu chunks) of %lu\n", (unsigned long)state.day,
+                  (unsigned long)state.messages, (unsigned long)state.chunks, (unsigned long)daily_limit);
+  }
+  state.magic = BUDGET_RTC_MAGIC;
+  state.day = day;
+  state.messages = 0;
+  state.chunks = 0;
+  report();
+}
+
+void KorraCloudBudget::report() {
+  KorraMetrics::set(KORRA_METRICS_GAUGE_BUDGET_DAILY, daily_limit);
+  KorraMetrics::set(KORRA_METRICS_GAUGE_BUDGET_MESSAGES, state.messages);
+  KorraMetrics::set(KORRA_METRICS_GAUGE_BUDGET_CHUNKS, state.chunks);
+}
@@ -0,0 +1,66 @@
+#ifndef KORRA_CLOUD_BUDGET_H_
+#define KORRA_CLOUD_BUDGET_H_
+
+#include "korra_config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** IoT Hub meters messages in chunks of this size, a 5 KB message costs two. */
+#define KORRA_CLOUD_BUDGET_CHUNK_SIZE 4096
+
+struct korra_cloud_budget_config {
+  uint32_t daily_messages; // chunks allowed per UTC day, zero for no limit
+};
+
+/**
+ * This class tracks the messages (and billing chunks) sent to the hub per UTC day against a daily budget.
+ * Telemetry uses it to decide how many readings to pack into one message so that the budget lasts the whole day.
+ * The counts are kept in RTC memory so that they survive a restart.
+ */
+class KorraCloudBudget {
+public:
+  /**
+   * Set the budget.
+   *
+   * @param config The budget, a zero `daily_messages` uses the default (`CONFIG_HUB_DAILY_MESSAGES`).
+   */
+  void set_config(const struct korra_cloud_budget_config *config);
+
+  /**
+   * Record a message sent to the hub.
+   *
+   * @param size The size of the message (topic and payload).
+   */
+  void record(size_t size);
+
+  /**
+   * Get how many readings to pack into one telemetry message.
+   * This is one until the budget is being spent faster than it can last the rest of the day.
+   *
+   * @param period_sec Seconds between readings.
+   * @param max Most readings that fit in one message.
+   */
+  uint8_t batch_size(uint32_t period_sec, uint8_t max);
+
+  /**
+   * Check if the budget for the day has been used up. Telemetry should be held until the next day.
+   */
+  bool exhausted();
+
+  /**
+   * Get the number of chunks that make up a message.
+   */
+  inline static uint32_t chunks(size_t size) {
+    return MAX(1, (size + KORRA_CLOUD_BUDGET_CHUNK_SIZE - 1) / KORRA_CLOUD_BUDGET_CHUNK_SIZE);
+  }
+
+private:
+  uint32_t daily_limit = CONFIG_HUB_DAILY_MESSAGES;
+
+private:
+  void roll();
+  void report();
+};
+
+#endif // KORRA_CLOUD_BUDGET_H_
@@ -0,0 +1,44 @@
+#include <Arduino.h>
+
+#include "korra_cloud_commands.h"
+
+KorraCloudCommands::~KorraCloudCommands() {
+  while (count > 0) pop();
+}
+
+bool KorraCloudCommands::enqueue(const char *name, const char *message_id, const char *payload, size_t payload_len) {
+  if (count >= KORRA_CLOUD_COMMANDS_MAX) {
+    Serial.printf("Command queue is full, unable to queue '%s' (mid: %s)\n", name, message_id);
+    return false;
+  }
+
+  char *copy = (char *)malloc(payload_len + 1);
+  if (copy == NULL) {
+    Serial.printf("Unable to allocate %d bytes for command '%s'\n", (int)(payload_len + 1), name);
+    return false;
+  }
+  memcpy(copy, payload, payload_len);
+  copy[payload_len] = '\0';
+
+  struct korra_cloud_command *command = &(commands[(head + count) % KORRA_CLOUD_COMMANDS_MAX]);
+  snprintf(command->name, sizeof(command->name), "%s", name);
+  snprintf(command->message_id, sizeof(command->message_id), "%s", message_id);
+  command->payload = copy;
+  command->payload_len = payload_len;
+  count++;
+  return true;
+}
+
+struct korra_cloud_command *KorraCloudCommands::peek() {
+  return count > 0 ? &(commands[head]) : NULL;
+}
+
+void KorraCloudCommands::pop() {
+  if (count == 0) return;
+
+  struct korra_cloud_command *command = &(commands[head]);
+  free(command->payload);
+  memset(command, 0, sizeof(struct korra_cloud_command));
+  head = (head + 1) % KORRA_CLOUD_COMMANDS_MAX;
+  count--;
+}
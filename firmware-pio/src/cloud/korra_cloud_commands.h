@@ -0,0 +1,65 @@
+#ifndef KORRA_CLOUD_COMMANDS_H_
+#define KORRA_CLOUD_COMMANDS_H_
+
+#include "korra_config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Most commands waiting to be executed, more are rejected. */
+#define KORRA_CLOUD_COMMANDS_MAX 8
+
+struct korra_cloud_command {
+  /** The name of the command (e.g. set_actuator). */
+  char name[32 + 1];
+
+  /** The id of the cloud-to-device message ($.mid), used to acknowledge it. */
+  char message_id[64 + 1];
+
+  /** The payload (JSON), NULL terminated. */
+  char *payload;
+
+  /** The length of the payload. */
+  size_t payload_len;
+};
+
+/**
+ * This class holds commands received as cloud-to-device messages until they are executed.
+ * The hub keeps cloud-to-device messages for a device that is offline, so they arrive together on reconnect
+ * and are executed one after the other outside of the MQTT callback.
+ */
+class KorraCloudCommands {
+public:
+  /**
+   * Cleanup resources created and managed by the KorraCloudCommands class.
+   */
+  ~KorraCloudCommands();
+
+  /**
+   * Add a command to the end of the queue. The payload is copied.
+   *
+   * @return `true` if queued, `false` if the queue is full or memory could not be allocated.
+   */
+  bool enqueue(const char *name, const char *message_id, const char *payload, size_t payload_len);
+
+  /**
+   * Get the oldest command, `NULL` if there is none.
+   */
+  struct korra_cloud_command *peek();
+
+  /**
+   * Remove the oldest command.
+   */
+  void pop();
+
+  /**
+   * Get the number of commands queued.
+   */
+  inline size_t length() { return count; }
+
+private:
+  struct korra_cloud_command commands[KORRA_CLOUD_COMMANDS_MAX] = {0};
+  size_t head = 0, count = 0;
+};
+
+#endif // KORRA_CLOUD_COMMANDS_H_
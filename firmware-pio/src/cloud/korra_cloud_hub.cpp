@@ -1,3 +1,5 @@
+#include <esp_rom_crc.h>
+
 #include "korra_cloud_hub.h"
 
 // Username format -> {iotHub-hostname}/{device_id}/api-version=2021-04-12
@@ -26,14 +28,112 @@
 #define TOPIC_TWIN_PATCH_DESIRED_PREFIX "$iothub/twin/PATCH/properties/desired/"
 #define TOPIC_TWIN_PATCH_DESIRED_FILTER TOPIC_TWIN_PATCH_DESIRED_PREFIX "#"
 
+// Time the caller of a direct method can wait for the response (the hub allows at most 300 seconds)
+#define DIRECT_METHOD_TIMEOUT_MS (300 * 1000)
+
+// Most messages published from the outbox per call to maintain(), keeps the main loop responsive
+#define OUTBOX_FLUSH_MAX_MESSAGES 4
+// Attempts to publish a message before it is dropped
+#define OUTBOX_MAX_ATTEMPTS 3
+
+// Milliseconds over which updates to the reported properties are coalesced into one patch
+#define REPORTED_COALESCE_MS 2000
+
+// Most readings packed into one telemetry message
+#define BATCH_MAX_READINGS 32
+#ifndef CONFIG_HUB_BATCH_MAX_AGE_SEC
+#define CONFIG_HUB_BATCH_MAX_AGE_SEC (15 * 60) // a batch is sent once its first reading is this old, even if not full
+#endif
+// Largest payload for a batch, just under one billing chunk leaving room for the topic and properties
+#define BATCH_MAX_PAYLOAD (KORRA_CLOUD_BUDGET_CHUNK_SIZE - 256)
+
 KorraCloudHub *KorraCloudHub::_instance = NULL;
 
-static void on_mqtt_message_callback(int size) {
-  KorraCloudHub::instance()->on_mqtt_message(size);
+// responses to direct methods may come from other tasks
+static portMUX_TYPE pending_methods_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *boot_phase_key(uint8_t index) {
+  return KorraBoot::name((enum korra_boot_phase)index);
+}
+
+// Reported properties, adding one to the twin only takes a row here
+#define REPORTED_FIELD(type, member, ...) KORRA_TWIN_FIELD(struct korra_device_twin_reported, type, member, __VA_ARGS__)
+static const struct korra_twin_field reported_fields[] = {
+    REPORTED_FIELD(UINT32, firmware.version.value, "firmware", "version", "value"),
+    REPORTED_FIELD(STRING, firmware.version.semver, "firmware", "version", "semver"),
+    REPORTED_FIELD(STRING, firmware.ota.status, "firmware", "ota", "status"),
+    REPORTED_FIELD(UINT32, firmware.ota.bytes, "firmware", "ota", "bytes"),
+    REPORTED_FIELD(UINT32, firmware.ota.total, "firmware", "ota", "total"),
+    REPORTED_FIELD(UINT32, firmware.ota.rate, "firmware", "ota", "rate"),
+    REPORTED_FIELD(UINT32, firmware.ota.eta, "firmware", "ota", "eta"),
+    REPORTED_FIELD(STRING, network.kind, "network", "kind"),
+    REPORTED_FIELD(STRING, network.mac, "network", "mac"),
+    REPORTED_FIELD(STRING, network.name, "network", "name"),
+    REPORTED_FIELD(STRING, network.local_ip, "network", "local_ip"),
+    KORRA_TWIN_FIELD_ARRAY(struct korra_device_twin_reported, boot.phases, boot_phase_key, "boot"),
+    REPORTED_FIELD(UINT32, sampling.sensors, "sampling", "sensors"),
+    REPORTED_FIELD(UINT32, sampling.twin, "sampling", "twin"),
+    REPORTED_FIELD(UINT32, sampling.metrics, "sampling", "metrics"),
+};
+#define REPORTED_FIELDS_COUNT (sizeof(reported_fields) / sizeof(reported_fields[0]))
+
+// Desired properties, missing members are left as they are
+#define DESIRED_FIELD(type, member, ...) KORRA_TWIN_FIELD(struct korra_device_twin_desired, type, member, __VA_ARGS__)
+static const struct korra_twin_field desired_fields[] = {
+    DESIRED_FIELD(UINT32, firmware.version.value, "firmware", "version", "value"),
+    DESIRED_FIELD(STRING, firmware.version.semver, "firmware", "version", "semver"),
+    DESIRED_FIELD(STRING, firmware.url, "firmware", "url"),
+    DESIRED_FIELD(STRING, firmware.manifest, "firmware", "manifest"),
+    DESIRED_FIELD(STRING, firmware.hash, "firmware", "hash"),
+    DESIRED_FIELD(STRING, firmware.signature, "firmware", "signature"),
+    DESIRED_FIELD(UINT32, firmware.chunk_size, "firmware", "chunk_size"),
+    DESIRED_FIELD(STRING, firmware.format, "firmware", "format"),
+    DESIRED_FIELD(UINT32, firmware.base, "firmware", "base"),
+    DESIRED_FIELD(UINT32, firmware.schedule.max_rate, "firmware", "schedule", "max_rate"),
+    DESIRED_FIELD(UINT16, firmware.schedule.window_start, "firmware", "schedule", "window_start"),
+    DESIRED_FIELD(UINT16, firmware.schedule.window_end, "firmware", "schedule", "window_end"),
+    DESIRED_FIELD(BOOL, actuator.enabled, "actuator", "enabled"),
+    DESIRED_FIELD(UINT16, actuator.duration, "actuator", "duration"),
+    DESIRED_FIELD(UINT16, actuator.equilibrium_time, "actuator", "equilibrium_time"),
+    DESIRED_FIELD(FLOAT, actuator.target, "actuator", "target"),
+    DESIRED_FIELD(UINT32, budget.daily_messages, "budget", "daily_messages"),
+    DESIRED_FIELD(UINT32, sampling.sensors, "sampling", "sensors"),
+    DESIRED_FIELD(UINT32, sampling.twin, "sampling", "twin"),
+    DESIRED_FIELD(UINT32, sampling.metrics, "sampling", "metrics"),
+};
+#define DESIRED_FIELDS_COUNT (sizeof(desired_fields) / sizeof(desired_fields[0]))
+
+// Sections of the desired properties, compared as a whole to find which subsystems need updating
+struct desired_section {
+  uint8_t flag; // enum korra_device_twin_section
+  size_t offset;
+  size_t size;
+};
+#define DESIRED_SECTION(flag, member)                                                                                  \
+  {flag, offsetof(struct korra_device_twin_desired, member), sizeof(((struct korra_device_twin_desired *)0)->member)}
+static const struct desired_section desired_sections[] = {
+    DESIRED_SECTION(KORRA_DEVICE_TWIN_SECTION_FIRMWARE, firmware),
+    DESIRED_SECTION(KORRA_DEVICE_TWIN_SECTION_ACTUATOR, actuator),
+    DESIRED_SECTION(KORRA_DEVICE_TWIN_SECTION_BUDGET, budget),
+    DESIRED_SECTION(KORRA_DEVICE_TWIN_SECTION_SAMPLING, sampling),
+};
+#define DESIRED_SECTIONS_COUNT (sizeof(desired_sections) / sizeof(desired_sections[0]))
+
+static void on_mqtt_message_callback(const char *topic, const char *payload, size_t size) {
+  KorraCloudHub::instance()->on_mqtt_message(topic, payload, size);
+}
+
+static void on_mqtt_dropped_callback(const char *topic) {
+  KorraCloudHub::instance()->on_mqtt_dropped(topic);
 }
 
-KorraCloudHub::KorraCloudHub(Client &client) : mqtt(client) {
+static void on_outbox_dropped_callback(const struct korra_cloud_message *message) {
+  KorraCloudHub::instance()->on_outbox_dropped(message);
+}
+
+KorraCloudHub::KorraCloudHub(KorraMqtt &mqtt) : mqtt(mqtt) {
   _instance = this;
+  outbox.onDropped(on_outbox_dropped_callback);
 }
 
 KorraCloudHub::~KorraCloudHub() {
@@ -50,6 +150,18 @@ void KorraCloudHub::begin() {
 }
 
 void KorraCloudHub::maintain(struct korra_cloud_provisioning_info *info) {
+  // provisioning again (e.g. after clear()) may assign another hub, the client is then set up again
+  uint32_t assignment = esp_rom_crc32_le(0, (const uint8_t *)info->hostname, info->hostname_len);
+  assignment = esp_rom_crc32_le(assignment, (const uint8_t *)info->id, info->id_len);
+  if (client_setup && assignment != client_assignment) {
+    Serial.println("Hub assignment changed, setting up the client again");
+    mqtt.stop();
+    free(username);
+    username = NULL;
+    username_len = 0;
+    client_setup = false;
+  }
+
   if (!client_setup) {
     // set fields
     hostname = info->hostname;
@@ -61,18 +173,17 @@ void KorraCloudHub::maintain(struct korra_cloud_provisioning_info *info) {
     username_len = snprintf(NULL, 0, USERNAME_FORMAT, hostname, deviceid) + 1; // plus NULL
     username = (char *)malloc(username_len);
     if (username == NULL) {
-      Serial.printf("Unable to allocate %d bytes for username\n", username_len);
+      Serial.printf("Unable to allocate %d bytes for username\n", (int)username_len);
       while (1);
     }
     username_len = snprintf(username, username_len, USERNAME_FORMAT, hostname, deviceid);
 
-    mqtt.setId(deviceid);
-    mqtt.setTxPayloadSize(512);            // defaults to 256
-    mqtt.setCleanSession(false);           // want to received any messages we missed
-    mqtt.setKeepAliveInterval(240 * 1000); // 240 seconds (default 60 seconds)
-    mqtt.setUsernamePassword(username, "" /* password (library throws when NULL) */);
+    mqtt.configure(deviceid, username, /* keep alive */ 240 /* seconds (default 60) */,
+                   /* clean session */ false /* want to received any messages we missed */);
     mqtt.onMessage(on_mqtt_message_callback);
+    mqtt.onDropped(on_mqtt_dropped_callback);
     client_setup = true;
+    client_assignment = assignment;
   }
 
   if (!connected()) {
@@ -84,7 +195,7 @@ void KorraCloudHub::maintain(struct korra_cloud_provisioning_info *info) {
       size_t topic_len = snprintf(NULL, 0, TOPIC_C2D_FILTER, deviceid);
       char topic[topic_len + 1] = {0};
       topic_len = snprintf(topic, sizeof(topic), TOPIC_C2D_FILTER, deviceid);
-      mqtt.subscribe(topic, /* qos */ 0);
+      mqtt.subscribe(topic, /* qos */ 1); // the hub only completes the message once acknowledged
 
       // subscribe to device twin messages
       mqtt.subscribe(TOPIC_TWIN_RESULT_FILTER, /* qos */ 0);        // request response
@@ -102,139 +213,200 @@ void KorraCloudHub::maintain(struct korra_cloud_provisioning_info *info) {
     query_device_twin();
     twin_requested = true;
   }
+
+  // publish responses of direct methods that completed in the background
+  send_direct_method_responses();
+
+  // execute commands received (possibly many at once after being offline)
+  run_commands();
+
+  // report the properties once updates have settled
+  if (reported_dirty && (millis() - reported_dirty_since) >= REPORTED_COALESCE_MS) report();
+
+  // readings must not wait for a slow batch to fill (a full one takes hours at long sampling periods)
+  if (batch_count > 0 && (millis() - batch_started) >= CONFIG_HUB_BATCH_MAX_AGE_SEC * 1000UL) send_batch();
+
+  // publish whatever is waiting (e.g. messages queued while disconnected or held back by rate limits)
+  flush();
 }
 
 void KorraCloudHub::push(const struct korra_sensors_data *source) {
-  JsonDocument doc;
+  uint8_t target = budget.batch_size(sampling_period_sec, BATCH_MAX_READINGS);
+  if (target <= 1 && batch_count == 0) {
+    // plenty of budget, each reading goes in its own message
+    JsonDocument doc;
+    populate_sensors(doc.to<JsonObject>(), source);
 
-  // set timestamp (though it exists in the properties of the message, this ensures it is also in the body)
-  time_t now = time(NULL);
-  doc["timestamp"] = now;
+    // prepare topic
+    size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_D2C_MESSAGE, deviceid, "sensors");
+    char topic[topic_len + 1] = {0};
+    topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_D2C_MESSAGE, deviceid, "sensors");
+
+    // prepare payload
+    size_t payload_len = measureJson(doc);
+    char payload[payload_len + 1] = {0};
+    payload_len = serializeJson(doc, payload, payload_len);
+    Serial.printf("Sending message to topic '%s', length %d bytes:\n%s\n", topic, (int)payload_len, payload);
+
+    // publish
+    send(KORRA_CLOUD_PRIORITY_TELEMETRY, topic, payload, payload_len);
+    return;
+  }
+
+  // pack the reading into the batch, sending the batch first if the reading would take it past a chunk
+  JsonDocument reading;
+  populate_sensors(reading.to<JsonObject>(), source);
+  reading.remove("app_kind"); // it is set once for the whole batch
+  if (batch_count > 0 && measureJson(batch) + measureJson(reading) + 1 /* comma */ > BATCH_MAX_PAYLOAD) {
+    send_batch();
+  }
+
+  if (batch_count == 0) {
+    batch.clear();
+    batch_started = millis();
+  }
+  batch["readings"].add(reading);
+  batch_count++;
+
+  // the batch carries the values of the latest reading for the top-level fields
+  batch["timestamp"] = reading["timestamp"];
+  batch["created"] = reading["created"];
+#ifdef CONFIG_APP_KIND_KEEPER
+  batch["app_kind"] = "keeper";
+#endif // CONFIG_APP_KIND_KEEPER
+#ifdef CONFIG_APP_KIND_POT
+  batch["app_kind"] = "pot";
+#endif // CONFIG_APP_KIND_POT
+
+  Serial.printf("Packed reading %d of %d into the batch\n", batch_count, target);
+  if (batch_count >= target) send_batch();
+}
+
+void KorraCloudHub::push(const struct korra_actuation *source) {
+  JsonDocument doc;
 
   // set the IOS8601 version of the timestamp
   struct tm tm;
-  gmtime_r(&now, &tm);
+  gmtime_r(&(source->timestamp), &tm);
   char time_str[sizeof("1970-01-01T00:00:00")];
   strftime(time_str, sizeof(time_str), "%FT%T", &tm);
   doc["created"] = time_str;
 
 #ifdef CONFIG_APP_KIND_KEEPER
   doc["app_kind"] = "keeper";
-  doc["temperature"]["unit"] = "C";
-  doc["temperature"]["value"] = source->temperature;
-  doc["humidity"]["unit"] = "%";
-  doc["humidity"]["value"] = source->humidity;
+  doc["fan"]["duration"] = source->duration;
+  doc["fan"]["quantity"] = 0;
 #endif // CONFIG_APP_KIND_KEEPER
 #ifdef CONFIG_APP_KIND_POT
   doc["app_kind"] = "pot";
-  doc["moisture"]["unit"] = "%";
-  doc["moisture"]["value"] = source->moisture.value;
-  doc["moisture"]["millivolts"] = source->moisture.millivolts;
-  doc["ph"]["value"] = source->ph.value;
-  doc["ph"]["millivolts"] = source->ph.millivolts;
+  doc["pump"]["duration"] = source->duration;
+  doc["pump"]["quantity"] = 0;
 #endif // CONFIG_APP_KIND_POT
 
   // prepare topic
-  size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_D2C_MESSAGE, deviceid, "sensors");
+  size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_D2C_MESSAGE, deviceid, "actuators");
   char topic[topic_len + 1] = {0};
-  topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_D2C_MESSAGE, deviceid, "sensors");
+  topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_D2C_MESSAGE, deviceid, "actuators");
 
   // prepare payload
   size_t payload_len = measureJson(doc);
   char payload[payload_len + 1] = {0};
-  payload_len = serializeJson(doc, payload, payload_len);
-  Serial.printf("Sending message to topic '%s', length %d bytes:\n%s\n", topic, payload_len, payload);
+  payload_len = serializeJson(doc, payload, sizeof(payload));
+  Serial.printf("Sending message to topic '%s', length %d bytes:\n%s\n", topic, (int)payload_len, payload);
 
   // publish
-  mqtt.beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
-  mqtt.write((const uint8_t *)payload, payload_len);
-  mqtt.endMessage();
+  send(KORRA_CLOUD_PRIORITY_ACTUATION, topic, payload, payload_len);
 }
 
-void KorraCloudHub::push(const struct korra_actuation *source) {
+void KorraCloudHub::push(const struct korra_metrics_snapshot *source) {
   JsonDocument doc;
 
+  // set timestamp (though it exists in the properties of the message, this ensures it is also in the body)
+  time_t now = time(NULL);
+  doc["timestamp"] = now;
+
   // set the IOS8601 version of the timestamp
   struct tm tm;
-  gmtime_r(&(source->timestamp), &tm);
+  gmtime_r(&now, &tm);
   char time_str[sizeof("1970-01-01T00:00:00")];
   strftime(time_str, sizeof(time_str), "%FT%T", &tm);
   doc["created"] = time_str;
 
 #ifdef CONFIG_APP_KIND_KEEPER
   doc["app_kind"] = "keeper";
-  doc["fan"]["duration"] = source->duration;
-  doc["fan"]["quantity"] = 0;
 #endif // CONFIG_APP_KIND_KEEPER
 #ifdef CONFIG_APP_KIND_POT
   doc["app_kind"] = "pot";
-  doc["pump"]["duration"] = source->duration;
-  doc["pump"]["quantity"] = 0;
 #endif // CONFIG_APP_KIND_POT
 
+  doc["uptime"] = source->uptime;
+  for (uint8_t i = 0; i < KORRA_METRICS_COUNTER_COUNT; i++) {
+    doc["counters"][KorraMetrics::name((enum korra_metrics_counter)i)] = source->counters[i];
+  }
+  for (uint8_t i = 0; i < KORRA_METRICS_GAUGE_COUNT; i++) {
+    doc["gauges"][KorraMetrics::name((enum korra_metrics_gauge)i)] = source->gauges[i];
+  }
+  for (uint8_t i = 0; i < KORRA_METRICS_HISTOGRAM_COUNT; i++) {
+    const struct korra_metrics_histogram_data *hist = &(source->histograms[i]);
+    JsonObject node = doc["histograms"][KorraMetrics::name((enum korra_metrics_histogram)i)].to<JsonObject>();
+    node["count"] = hist->count;
+    node["sum"] = hist->sum;
+    node["min"] = hist->min;
+    node["max"] = hist->max;
+
+    // trailing empty buckets are left out to keep the message small, bounds are powers of 2 (see KorraMetrics)
+    uint8_t used = KORRA_METRICS_HISTOGRAM_BUCKETS;
+    while (used > 0 && hist->buckets[used - 1] == 0) used--;
+    JsonArray buckets = node["buckets"].to<JsonArray>();
+    for (uint8_t b = 0; b < used; b++) buckets.add(hist->buckets[b]);
+  }
+  for (size_t i = 0; i < source->tasks_count; i++) {
+    const struct korra_task_info *info = &(source->tasks[i]);
+    JsonObject node = doc["tasks"][info->name].to<JsonObject>();
+    node["stack_free"] = info->stack_free;
+    node["priority"] = info->priority;
+    if (info->core >= 0) node["core"] = info->core;
+    if (info->cpu >= 0) node["cpu"] = info->cpu;
+  }
+
   // prepare topic
-  size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_D2C_MESSAGE, deviceid, "actuators");
+  size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_D2C_MESSAGE, deviceid, "metrics");
   char topic[topic_len + 1] = {0};
-  topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_D2C_MESSAGE, deviceid, "actuators");
+  topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_D2C_MESSAGE, deviceid, "metrics");
 
   // prepare payload
   size_t payload_len = measureJson(doc);
   char payload[payload_len + 1] = {0};
   payload_len = serializeJson(doc, payload, sizeof(payload));
-  Serial.printf("Sending message to topic '%s', length %d bytes:\n%s\n", topic, payload_len, payload);
+  Serial.printf("Sending message to topic '%s', length %d bytes:\n%s\n", topic, (int)payload_len, payload);
 
   // publish
-  mqtt.beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
-  mqtt.write((const uint8_t *)payload, payload_len);
-  mqtt.endMessage();
+  send(KORRA_CLOUD_PRIORITY_TELEMETRY, topic, payload, payload_len);
 }
 
 void KorraCloudHub::update(struct korra_device_twin_reported *props) {
+  // the window starts with the first update so that frequent updates cannot postpone reporting forever
+  if (!reported_dirty) reported_dirty_since = millis();
+  reported_dirty = true;
+  memcpy(&reported_pending, props, sizeof(struct korra_device_twin_reported));
+}
+
+void KorraCloudHub::report() {
   // The request message body contains a JSON document that contains new values for reported properties.
   // Each member in the JSON document updates or add the corresponding member in the device twin's document.
   // A member set to null deletes the member from the containing object.
   JsonDocument doc;
+  reported_dirty = false;
 
-  // check if the values we have reported need updating then update
-  bool update = false;
-
-  // check the firmware version (either value or semver)
-  if (props->firmware.version.value != twin.reported.firmware.version.value ||
-      strcmp(props->firmware.version.semver, twin.reported.firmware.version.semver) != 0) {
-
-    twin.reported.firmware.version.value = props->firmware.version.value;
-    snprintf((char *)twin.reported.firmware.version.semver, sizeof(twin.reported.firmware.version.semver),
-             props->firmware.version.semver);
-
-    doc["firmware"]["version"]["value"] = props->firmware.version.value;
-    doc["firmware"]["version"]["semver"] = props->firmware.version.semver;
-    update |= true;
-  }
+  // boot times are only reported once the boot is complete, until then they match what was reported
+  if (reported_pending.boot.phases[KORRA_BOOT_PHASE_FIRST_TELEMETRY] == 0) reported_pending.boot = twin.reported.boot;
 
-  // check the network props
-  if (strcmp(props->network.kind, twin.reported.network.kind) != 0) {
-    snprintf((char *)twin.reported.network.kind, sizeof(twin.reported.network.kind), props->network.kind);
-    doc["network"]["kind"] = props->network.kind;
-    update |= true;
-  }
-  if (strcmp(props->network.mac, twin.reported.network.mac) != 0) {
-    snprintf((char *)twin.reported.network.mac, sizeof(twin.reported.network.mac), props->network.mac);
-    doc["network"]["mac"] = props->network.mac;
-    update |= true;
-  }
-  if (strcmp(props->network.name, twin.reported.network.name) != 0) {
-    snprintf((char *)twin.reported.network.name, sizeof(twin.reported.network.name), props->network.name);
-    doc["network"]["name"] = props->network.name;
-    update |= true;
-  }
-  if (strcmp(props->network.local_ip, twin.reported.network.local_ip) != 0) {
-    snprintf((char *)twin.reported.network.local_ip, sizeof(twin.reported.network.local_ip), props->network.local_ip);
-    doc["network"]["local_ip"] = props->network.local_ip;
-    update |= true;
-  }
-
-  // if we have nothing to update, return
-  if (!update) {
+  // only the values that differ from what has been published, they count as reported once this patch is published
+  // so that a patch dropped from the outbox is made again (see `on_outbox_dropped()`)
+  memcpy(&reported_sending, &(twin.reported), sizeof(reported_sending));
+  size_t changes = KorraCloudTwin::diff(reported_fields, REPORTED_FIELDS_COUNT, &reported_pending, &reported_sending,
+                                        doc.to<JsonObject>());
+  if (changes == 0) {
     Serial.println("No update required for the reported properties in the device twin");
     return;
   }
@@ -248,14 +420,62 @@ void KorraCloudHub::update(struct korra_device_twin_reported *props) {
   size_t payload_len = measureJson(doc);
   char payload[payload_len + 1] = {0};
   payload_len = serializeJson(doc, payload, payload_len);
-  Serial.printf("Sending message to topic '%s', length %d bytes:\n%s\n", topic, payload_len, payload);
+  Serial.printf("Sending message to topic '%s', length %d bytes:\n%s\n", topic, (int)payload_len, payload);
 
   // publish
-  mqtt.beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
-  mqtt.write((const uint8_t *)payload, payload_len);
-  mqtt.endMessage();
+  snprintf(reported_topic, sizeof(reported_topic), "%s", topic);
+  send(KORRA_CLOUD_PRIORITY_TWIN, topic, payload, payload_len);
   request_id++;
-  memcpy(&(twin.reported.firmware), props, sizeof(struct korra_device_twin_reported));
+}
+
+void KorraCloudHub::send_batch() {
+  if (batch_count == 0) return;
+
+  // prepare topic
+  size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_D2C_MESSAGE, deviceid, "sensors");
+  char topic[topic_len + 1] = {0};
+  topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_D2C_MESSAGE, deviceid, "sensors");
+
+  // prepare payload
+  size_t payload_len = measureJson(batch);
+  char payload[payload_len + 1] = {0};
+  payload_len = serializeJson(batch, payload, payload_len);
+  Serial.printf("Sending message to topic '%s' with %d readings, length %d bytes:\n%s\n", topic, batch_count,
+                (int)payload_len, payload);
+
+  // publish
+  send(KORRA_CLOUD_PRIORITY_TELEMETRY, topic, payload, payload_len);
+  batch.clear();
+  batch_count = 0;
+}
+
+void KorraCloudHub::populate_sensors(JsonObject node, const struct korra_sensors_data *source) {
+  // set timestamp (though it exists in the properties of the message, this ensures it is also in the body)
+  time_t now = time(NULL);
+  node["timestamp"] = now;
+
+  // set the IOS8601 version of the timestamp
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  char time_str[sizeof("1970-01-01T00:00:00")];
+  strftime(time_str, sizeof(time_str), "%FT%T", &tm);
+  node["created"] = time_str;
+
+#ifdef CONFIG_APP_KIND_KEEPER
+  node["app_kind"] = "keeper";
+  node["temperature"]["unit"] = "C";
+  node["temperature"]["value"] = source->temperature;
+  node["humidity"]["unit"] = "%";
+  node["humidity"]["value"] = source->humidity;
+#endif // CONFIG_APP_KIND_KEEPER
+#ifdef CONFIG_APP_KIND_POT
+  node["app_kind"] = "pot";
+  node["moisture"]["unit"] = "%";
+  node["moisture"]["value"] = source->moisture.value;
+  node["moisture"]["millivolts"] = source->moisture.millivolts;
+  node["ph"]["value"] = source->ph.value;
+  node["ph"]["millivolts"] = source->ph.millivolts;
+#endif // CONFIG_APP_KIND_POT
 }
 
 void KorraCloudHub::connect(int retries, int delay_ms) {
@@ -264,10 +484,12 @@ void KorraCloudHub::connect(int retries, int delay_ms) {
     Serial.printf("Connecting to Hub server... (%d/%d)\n", i + 1, retries);
     mqtt.connect(hostname, 8883);
     if (connected()) {
+      if (connected_before) KorraMetrics::increment(KORRA_METRICS_COUNTER_HUB_RECONNECTS);
+      connected_before = true;
       Serial.println("Connected to Hub server.");
       break;
     }
-    Serial.printf("Failed to connect to Hub server (%d). Retrying in %d ms...\n", mqtt.connectError(), delay_ms);
+    Serial.printf("Failed to connect to Hub server (%d). Retrying in %d ms...\n", mqtt.connect_error(), delay_ms);
     delay(delay_ms);
   }
 
@@ -281,23 +503,75 @@ void KorraCloudHub::query_device_twin() {
   size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_TWIN_GET_STATUS, request_id);
   char topic[topic_len + 1] = {0};
   topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_TWIN_GET_STATUS, request_id);
-  mqtt.beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
-  mqtt.print("{}"); // must be an empty json otherwise it won't work
-  mqtt.endMessage();
+  send(KORRA_CLOUD_PRIORITY_TWIN, topic, "{}", 2); // must be an empty json otherwise it won't work
   request_id++;
 }
 
-void KorraCloudHub::on_mqtt_message(int size) {
-  // Keep the String alive until the function ends since we depend on it.
-  // Converting direct with c_str(), discards the string but we need it.
-  String topic_str = mqtt.messageTopic();
-  const char *topic = topic_str.c_str();
-  Serial.printf("Received a message on topic '%s', length %d bytes:\n", topic, size);
+void KorraCloudHub::send(enum korra_cloud_priority priority, const char *topic, const char *payload,
+                         size_t payload_len) {
+  // queue first so that a message of a higher class already waiting is published before this one
+  outbox.enqueue(priority, topic, payload, payload_len);
+  flush();
+}
+
+void KorraCloudHub::flush() {
+  if (!connected()) return;
+
+  // telemetry waits for the next day once the budget is used up, the control plane does not
+  outbox.hold(KORRA_CLOUD_PRIORITY_TELEMETRY, budget.exhausted());
+
+  for (uint8_t i = 0; i < OUTBOX_FLUSH_MAX_MESSAGES; i++) {
+    struct korra_cloud_message *message = outbox.next();
+    if (message == NULL) break;
+
+    if (!publish(message->topic, message->payload, message->payload_len)) {
+      // leave it at the head of its queue and try again on the next call
+      if (++(message->attempts) < OUTBOX_MAX_ATTEMPTS) break;
+      Serial.printf("Dropping message to topic '%s' after %d attempts\n", message->topic, message->attempts);
+      KorraMetrics::increment(KORRA_METRICS_COUNTER_OUTBOX_DROPPED);
+      on_outbox_dropped(message);
+    } else if (strcmp(message->topic, reported_topic) == 0) {
+      // each patch has every change not yet published, so the last one being out is all it takes
+      uint16_t version = twin.reported.version;
+      memcpy(&(twin.reported), &reported_sending, sizeof(twin.reported));
+      twin.reported.version = version;
+      reported_topic[0] = '\0';
+    }
+    outbox.remove(message);
+  }
+}
+
+void KorraCloudHub::on_outbox_dropped(const struct korra_cloud_message *message) {
+  if (strcmp(message->topic, reported_topic) != 0) return;
+
+  // the changes in the patch were never published, another patch is made with them
+  reported_topic[0] = '\0';
+  if (!reported_dirty) reported_dirty_since = millis();
+  reported_dirty = true;
+}
 
-  // read payload
-  char payload[size + 1] = {0};
-  mqtt.readBytes(payload, size);
+bool KorraCloudHub::publish(const char *topic, const char *payload, size_t payload_len) {
+  // milliseconds since a TLS write takes several, the buckets would saturate in microseconds
+  unsigned long started = millis();
+  bool published = mqtt.publish(topic, (const uint8_t *)payload, payload_len, /* qos */ 0);
+  KorraMetrics::record(KORRA_METRICS_HISTOGRAM_PUBLISH, millis() - started);
+
+  if (!published) {
+    Serial.printf("Failed to publish message to topic '%s'\n", topic);
+    KorraMetrics::increment(KORRA_METRICS_COUNTER_PUBLISH_FAILURES);
+    return false;
+  }
+  KorraMetrics::increment(KORRA_METRICS_COUNTER_MESSAGES_SENT);
+  KorraMetrics::increment(KORRA_METRICS_COUNTER_BYTES_SENT, strlen(topic) + payload_len);
+  budget.record(strlen(topic) + payload_len);
+  return true;
+}
+
+void KorraCloudHub::on_mqtt_message(const char *topic, const char *payload, size_t size) {
+  Serial.printf("Received a message on topic '%s', length %d bytes:\n", topic, (int)size);
   Serial.printf("%s\n", payload);
+  KorraMetrics::increment(KORRA_METRICS_COUNTER_MESSAGES_RECEIVED);
+  KorraMetrics::increment(KORRA_METRICS_COUNTER_BYTES_RECEIVED, strlen(topic) + size);
 
   // sample topics
   // twin (request response) -> $iothub/registrations/res/200/?$rid=1
@@ -334,17 +608,11 @@ void KorraCloudHub::on_mqtt_message(int size) {
         return;
       }
 
-      // reset the stored twin and then populate it
-      twin = {0};
-      twin.desired.version = desired_version;
+      // the reported properties are replaced, the desired ones are applied by section to avoid needless churn
+      memset(&(twin.reported), 0, sizeof(twin.reported));
       twin.reported.version = reported_version;
-      populate_desired_props(node_desired, &(twin.desired));
       populate_reported_props(node_reported, &(twin.reported));
-
-      // invoke callback
-      if (changed && device_twin_updated_callback != NULL) {
-        device_twin_updated_callback(&twin, initial);
-      }
+      apply_desired_props(node_desired, /* full */ true, initial);
     } else if (status_code == 204) {
       Serial.println("Update was successful.");
     } else {
@@ -370,15 +638,18 @@ void KorraCloudHub::on_mqtt_message(int size) {
       return;
     }
 
-    // populate
-    twin.desired.version = doc["$version"].as<uint16_t>();
-    populate_desired_props(doc, &(twin.desired));
+    // apply (only the members in the patch are present)
+    apply_desired_props(doc, /* full */ false, /* initial */ false);
 
-    // invoke callback
-    if (device_twin_updated_callback != NULL) {
-      device_twin_updated_callback(&twin, /* initial */ false);
-    }
+    return;
+  }
 
+  // find the prefix (cloud to device message)
+  size_t c2d_prefix_len = snprintf(NULL, 0, TOPIC_C2D_PREFIX, deviceid);
+  char c2d_prefix[c2d_prefix_len + 1] = {0};
+  snprintf(c2d_prefix, sizeof(c2d_prefix), TOPIC_C2D_PREFIX, deviceid);
+  if (strncmp(topic, c2d_prefix, c2d_prefix_len) == 0) {
+    queue_command(topic + c2d_prefix_len, payload, size);
     return;
   }
 
@@ -404,12 +675,39 @@ void KorraCloudHub::on_mqtt_message(int size) {
       }
     }
 
-    // invoke the callback
-    int status_code = 404; // default status code (not found)
-    if (direct_method_call_callback != NULL) {
-      status_code = direct_method_call_callback(method_name, doc);
+    // find the handler
+    korra_direct_method_handler handler = NULL;
+    for (size_t i = 0; i < methods_count; i++) {
+      if (strcmp(methods[i].name, method_name) == 0) {
+        handler = methods[i].handler;
+        break;
+      }
+    }
+    if (handler == NULL) {
+      const char *error = "{\"error\":\"unknown method\"}";
+      direct_method_response(404, rid, error, strlen(error));
+      return;
+    }
+
+    // keep track of the invocation until the handler responds
+    bool tracked = false;
+    portENTER_CRITICAL(&pending_methods_mux);
+    for (uint8_t i = 0; i < KORRA_DIRECT_METHODS_PENDING_MAX && !tracked; i++) {
+      struct pending_method *pending = &(pending_methods[i]);
+      if (pending->started != 0) continue;
+      *pending = {.rid = rid, .started = MAX(millis(), 1UL), .completed = false};
+      tracked = true;
+    }
+    portEXIT_CRITICAL(&pending_methods_mux);
+    if (!tracked) {
+      const char *error = "{\"error\":\"too many pending methods\"}";
+      direct_method_response(429, rid, error, strlen(error));
+      return;
     }
-    direct_method_response(status_code, rid);
+
+    // invoke the handler then publish the response straight away if it has already responded
+    handler(rid, doc);
+    send_direct_method_responses();
 
     return;
   }
@@ -417,104 +715,279 @@ void KorraCloudHub::on_mqtt_message(int size) {
   Serial.printf("Unknown topic.\n");
 }
 
+void KorraCloudHub::apply_desired_props(const JsonVariantConst &json, bool full, bool initial) {
+  // a full twin starts from nothing, a patch from what we have
+  struct korra_device_twin_desired desired = {0};
+  if (!full) memcpy(&desired, &(twin.desired), sizeof(desired));
+  desired.version = json["$version"].as<uint16_t>();
+  populate_desired_props(json, &desired);
+
+  // compare section by section so that only the affected subsystems are updated
+  uint8_t changed = 0;
+  for (size_t i = 0; i < DESIRED_SECTIONS_COUNT; i++) {
+    const struct desired_section *section = &(desired_sections[i]);
+    const uint8_t *next = (const uint8_t *)&desired + section->offset;
+    const uint8_t *current = (const uint8_t *)&(twin.desired) + section->offset;
+    if (initial || memcmp(next, current, section->size) != 0) changed |= section->flag;
+  }
+  memcpy(&(twin.desired), &desired, sizeof(desired));
+
+  if (changed == 0) {
+    Serial.printf("Desired properties (version %d) have no changes for any section\n", desired.version);
+    return;
+  }
+  Serial.printf("Desired properties (version %d) changed sections: 0x%02x\n", desired.version, changed);
+
+  // the budget belongs to the hub
+  if (changed & KORRA_DEVICE_TWIN_SECTION_BUDGET) budget.set_config(&(twin.desired.budget));
+
+  // invoke callback
+  if (device_twin_updated_callback != NULL) {
+    device_twin_updated_callback(&twin, changed, initial);
+  }
+}
+
 void KorraCloudHub::populate_desired_props(const JsonVariantConst &json, struct korra_device_twin_desired *desired) {
-  // firmware version
-  JsonVariantConst node_fw = json["firmware"];
-  if (!node_fw.isNull()) {
-    // firmware version
-    JsonVariantConst node_fw_v = node_fw["version"];
-    if (!node_fw_v.isNull()) {
-      twin.desired.firmware.version.value = node_fw_v["value"].as<uint32_t>();
-      const char *semver_raw = node_fw_v["semver"];
-      if (semver_raw != NULL) {
-        size_t semver_raw_len = MIN((int)strlen(semver_raw) + 1, (int)sizeof(twin.desired.firmware.version.semver));
-        memcpy(twin.desired.firmware.version.semver, semver_raw, semver_raw_len - 1);
-      }
-    }
+  KorraCloudTwin::read(desired_fields, DESIRED_FIELDS_COUNT, json, desired);
+
+  // clamp actuator values
+  if (!json["actuator"].isNull()) {
+    desired->actuator.duration = CLAMP(desired->actuator.duration, 5, 15);
+    desired->actuator.equilibrium_time = CLAMP(desired->actuator.equilibrium_time, 5, 60);
+  }
+
+  // clamp sampling values (zero means the default so it is left alone)
+  struct korra_device_twin_sampling *sampling = &(desired->sampling);
+  if (sampling->sensors) {
+    sampling->sensors = CLAMP(sampling->sensors, KORRA_SAMPLING_SENSORS_MIN_SEC, KORRA_SAMPLING_SENSORS_MAX_SEC);
+  }
+  if (sampling->twin) {
+    sampling->twin = CLAMP(sampling->twin, KORRA_SAMPLING_TWIN_MIN_SEC, KORRA_SAMPLING_TWIN_MAX_SEC);
+  }
+  if (sampling->metrics) {
+    sampling->metrics = CLAMP(sampling->metrics, KORRA_SAMPLING_METRICS_MIN_SEC, KORRA_SAMPLING_METRICS_MAX_SEC);
+  }
+}
 
-    // firmware url
-    const char *url_raw = node_fw["url"];
-    if (url_raw != NULL) {
-      size_t url_raw_len = MIN((int)strlen(url_raw) + 1, (int)sizeof(twin.desired.firmware.url));
-      memcpy(twin.desired.firmware.url, url_raw, url_raw_len - 1);
+void KorraCloudHub::populate_reported_props(const JsonVariantConst &json, struct korra_device_twin_reported *reported) {
+  KorraCloudTwin::read(reported_fields, REPORTED_FIELDS_COUNT, json, reported);
+}
+
+// decodes the percent-encoding used in the property bag of a topic
+static void url_decode(char *dest, size_t size, const char *src, size_t len) {
+  size_t j = 0;
+  for (size_t i = 0; i < len && j + 1 < size; i++) {
+    unsigned int value;
+    if (src[i] == '%' && i + 2 < len && sscanf(src + i + 1, "%2x", &value) == 1) {
+      dest[j++] = (char)value;
+      i += 2;
+    } else {
+      dest[j++] = src[i] == '+' ? ' ' : src[i];
     }
+  }
+  dest[j] = '\0';
+}
 
-    // firmware hash
-    const char *hash_raw = node_fw["hash"];
-    if (hash_raw != NULL) {
-      size_t hash_raw_len = MIN((int)strlen(hash_raw) + 1, (int)sizeof(twin.desired.firmware.hash));
-      memcpy(twin.desired.firmware.hash, hash_raw, hash_raw_len - 1);
+// the property bag -> $.mid={message-id}&$.to=...&command={name}&... (URL encoded)
+static void read_command_properties(const char *properties, char *name, size_t name_size, char *message_id,
+                                    size_t message_id_size) {
+  const char *pos = properties;
+  while (*pos) {
+    const char *end = strchr(pos, '&');
+    size_t pair_len = end ? (size_t)(end - pos) : strlen(pos);
+    const char *eq = (const char *)memchr(pos, '=', pair_len);
+    if (eq != NULL) {
+      char key[16] = {0};
+      url_decode(key, sizeof(key), pos, eq - pos);
+      const char *value = eq + 1;
+      size_t value_len = pair_len - (value - pos);
+      if (strcmp(key, "$.mid") == 0) url_decode(message_id, message_id_size, value, value_len);
+      if (strcmp(key, "command") == 0) url_decode(name, name_size, value, value_len);
     }
+    pos += pair_len + (end ? 1 : 0);
+  }
+}
+
+void KorraCloudHub::queue_command(const char *properties, const char *payload, size_t payload_len) {
+  char message_id[sizeof(((struct korra_cloud_command *)0)->message_id)] = {0};
+  char name[sizeof(((struct korra_cloud_command *)0)->name)] = {0};
+  read_command_properties(properties, name, sizeof(name), message_id, sizeof(message_id));
 
-    // firmware signature
-    const char *signature_raw = node_fw["signature"];
-    if (signature_raw != NULL) {
-      size_t signature_raw_len = MIN((int)strlen(signature_raw) + 1, (int)sizeof(twin.desired.firmware.signature));
-      memcpy(twin.desired.firmware.signature, signature_raw, signature_raw_len - 1);
+  // the name may also be in the body -> {"command": "set_actuator", ...}
+  if (name[0] == '\0') {
+    JsonDocument doc;
+    if (!deserializeJson(doc, payload, payload_len)) {
+      const char *raw = doc["command"];
+      if (raw != NULL) snprintf(name, sizeof(name), "%s", raw);
     }
   }
+  if (name[0] == '\0') {
+    Serial.printf("Ignoring cloud to device message without a command (mid: %s)\n", message_id);
+    return;
+  }
+
+  // the message is already acknowledged at the MQTT level so the hub will not deliver it again, tell the sender
+  if (!commands.enqueue(name, message_id, payload, payload_len)) {
+    JsonDocument result;
+    result["error"] = "busy";
+    send_command_ack(name, message_id, 503, result);
+    return;
+  }
+  Serial.printf("Queued command '%s' (mid: %s)\n", name, message_id);
+}
 
-  // actuator
-  JsonVariantConst node_acc = json["actuator"];
-  if (!node_acc.isNull()) {
-    twin.desired.actuator.enabled = node_acc["enabled"].as<bool>();
-    twin.desired.actuator.duration = node_acc["duration"].as<uint16_t>();
-    twin.desired.actuator.equilibrium_time = node_acc["equilibrium_time"].as<uint16_t>();
-    twin.desired.actuator.target = node_acc["target"].as<float>();
+void KorraCloudHub::on_mqtt_dropped(const char *topic) {
+  // the message was acknowledged at the MQTT level but never handled, the sender is told so that it can try again
+  size_t c2d_prefix_len = snprintf(NULL, 0, TOPIC_C2D_PREFIX, deviceid);
+  char c2d_prefix[c2d_prefix_len + 1] = {0};
+  snprintf(c2d_prefix, sizeof(c2d_prefix), TOPIC_C2D_PREFIX, deviceid);
+  if (strncmp(topic, c2d_prefix, c2d_prefix_len) == 0) {
+    char message_id[sizeof(((struct korra_cloud_command *)0)->message_id)] = {0};
+    char name[sizeof(((struct korra_cloud_command *)0)->name)] = {0};
+    read_command_properties(topic + c2d_prefix_len, name, sizeof(name), message_id, sizeof(message_id));
+    JsonDocument result;
+    result["error"] = "busy";
+    send_command_ack(name, message_id, 503, result);
+    return;
+  }
 
-    // clamp actuator values
-    twin.desired.actuator.duration = CLAMP(twin.desired.actuator.duration, 5, 15);
-    twin.desired.actuator.equilibrium_time = CLAMP(twin.desired.actuator.equilibrium_time, 5, 60);
+  const char *prefix_pos = strstr(topic, TOPIC_DIRECT_METHOD_PREFIX);
+  int rid = 0;
+  if (prefix_pos != NULL && sscanf(prefix_pos + strlen(TOPIC_DIRECT_METHOD_PREFIX), "%*[^/]/?$rid=%d", &rid) == 1) {
+    const char *error = "{\"error\":\"busy\"}";
+    direct_method_response(503, rid, error, strlen(error));
+    return;
   }
+
+  // a twin response or desired patch, the whole twin is fetched again
+  twin_requested = false;
 }
 
-void KorraCloudHub::populate_reported_props(const JsonVariantConst &json, struct korra_device_twin_reported *reported) {
-  // firmware version
-  JsonVariantConst node_fv = json["firmware"]["version"];
-  if (!node_fv.isNull()) {
-    twin.reported.firmware.version.value = node_fv["value"].as<uint32_t>();
-    const char *semver_raw = node_fv["semver"];
-    if (semver_raw != NULL) {
-      size_t semver_raw_len = MIN((int)strlen(semver_raw) + 1, (int)sizeof(twin.reported.firmware.version.semver));
-      memcpy(twin.reported.firmware.version.semver, semver_raw, semver_raw_len - 1);
+void KorraCloudHub::run_commands() {
+  // only as many as there is room for their acknowledgements, the rest run on the next call
+  struct korra_cloud_command *command;
+  while (outbox.room(KORRA_CLOUD_PRIORITY_COMMAND_ACK) > 0 && (command = commands.peek()) != NULL) {
+    JsonDocument doc, result;
+    int status = 400; // bad request, unless the payload parses
+    if (command->payload_len == 0 || !deserializeJson(doc, command->payload, command->payload_len)) {
+      status = 404; // not found, unless there is someone to execute it
+      if (command_callback != NULL) status = command_callback(command->name, doc, result);
     }
+    Serial.printf("Executed command '%s' (mid: %s) with status %d\n", command->name, command->message_id, status);
+    send_command_ack(command->name, command->message_id, status, result);
+    commands.pop();
   }
+}
 
-  // network
-  JsonVariantConst node_net = json["network"];
-  if (!node_net.isNull()) {
-    const char *kind_raw = node_net["kind"];
-    if (kind_raw != NULL) {
-      size_t kind_raw_len = MIN((int)strlen(kind_raw) + 1, (int)sizeof(twin.reported.network.kind));
-      memcpy(twin.reported.network.kind, kind_raw, kind_raw_len - 1);
-    }
-    const char *mac_raw = node_net["mac"];
-    if (mac_raw != NULL) {
-      size_t mac_raw_len = MIN((int)strlen(mac_raw) + 1, (int)sizeof(twin.reported.network.mac));
-      memcpy(twin.reported.network.mac, mac_raw, mac_raw_len - 1);
-    }
-    const char *name_raw = node_net["name"];
-    if (name_raw != NULL) {
-      size_t name_raw_len = MIN((int)strlen(name_raw) + 1, (int)sizeof(twin.reported.network.name));
-      memcpy(twin.reported.network.name, name_raw, name_raw_len - 1);
+void KorraCloudHub::send_command_ack(const char *name, const char *message_id, int status, const JsonDocument &result) {
+  JsonDocument ack;
+  ack["message_id"] = message_id;
+  ack["command"] = name;
+  ack["status"] = status;
+  if (!result.isNull()) ack["result"] = result;
+
+  // prepare topic
+  size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_D2C_MESSAGE, deviceid, "command_ack");
+  char topic[topic_len + 1] = {0};
+  topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_D2C_MESSAGE, deviceid, "command_ack");
+
+  // prepare payload
+  size_t payload_len = measureJson(ack);
+  char payload[payload_len + 1] = {0};
+  payload_len = serializeJson(ack, payload, sizeof(payload));
+
+  // publish
+  send(KORRA_CLOUD_PRIORITY_COMMAND_ACK, topic, payload, payload_len);
+}
+
+void KorraCloudHub::flush_backlog() {
+  send_batch();
+  flush();
+}
+
+bool KorraCloudHub::drain() {
+  if (reported_dirty) report();
+  flush_backlog();
+  return outbox.length() == 0;
+}
+
+bool KorraCloudHub::add_direct_method(const char *name, korra_direct_method_handler handler) {
+  if (methods_count >= KORRA_DIRECT_METHODS_MAX) {
+    Serial.printf("Unable to register direct method '%s', the maximum is %d\n", name, KORRA_DIRECT_METHODS_MAX);
+    return false;
+  }
+  methods[methods_count++] = {.name = name, .handler = handler};
+  return true;
+}
+
+bool KorraCloudHub::respond(int rid, int status) {
+  char *payload = strdup("{}"); // must be a json otherwise it won't work
+  if (payload == NULL) return false;
+  return complete_direct_method(rid, status, payload, 2);
+}
+
+bool KorraCloudHub::respond(int rid, int status, const JsonVariantConst &payload) {
+  size_t payload_len = measureJson(payload);
+  char *buffer = (char *)malloc(payload_len + 1);
+  if (buffer == NULL) {
+    Serial.printf("Unable to allocate %d bytes for the response to direct method (RID: %d)\n", (int)(payload_len + 1),
+                  rid);
+    return false;
+  }
+  payload_len = serializeJson(payload, buffer, payload_len + 1);
+  return complete_direct_method(rid, status, buffer, payload_len);
+}
+
+bool KorraCloudHub::complete_direct_method(int rid, int status, char *payload, size_t payload_len) {
+  bool found = false;
+  portENTER_CRITICAL(&pending_methods_mux);
+  for (uint8_t i = 0; i < KORRA_DIRECT_METHODS_PENDING_MAX && !found; i++) {
+    struct pending_method *pending = &(pending_methods[i]);
+    if (pending->started == 0 || pending->completed || pending->rid != rid) continue;
+    pending->completed = true;
+    pending->status = status;
+    pending->payload = payload;
+    pending->payload_len = payload_len;
+    found = true;
+  }
+  portEXIT_CRITICAL(&pending_methods_mux);
+
+  if (!found) {
+    Serial.printf("Direct method (RID: %d) is not pending, it may have expired\n", rid);
+    free(payload);
+  }
+  return found;
+}
+
+void KorraCloudHub::send_direct_method_responses() {
+  for (uint8_t i = 0; i < KORRA_DIRECT_METHODS_PENDING_MAX; i++) {
+    // take the entry out under the lock, publishing happens outside of it
+    struct pending_method taken = {0};
+    portENTER_CRITICAL(&pending_methods_mux);
+    struct pending_method *pending = &(pending_methods[i]);
+    if (pending->started != 0 && (pending->completed || (millis() - pending->started) >= DIRECT_METHOD_TIMEOUT_MS)) {
+      taken = *pending;
+      *pending = {0};
     }
-    const char *local_ip_raw = node_net["local_ip"];
-    if (local_ip_raw != NULL) {
-      size_t local_ip_raw_len = MIN((int)strlen(local_ip_raw) + 1, (int)sizeof(twin.reported.network.local_ip));
-      memcpy(twin.reported.network.local_ip, local_ip_raw, local_ip_raw_len - 1);
+    portEXIT_CRITICAL(&pending_methods_mux);
+    if (taken.started == 0) continue;
+
+    if (!taken.completed) {
+      Serial.printf("Direct method (RID: %d) expired without a response\n", taken.rid);
+      continue;
     }
+    direct_method_response(taken.status, taken.rid, taken.payload, taken.payload_len);
+    free(taken.payload);
   }
 }
 
-void KorraCloudHub::direct_method_response(int status_code, int request_id) {
+void KorraCloudHub::direct_method_response(int status_code, int request_id, const char *payload, size_t payload_len) {
   // prepare topic
   size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_DIRECT_METHOD_RESPONSE, status_code, request_id);
   char topic[topic_len + 1] = {0};
   snprintf(topic, sizeof(topic), TOPIC_FORMAT_DIRECT_METHOD_RESPONSE, status_code, request_id);
-  Serial.printf("Sending message to topic '%s'\n", topic);
+  Serial.printf("Sending message to topic '%s', length %d bytes:\n%s\n", topic, (int)payload_len, payload);
 
   // publish
-  mqtt.beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
-  mqtt.print("{}"); // must be an empty json otherwise it won't work
-  mqtt.endMessage();
+  send(KORRA_CLOUD_PRIORITY_METHOD_RESPONSE, topic, payload, payload_len);
 }
@@ -3,15 +3,22 @@
 
 #include "actuator/korra_actuator.h"
 #include "korra_config.h"
+#include "metrics/korra_boot.h"
+#include "metrics/korra_metrics.h"
+#include "ota/korra_ota.h"
 #include "sensors/korra_sensors.h"
 
 #ifdef CONFIG_BOARD_HAS_INTERNET
 
 #include <ArduinoJson.h>
-#include <ArduinoMqttClient.h>
 
 #include "internet/korra_network_shared.h"
+#include "korra_cloud_budget.h"
+#include "korra_cloud_commands.h"
+#include "korra_cloud_outbox.h"
 #include "korra_cloud_shared.h"
+#include "korra_cloud_twin.h"
+#include "korra_mqtt.h"
 
 struct korra_device_twin_firmware_version {
   uint32_t value;
@@ -21,24 +28,56 @@ struct korra_device_twin_firmware_version {
 struct korra_device_twin_desired_firmware {
   struct korra_device_twin_firmware_version version; // version
   char url[256 + 1];                                 // firmware binary URL
+  char manifest[256 + 1];                            // URL of the manifest describing the image, optional
   char hash[64 + 1];                                 // SHA-256 hash in hex
-  char signature[128 + 1];                           // Signature (e.g., base64 or hex)
+  char signature[128 + 1];                           // ECDSA P-256 signature of the hash (r then s) in hex
+  uint32_t chunk_size;                               // bytes per ranged download request, zero for the default
+  char format[8 + 1];                                // encoding of the image at the URL (raw, zlib or delta)
+  uint32_t base;                                     // version a delta image is made against
+  struct korra_ota_schedule schedule;                // when and how fast to download
+};
+
+// Bounds (in seconds) of the periods that can be set from the cloud
+#define KORRA_SAMPLING_SENSORS_MIN_SEC 30
+#define KORRA_SAMPLING_SENSORS_MAX_SEC 3600
+#define KORRA_SAMPLING_TWIN_MIN_SEC 300
+#define KORRA_SAMPLING_TWIN_MAX_SEC 86400
+#define KORRA_SAMPLING_METRICS_MIN_SEC 300
+#define KORRA_SAMPLING_METRICS_MAX_SEC 86400
+
+struct korra_device_twin_sampling {
+  uint32_t sensors; // seconds between sensor readings, zero for the default
+  uint32_t twin;    // seconds between updates of the reported properties, zero for the default
+  uint32_t metrics; // seconds between metrics reports, zero for the default
 };
 
 struct korra_device_twin_desired {
   uint16_t version; // $version
   struct korra_device_twin_desired_firmware firmware;
   struct korra_actuator_config actuator;
+  struct korra_cloud_budget_config budget;
+  struct korra_device_twin_sampling sampling;
 };
 
 struct korra_device_twin_reported_firmware {
   struct korra_device_twin_firmware_version version; // version
+  struct korra_ota_progress ota;                     // state of the update in progress
 };
 
 struct korra_device_twin_reported {
   uint16_t version; // $version
   struct korra_device_twin_reported_firmware firmware;
   struct korra_network_props network;
+  struct korra_boot_times boot;
+  struct korra_device_twin_sampling sampling; // periods in use
+};
+
+/** Sections of the desired properties, used as flags to tell which ones changed. */
+enum korra_device_twin_section {
+  KORRA_DEVICE_TWIN_SECTION_FIRMWARE = 1 << 0,
+  KORRA_DEVICE_TWIN_SECTION_ACTUATOR = 1 << 1,
+  KORRA_DEVICE_TWIN_SECTION_BUDGET = 1 << 2,
+  KORRA_DEVICE_TWIN_SECTION_SAMPLING = 1 << 3,
 };
 
 struct korra_device_twin {
@@ -46,6 +85,21 @@ struct korra_device_twin {
   struct korra_device_twin_reported reported;
 };
 
+/** Most direct methods that can be registered. */
+#define KORRA_DIRECT_METHODS_MAX 8
+
+/** Most direct method invocations that can be waiting for their response at the same time. */
+#define KORRA_DIRECT_METHODS_PENDING_MAX 4
+
+/**
+ * Handler of a direct method.
+ * The payload is only valid until the handler returns, copy what is needed to respond later.
+ *
+ * @param rid The request id to pass to `KorraCloudHub::respond()`.
+ * @param payload The payload of the invocation.
+ */
+typedef void (*korra_direct_method_handler)(int rid, const JsonVariantConst &payload);
+
 /**
  * This class is a wrapper for the cloud functionalities.
  */
@@ -55,9 +109,9 @@ public:
    * Creates a new instance of the KorraCloudHub class.
    * Please note that only one instance of the class can be initialized at the same time.
    *
-   * @param client The secure TCP client to use for communication.
+   * @param mqtt The MQTT backend to use for communication.
    */
-  KorraCloudHub(Client &client);
+  KorraCloudHub(KorraMqtt &mqtt);
 
   /**
    * Cleanup resources created and managed by the KorraCloudHub class.
@@ -80,7 +134,8 @@ public:
 
   /**
    * Publishes data for configured sensors.
-   * If the connection has not been established, nothing is published.
+   * Messages are queued by priority and published as the connection and rate limits allow.
+   * When the daily budget is tight, readings are packed into fewer messages (see `KorraCloudBudget`).
    *
    * @param source All values for configured sensors.
    */
@@ -88,14 +143,31 @@ public:
 
   /**
    * Publishes data for actuators.
-   * If the connection has not been established, nothing is published.
+   * Messages are queued by priority and published as the connection and rate limits allow.
    *
    * @param source All values for configured actuators.
    */
   void push(const struct korra_actuation *source);
 
+  /**
+   * Publishes a snapshot of the runtime metrics.
+   * Messages are queued by priority and published as the connection and rate limits allow.
+   *
+   * @param source The metrics snapshot.
+   */
+  void push(const struct korra_metrics_snapshot *source);
+
+  /**
+   * Fill a JSON object with a reading of the sensors, in the same form as published in telemetry.
+   *
+   * @param node The object to fill.
+   * @param source The values of the configured sensors.
+   */
+  void populate_sensors(JsonObject node, const struct korra_sensors_data *source);
+
   /**
    * Update reported properties of the device twin.
+   * Updates are coalesced over a short window and only the fields that changed are published.
    *
    * @param props The properties to be reported.
    */
@@ -119,18 +191,82 @@ public:
   inline const struct korra_device_twin *device_twin() { return &twin; }
 
   /**
-   * Registers callback that will be called each time the twin is updated.
+   * Registers callback that will be called each time sections of the desired properties change.
+   * On the first twin received, all sections are flagged as changed.
    *
-   * @param callback The callback to register.
+   * @param callback The callback to register, `changed` holds flags of `enum korra_device_twin_section`.
    */
-  inline void onDeviceTwinUpdated(void (*callback)(struct korra_device_twin *twin, bool initial)) {
+  inline void onDeviceTwinUpdated(void (*callback)(struct korra_device_twin *twin, uint8_t changed, bool initial)) {
     device_twin_updated_callback = callback;
   }
 
-  inline void onDirectMethodInvoked(int (*callback)(const char *method_name, const JsonVariantConst &payload)) {
-    direct_method_call_callback = callback;
+  /**
+   * Registers callback that will be called to execute each command received as a cloud-to-device message.
+   * Commands are executed from `maintain()`, not from the MQTT callback, and acknowledged with the status returned.
+   *
+   * @param callback The callback to register, details may be added to `result` and are sent with the acknowledgement.
+   */
+  inline void onCommand(int (*callback)(const char *name, const JsonVariantConst &payload, JsonDocument &result)) {
+    command_callback = callback;
   }
 
+  /**
+   * Set the period at which sensors are read, used to spread the daily budget.
+   *
+   * @param period_sec Seconds between readings.
+   */
+  inline void set_sampling_period(uint32_t period_sec) { sampling_period_sec = period_sec; }
+
+  /**
+   * Publish the telemetry held back for batching and whatever the rate limits allow of the outbox.
+   */
+  void flush_backlog();
+
+  /**
+   * Publish everything pending, including reported properties still waiting to be coalesced.
+   * Meant to be called repeatedly before a restart, as the rate limits still apply.
+   *
+   * @return `true` once there is nothing left to publish.
+   */
+  bool drain();
+
+  /**
+   * Check if there are messages ready to be sent right now, other traffic should then give way.
+   */
+  inline bool busy() { return connected() && outbox.next() != NULL; }
+
+  /**
+   * Register the handler for a direct method.
+   * The handler must call `respond()` with the request id it receives, either before returning or later from any
+   * task, within the timeout set by the caller of the method (at most 5 minutes).
+   *
+   * @param name The name of the method.
+   * @param handler The handler.
+   * @return `true` if registered, `false` if there is no room for more methods.
+   */
+  bool add_direct_method(const char *name, korra_direct_method_handler handler);
+
+  /**
+   * Respond to a direct method invocation with an empty JSON object.
+   * This method is safe to call from any task.
+   *
+   * @param rid The request id given to the handler.
+   * @param status The status code (e.g. 200).
+   * @return `true` if the response will be published, `false` if the invocation is unknown or has expired.
+   */
+  bool respond(int rid, int status);
+
+  /**
+   * Respond to a direct method invocation.
+   * This method is safe to call from any task.
+   *
+   * @param rid The request id given to the handler.
+   * @param status The status code (e.g. 200).
+   * @param payload The payload of the response.
+   * @return `true` if the response will be published, `false` if the invocation is unknown or has expired.
+   */
+  bool respond(int rid, int status, const JsonVariantConst &payload);
+
   /**
    * Returns existing instance (singleton) of the KorraCloudHub class.
    * It may be a null pointer if the KorraCloudHub object was never constructed or it was destroyed.
@@ -138,20 +274,62 @@ public:
   inline static KorraCloudHub *instance() { return _instance; }
 
   /**
-   * Please do not call this method from outside the `KorraCloudProvisioning` class
+   * Please do not call this method from outside the `KorraCloudHub` class
+   */
+  void on_mqtt_message(const char *topic, const char *payload, size_t size);
+
+  /**
+   * Please do not call this method from outside the `KorraCloudHub` class
+   */
+  void on_mqtt_dropped(const char *topic);
+
+  /**
+   * Please do not call this method from outside the `KorraCloudHub` class
    */
-  void on_mqtt_message(int size);
+  void on_outbox_dropped(const struct korra_cloud_message *message);
 
 private:
-  MqttClient mqtt;
+  KorraMqtt &mqtt;
+  KorraCloudOutbox outbox;
+  KorraCloudBudget budget;
+  JsonDocument batch;
+  uint8_t batch_count = 0;
+  unsigned long batch_started = 0; // when the first reading of the batch was packed
+  uint32_t sampling_period_sec = CONFIG_SENSORS_READ_PERIOD_SECONDS;
   bool client_setup = false;
+  uint32_t client_assignment = 0; // checksum of the hostname and device ID the client was set up for
   char *username = NULL, *hostname = NULL, *deviceid = NULL;
   size_t username_len = 0, hostname_len = 0, deviceid_len = 0;
   uint16_t request_id = 1;
   bool twin_requested = false;
+  bool connected_before = false;
   struct korra_device_twin twin = {0};
-  void (*device_twin_updated_callback)(struct korra_device_twin *twin, bool initial);
-  int (*direct_method_call_callback)(const char *method_name, const JsonVariantConst &payload);
+  struct korra_device_twin_reported reported_pending = {0};
+  bool reported_dirty = false;
+  unsigned long reported_dirty_since = 0;
+  struct korra_device_twin_reported reported_sending = {0}; // the reported properties once the last patch is out
+  char reported_topic[64] = {0};                          // topic of the last patch, empty once published or dropped
+  void (*device_twin_updated_callback)(struct korra_device_twin *twin, uint8_t changed, bool initial);
+
+  KorraCloudCommands commands;
+  int (*command_callback)(const char *name, const JsonVariantConst &payload, JsonDocument &result) = NULL;
+
+  struct direct_method {
+    const char *name;
+    korra_direct_method_handler handler;
+  };
+  struct direct_method methods[KORRA_DIRECT_METHODS_MAX] = {0};
+  size_t methods_count = 0;
+
+  struct pending_method {
+    int rid;
+    unsigned long started;
+    bool completed;
+    int status;
+    char *payload;
+    size_t payload_len;
+  };
+  struct pending_method pending_methods[KORRA_DIRECT_METHODS_PENDING_MAX] = {0};
 
   /// Living instance of the KorraCloudHub class. It can be NULL.
   static KorraCloudHub *_instance;
@@ -159,9 +337,20 @@ private:
 private:
   void connect(int retries = 3, int delay_ms = 5000);
   void query_device_twin();
+  void report();
+  void send(enum korra_cloud_priority priority, const char *topic, const char *payload, size_t payload_len);
+  void flush();
+  void send_batch();
+  bool publish(const char *topic, const char *payload, size_t payload_len);
+  void apply_desired_props(const JsonVariantConst &json, bool full, bool initial);
   void populate_desired_props(const JsonVariantConst &json, struct korra_device_twin_desired *desired);
   void populate_reported_props(const JsonVariantConst &json, struct korra_device_twin_reported *reported);
-  void direct_method_response(int status_code, int request_id);
+  bool complete_direct_method(int rid, int status, char *payload, size_t payload_len);
+  void send_direct_method_responses();
+  void queue_command(const char *properties, const char *payload, size_t payload_len);
+  void run_commands();
+  void send_command_ack(const char *name, const char *message_id, int status, const JsonDocument &result);
+  void direct_method_response(int status_code, int request_id, const char *payload, size_t payload_len);
 };
 
 #endif // BOARD_HAS_INTERNET
@@ -0,0 +1,127 @@
+#include <Arduino.h>
+
+#include "korra_cloud_outbox.h"
+#include "metrics/korra_metrics.h"
+
+struct class_limits {
+  /** Messages kept before the oldest is dropped. */
+  uint8_t capacity;
+
+  /** Messages allowed per minute, zero for no limit. */
+  uint16_t per_minute;
+
+  /** Messages that can be sent at once after being idle. */
+  uint8_t burst;
+};
+
+static const struct class_limits limits[KORRA_CLOUD_PRIORITY_COUNT] = {
+    {8, 0, 0},   // KORRA_CLOUD_PRIORITY_METHOD_RESPONSE
+    {4, 30, 4},  // KORRA_CLOUD_PRIORITY_TWIN
+    {16, 30, 8}, // KORRA_CLOUD_PRIORITY_COMMAND_ACK (a full command queue and as many rejections)
+    {8, 30, 4},  // KORRA_CLOUD_PRIORITY_ACTUATION
+    {16, 12, 4}, // KORRA_CLOUD_PRIORITY_TELEMETRY
+};
+
+KorraCloudOutbox::KorraCloudOutbox() {
+  memset(queues, 0, sizeof(queues));
+  for (uint8_t i = 0; i < KORRA_CLOUD_PRIORITY_COUNT; i++) {
+    queues[i].tokens = limits[i].burst;
+  }
+}
+
+KorraCloudOutbox::~KorraCloudOutbox() {
+  clear();
+}
+
+bool KorraCloudOutbox::enqueue(enum korra_cloud_priority priority, const char *topic, const char *payload,
+                               size_t payload_len) {
+  struct queue *q = &(queues[priority]);
+  if (q->length >= limits[priority].capacity) {
+    Serial.printf("Outbox full for priority %d, dropping the oldest message to '%s'\n", priority, q->head->topic);
+    if (dropped_callback != NULL) dropped_callback(q->head);
+    pop(priority);
+    KorraMetrics::increment(KORRA_METRICS_COUNTER_OUTBOX_DROPPED);
+  }
+
+  // one allocation for the message, topic and payload
+  size_t topic_len = strlen(topic);
+  struct korra_cloud_message *message =
+      (struct korra_cloud_message *)malloc(sizeof(struct korra_cloud_message) + topic_len + 1 + payload_len + 1);
+  if (message == NULL) {
+    Serial.printf("Unable to allocate %d bytes for message to '%s'\n", (int)payload_len, topic);
+    KorraMetrics::increment(KORRA_METRICS_COUNTER_OUTBOX_DROPPED);
+    return false;
+  }
+  message->next = NULL;
+  message->priority = priority;
+  message->attempts = 0;
+  message->topic = (char *)(message + 1);
+  memcpy(message->topic, topic, topic_len + 1);
+  message->payload = message->topic + topic_len + 1;
+  memcpy(message->payload, payload, payload_len);
+  message->payload[payload_len] = '\0';
+  message->payload_len = payload_len;
+
+  if (q->tail) {
+    q->tail->next = message;
+  } else {
+    q->head = message;
+  }
+  q->tail = message;
+  q->length++;
+  total++;
+  KorraMetrics::set(KORRA_METRICS_GAUGE_OUTBOX_LENGTH, total);
+  return true;
+}
+
+struct korra_cloud_message *KorraCloudOutbox::next() {
+  for (uint8_t i = 0; i < KORRA_CLOUD_PRIORITY_COUNT; i++) {
+    enum korra_cloud_priority priority = (enum korra_cloud_priority)i;
+    if (queues[i].head == NULL || queues[i].held) continue;
+    if (!has_token(priority)) continue; // a lower class may still be within its limit
+    return queues[i].head;
+  }
+  return NULL;
+}
+
+void KorraCloudOutbox::remove(struct korra_cloud_message *message) {
+  struct queue *q = &(queues[message->priority]);
+  if (q->head != message) return; // only the head is ever handed out
+  if (limits[message->priority].per_minute) q->tokens -= 1;
+  pop(message->priority);
+}
+
+void KorraCloudOutbox::clear() {
+  for (uint8_t i = 0; i < KORRA_CLOUD_PRIORITY_COUNT; i++) {
+    while (queues[i].head) pop((enum korra_cloud_priority)i);
+  }
+}
+
+size_t KorraCloudOutbox::room(enum korra_cloud_priority priority) {
+  return limits[priority].capacity - queues[priority].length;
+}
+
+bool KorraCloudOutbox::has_token(enum korra_cloud_priority priority) {
+  const struct class_limits *limit = &(limits[priority]);
+  if (limit->per_minute == 0) return true;
+
+  // token bucket, refilled continuously up to the burst size
+  struct queue *q = &(queues[priority]);
+  unsigned long now = millis();
+  q->tokens = MIN((float)limit->burst, q->tokens + ((now - q->refilled) * limit->per_minute) / 60000.0f);
+  q->refilled = now;
+  return q->tokens >= 1;
+}
+
+void KorraCloudOutbox::pop(enum korra_cloud_priority priority) {
+  struct queue *q = &(queues[priority]);
+  struct korra_cloud_message *message = q->head;
+  if (message == NULL) return;
+
+  q->head = message->next;
+  if (q->head == NULL) q->tail = NULL;
+  q->length--;
+  total--;
+  free(message);
+  KorraMetrics::set(KORRA_METRICS_GAUGE_OUTBOX_LENGTH, total);
+}
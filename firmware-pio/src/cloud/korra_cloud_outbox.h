@@ -0,0 +1,131 @@
+#ifndef KORRA_CLOUD_OUTBOX_H_
+#define KORRA_CLOUD_OUTBOX_H_
+
+#include "korra_config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum korra_cloud_priority {
+  /** Responses to direct methods, the hub stops waiting for them after a timeout. */
+  KORRA_CLOUD_PRIORITY_METHOD_RESPONSE = 0,
+
+  /** Device twin requests and reported properties. */
+  KORRA_CLOUD_PRIORITY_TWIN,
+
+  /** Acknowledgements of commands, which arrive together after being offline. */
+  KORRA_CLOUD_PRIORITY_COMMAND_ACK,
+
+  /** Actuation events. */
+  KORRA_CLOUD_PRIORITY_ACTUATION,
+
+  /** Sensor data, metrics and any backlog of them. */
+  KORRA_CLOUD_PRIORITY_TELEMETRY,
+
+  KORRA_CLOUD_PRIORITY_COUNT, // must be last
+};
+
+struct korra_cloud_message {
+  /** The next message with the same priority. */
+  struct korra_cloud_message *next;
+
+  /** The priority class of the message. */
+  enum korra_cloud_priority priority;
+
+  /** Number of failed attempts to publish the message. */
+  uint8_t attempts;
+
+  /** The topic, NULL terminated. */
+  char *topic;
+
+  /** The payload, NULL terminated. */
+  char *payload;
+
+  /** The length of the payload. */
+  size_t payload_len;
+};
+
+/**
+ * This class holds messages waiting to be published, one queue per priority class.
+ * Each class has a bounded length (the oldest message is dropped when full) and a rate limit,
+ * so that a backlog of telemetry never delays messages of a higher class.
+ */
+class KorraCloudOutbox {
+public:
+  /**
+   * Creates a new instance of the KorraCloudOutbox class.
+   */
+  KorraCloudOutbox();
+
+  /**
+   * Cleanup resources created and managed by the KorraCloudOutbox class.
+   */
+  ~KorraCloudOutbox();
+
+  /**
+   * Add a message to the queue of its class. The topic and payload are copied.
+   *
+   * @return `true` if queued, `false` if memory could not be allocated.
+   */
+  bool enqueue(enum korra_cloud_priority priority, const char *topic, const char *payload, size_t payload_len);
+
+  /**
+   * Get the message to publish next.
+   * This is the oldest message of the highest priority class that is within its rate limit.
+   *
+   * @return the message or `NULL` if none can be published now.
+   */
+  struct korra_cloud_message *next();
+
+  /**
+   * Remove a message (returned by `next()`) once published or given up on.
+   * This counts against the rate limit of its class.
+   */
+  void remove(struct korra_cloud_message *message);
+
+  /**
+   * Hold back (or release) the messages of a class, `next()` skips held classes.
+   */
+  inline void hold(enum korra_cloud_priority priority, bool held) { queues[priority].held = held; }
+
+  /**
+   * Remove all messages.
+   */
+  void clear();
+
+  /**
+   * Get the number of messages queued.
+   */
+  inline size_t length() { return total; }
+
+  /**
+   * Get the number of messages that can be added to a class before the oldest is dropped.
+   */
+  size_t room(enum korra_cloud_priority priority);
+
+  /**
+   * Registers callback that will be called for each message dropped because its class was full.
+   * The message is only valid during the call.
+   *
+   * @param callback The callback to register.
+   */
+  inline void onDropped(void (*callback)(const struct korra_cloud_message *message)) { dropped_callback = callback; }
+
+private:
+  struct queue {
+    struct korra_cloud_message *head, *tail;
+    uint8_t length;
+    bool held;
+    float tokens;
+    unsigned long refilled;
+  };
+  struct queue queues[KORRA_CLOUD_PRIORITY_COUNT];
+  size_t total = 0;
+  void (*dropped_callback)(const struct korra_cloud_message *message) = NULL;
+
+private:
+  bool has_token(enum korra_cloud_priority priority);
+  void pop(enum korra_cloud_priority priority);
+};
+
+#endif // KORRA_CLOUD_OUTBOX_H_
@@ -22,48 +22,38 @@ static void on_mqtt_message_callback(int size) {
   KorraCloudProvisioning::instance()->on_mqtt_message(size);
 }
 
-KorraCloudProvisioning::KorraCloudProvisioning(Client &client, Preferences &prefs, Timer<> &timer)
-    : mqtt(client), prefs(prefs), timer(timer) {
+KorraCloudProvisioning::KorraCloudProvisioning(Preferences &prefs, Timer<> &timer) : prefs(prefs), timer(timer) {
   _instance = this;
 }
 
 KorraCloudProvisioning::~KorraCloudProvisioning() {
   _instance = NULL;
 
-  if (username) {
-    free(username);
-    username = NULL;
-  }
-  username_len = 0;
-
-  free_status();
+  teardown();
 }
 
 void KorraCloudProvisioning::begin(const char *regid, const size_t regid_len) {
-  // if we have valid info, there is nothing todo
-  load();
-  if (info()->valid) return;
+  this->regid = regid;
 
-  // prepare username as per spec
-  username_len = snprintf(NULL, 0, USERNAME_FORMAT, CONFIG_AZURE_IOT_DPS_ID_SCOPE, regid) + 1; // plus NULL
-  username = (char *)malloc(username_len);
-  if (username == NULL) {
-    Serial.printf("Unable to allocate %d bytes for username\n", username_len);
-    while (1);
-  }
-  username_len = snprintf(username, username_len, USERNAME_FORMAT, CONFIG_AZURE_IOT_DPS_ID_SCOPE, regid);
+  // the clients are only built when provisioning is needed (see maintain())
+  load();
+}
 
-  // setup the MQTT client
-  mqtt.setId(regid);
-  mqtt.setCleanSession(true);           // must be true (1) for DPS
-  mqtt.setKeepAliveInterval(30 * 1000); // 30 seconds (default 60 seconds)
-  mqtt.setUsernamePassword(username, "" /* password (library throws when NULL) */);
-  mqtt.onMessage(on_mqtt_message_callback);
+void KorraCloudProvisioning::set_tls_credentials(mbedtls_x509_crt *trust_store, const struct korra_der_buffer *cert,
+                                                 const struct korra_der_buffer *key) {
+  this->trust_store = trust_store;
+  this->cert = cert;
+  this->key = key;
 }
 
 void KorraCloudProvisioning::maintain() {
-  // if we have valid info, there is nothing todo
-  if (info()->valid) return;
+  // if we have valid info, free the clients (done here because the message callback runs inside the client)
+  if (info()->valid) {
+    teardown();
+    return;
+  }
+
+  if (!build()) return;
 
   if (!connected()) {
     registration_requested = false;
@@ -72,13 +62,13 @@ void KorraCloudProvisioning::maintain() {
     // if now connected, subscribe to topics
     if (connected()) {
       // subscribe to topic for registration results
-      mqtt.subscribe(TOPIC_REGISTRATION_RESULT_FILTER, /* qos */ 0);
+      mqtt->subscribe(TOPIC_REGISTRATION_RESULT_FILTER, /* qos */ 0);
     }
   }
 
   if (!connected()) return;
 
-  mqtt.poll();
+  mqtt->poll();
 
   // request registration if not requested
   if (!registration_requested) {
@@ -86,9 +76,9 @@ void KorraCloudProvisioning::maintain() {
     size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_REGISTER, request_id);
     char topic[topic_len + 1] = {0};
     topic_len = snprintf(topic, sizeof(topic), TOPIC_FORMAT_REGISTER, request_id);
-    mqtt.beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
-    mqtt.print("{}"); // must be an empty json otherwise it won't work
-    mqtt.endMessage();
+    mqtt->beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
+    mqtt->print("{}"); // must be an empty json otherwise it won't work
+    mqtt->endMessage();
     request_id++;
     registration_requested = true;
   }
@@ -125,18 +115,79 @@ void KorraCloudProvisioning::save() {
 void KorraCloudProvisioning::clear() {
   prefs.remove(PREFERENCES_KEY_HOSTNAME);
   prefs.remove(PREFERENCES_KEY_DEVICEID);
+  stored_info = {0};
+  registration_requested = false;
+}
+
+bool KorraCloudProvisioning::build() {
+  if (mqtt) return true;
+
+  Serial.printf("Building provisioning clients. Free heap: %lu bytes\n", (unsigned long)ESP.getFreeHeap());
+
+  // prepare username as per spec
+  username_len = snprintf(NULL, 0, USERNAME_FORMAT, CONFIG_AZURE_IOT_DPS_ID_SCOPE, regid) + 1; // plus NULL
+  username = (char *)malloc(username_len);
+  if (username == NULL) {
+    Serial.printf("Unable to allocate %d bytes for username\n", (int)username_len);
+    return false;
+  }
+  username_len = snprintf(username, username_len, USERNAME_FORMAT, CONFIG_AZURE_IOT_DPS_ID_SCOPE, regid);
+
+  // setup the TLS client
+  client = new KorraTlsClient();
+  client->set_trust_store(trust_store);
+  client->set_certificate(cert);
+  client->set_private_key(key);
+#ifdef CONFIG_TLS_PROFILE_LOW_MEMORY
+  client->set_profile(KORRA_TLS_PROFILE_LOW_MEMORY);
+#endif // CONFIG_TLS_PROFILE_LOW_MEMORY
+
+  // setup the MQTT client
+  mqtt = new MqttClient(client);
+  mqtt->setId(regid);
+  mqtt->setCleanSession(true);           // must be true (1) for DPS
+  mqtt->setKeepAliveInterval(30 * 1000); // 30 seconds (default 60 seconds)
+  mqtt->setUsernamePassword(username, "" /* password (library throws when NULL) */);
+  mqtt->onMessage(on_mqtt_message_callback);
+
+  return true;
+}
+
+void KorraCloudProvisioning::teardown() {
+  if (mqtt == NULL && client == NULL && username == NULL) return;
+
+  if (mqtt) {
+    mqtt->stop();
+    delete mqtt;
+    mqtt = NULL;
+  }
+
+  if (client) {
+    delete client;
+    client = NULL;
+  }
+
+  if (username) {
+    free(username);
+    username = NULL;
+  }
+  username_len = 0;
+
+  free_status();
+  registration_requested = false;
+  Serial.printf("Released provisioning clients. Free heap: %lu bytes\n", (unsigned long)ESP.getFreeHeap());
 }
 
 void KorraCloudProvisioning::connect(int retries, int delay_ms) {
   for (int i = 0; i < retries; i++) {
     // connect with retries
     Serial.printf("Connecting to DPS server... (%d/%d)\n", i + 1, retries);
-    mqtt.connect(DPS_HOSTNAME, 8883);
+    mqtt->connect(DPS_HOSTNAME, 8883);
     if (connected()) {
       Serial.println("Connected to DPS server.");
       break;
     }
-    Serial.printf("Failed to connect to DPS server (%d). Retrying in %d ms...\n", mqtt.connectError(), delay_ms);
+    Serial.printf("Failed to connect to DPS server (%d). Retrying in %d ms...\n", mqtt->connectError(), delay_ms);
     delay(delay_ms);
   }
 
@@ -146,26 +197,28 @@ void KorraCloudProvisioning::connect(int retries, int delay_ms) {
 }
 
 void KorraCloudProvisioning::query_registration_result() {
+  if (!connected()) return; // torn down or disconnected since it was scheduled
+
   Serial.printf("Requesting DPS registration result for operationId='%s' and rid: %d\n", status.operation_id,
                 request_id);
   size_t topic_len = snprintf(NULL, 0, TOPIC_FORMAT_GET_STATUS, request_id, status.operation_id);
   char topic[topic_len + 1] = {0};
   snprintf(topic, sizeof(topic), TOPIC_FORMAT_GET_STATUS, request_id, status.operation_id);
-  mqtt.beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
-  mqtt.print("{}"); // must be an empty json otherwise it won't work
-  mqtt.endMessage();
+  mqtt->beginMessage(topic, /* retain */ false, /* qos */ 0, /* dup */ false);
+  mqtt->print("{}"); // must be an empty json otherwise it won't work
+  mqtt->endMessage();
 }
 
 void KorraCloudProvisioning::on_mqtt_message(int size) {
   // Keep the String alive until the function ends since we depend on it.
   // Converting direct with c_str(), discards the string but we need it.
-  String topic_str = mqtt.messageTopic();
+  String topic_str = mqtt->messageTopic();
   const char *topic = topic_str.c_str();
   Serial.printf("Received a message on topic '%s', length %d bytes:\n", topic, size);
 
   // read payload
   char payload[size + 1] = {0};
-  mqtt.readBytes(payload, size);
+  mqtt->readBytes(payload, size);
   Serial.printf("%s\n", payload);
 
   // sample topics
@@ -256,8 +309,8 @@ void KorraCloudProvisioning::on_mqtt_message(int size) {
     stored_info.valid = stored_info.hostname_len > 0 && stored_info.id_len > 0;
     save();
 
-    // disconnect from the server
-    mqtt.stop();
+    // disconnect from the server (the clients are freed on the next maintain)
+    mqtt->stop();
   } else {
     // it is likely a transient error, we should actually parse the error
     // TODO: parse the error
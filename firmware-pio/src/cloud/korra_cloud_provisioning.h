@@ -10,9 +10,11 @@
 #include <arduino-timer.h>
 
 #include "korra_cloud_shared.h"
+#include "tls/korra_tls_client.h"
 
 /**
  * This class is a wrapper for the cloud functionalities.
+ * The TLS and MQTT clients are only created while provisioning is needed and freed once it succeeds.
  */
 class KorraCloudProvisioning {
 public:
@@ -20,11 +22,10 @@ public:
    * Creates a new instance of the KorraCloudProvisioning class.
    * Please note that only one instance of the class can be initialized at the same time.
    *
-   * @param client The secure TCP client to use for communication.
    * @param prefs The preferences instance to use for storing the provisioning info.
    * @param timer The timer instance to use for scheduling repetitive or future tasks.
    */
-  KorraCloudProvisioning(Client &client, Preferences &prefs, Timer<> &timer);
+  KorraCloudProvisioning(Preferences &prefs, Timer<> &timer);
 
   /**
    * Cleanup resources created and managed by the KorraCloudProvisioning class.
@@ -40,6 +41,17 @@ public:
    */
   void begin(const char *regid, const size_t regid_len);
 
+  /**
+   * Set the credentials used for the secure connection.
+   * The values are not copied and must remain valid for as long as provisioning may be needed.
+   *
+   * @param trust_store The parsed root CA certificates.
+   * @param cert The device certificate in DER form.
+   * @param key The device private key in DER form.
+   */
+  void set_tls_credentials(mbedtls_x509_crt *trust_store, const struct korra_der_buffer *cert,
+                           const struct korra_der_buffer *key);
+
   /**
    * This method should be called periodically inside the main loop of the firmware.
    * It's safe to call this method in some interval (like 5ms).
@@ -48,6 +60,7 @@ public:
 
   /**
    * Clears the provisioning info.
+   * The next call to `maintain()` provisions the device again.
    */
   void clear();
 
@@ -61,12 +74,14 @@ public:
    *
    * @return `true` if the connection is established, `false` otherwise.
    */
-  inline bool connected() { return mqtt.connected(); }
+  inline bool connected() { return mqtt && mqtt->connected(); }
 
   /**
    * Disconnect the client from the cloud.
    */
-  inline void disconnect() { mqtt.stop(); }
+  inline void disconnect() {
+    if (mqtt) mqtt->stop();
+  }
 
   /**
    * Returns existing instance (singleton) of the KorraCloudProvisioning class.
@@ -181,7 +196,11 @@ protected:
 
 private:
   Preferences &prefs;
-  MqttClient mqtt;
+  KorraTlsClient *client = NULL;
+  MqttClient *mqtt = NULL;
+  mbedtls_x509_crt *trust_store = NULL;
+  const struct korra_der_buffer *cert = NULL, *key = NULL;
+  const char *regid = NULL;
   korra_cloud_provisioning_info stored_info = {0};
   registration_operation_status status = {0};
   char *username = NULL;
@@ -198,6 +217,8 @@ private:
   void load();
   void save();
   void connect(int retries = 3, int delay_ms = 5000);
+  bool build();
+  void teardown();
   provisioning_registration_status parse_status(const char *value);
   provisioning_registration_sub_status parse_sub_status(const char *value);
   void free_status();
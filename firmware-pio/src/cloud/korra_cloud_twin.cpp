@@ -0,0 +1,123 @@
+#include <Arduino.h>
+
+#include "korra_cloud_twin.h"
+
+static JsonVariantConst find(const JsonVariantConst &root, const struct korra_twin_field *field) {
+  JsonVariantConst node = root;
+  for (uint8_t i = 0; i < KORRA_TWIN_FIELD_DEPTH && field->path[i] && !node.isNull(); i++) {
+    node = node[field->path[i]];
+  }
+  return node;
+}
+
+// returns the object that holds the last key of the path, creating the objects on the way
+static JsonVariant parent(JsonVariant root, const struct korra_twin_field *field, const char **leaf) {
+  JsonVariant node = root;
+  uint8_t i = 0;
+  while (i + 1 < KORRA_TWIN_FIELD_DEPTH && field->path[i + 1]) {
+    JsonVariant child = node[field->path[i]];
+    node = child.isNull() ? node[field->path[i]].to<JsonObject>() : child;
+    i++;
+  }
+  *leaf = field->path[i];
+  return node;
+}
+
+void KorraCloudTwin::read(const struct korra_twin_field *fields, size_t count, const JsonVariantConst &json,
+                          void *dest) {
+  for (size_t i = 0; i < count; i++) {
+    const struct korra_twin_field *field = &(fields[i]);
+    JsonVariantConst node = find(json, field);
+    if (node.isNull()) continue;
+
+    uint8_t *value = (uint8_t *)dest + field->offset;
+    switch (field->type) {
+    case KORRA_TWIN_FIELD_BOOL:
+      *(bool *)value = node.as<bool>();
+      break;
+    case KORRA_TWIN_FIELD_UINT16:
+      *(uint16_t *)value = node.as<uint16_t>();
+      break;
+    case KORRA_TWIN_FIELD_UINT32:
+      *(uint32_t *)value = node.as<uint32_t>();
+      break;
+    case KORRA_TWIN_FIELD_FLOAT:
+      *(float *)value = node.as<float>();
+      break;
+    case KORRA_TWIN_FIELD_STRING: {
+      // unused bytes are zeroed so that the struct can be compared as a whole
+      const char *raw = node.as<const char *>();
+      if (raw == NULL) break;
+      strncpy((char *)value, raw, field->size - 1);
+      value[field->size - 1] = '\0';
+      break;
+    }
+    case KORRA_TWIN_FIELD_UINT32_ARRAY:
+      for (uint8_t j = 0; j < field->size / sizeof(uint32_t); j++) {
+        JsonVariantConst entry = node[field->key(j)];
+        if (!entry.isNull()) ((uint32_t *)value)[j] = entry.as<uint32_t>();
+      }
+      break;
+    }
+  }
+}
+
+size_t KorraCloudTwin::diff(const struct korra_twin_field *fields, size_t count, const void *next, void *current,
+                            JsonVariant patch) {
+  size_t changes = 0;
+  for (size_t i = 0; i < count; i++) {
+    const struct korra_twin_field *field = &(fields[i]);
+    const uint8_t *src = (const uint8_t *)next + field->offset;
+    uint8_t *dst = (uint8_t *)current + field->offset;
+
+    if (field->type == KORRA_TWIN_FIELD_UINT32_ARRAY) {
+      // entries are compared (and patched) one by one
+      for (uint8_t j = 0; j < field->size / sizeof(uint32_t); j++) {
+        uint32_t value = ((const uint32_t *)src)[j];
+        if (value == ((uint32_t *)dst)[j]) continue;
+        ((uint32_t *)dst)[j] = value;
+
+        const char *leaf;
+        JsonVariant node = parent(patch, field, &leaf);
+        JsonVariant entries = node[leaf];
+        if (entries.isNull()) entries = node[leaf].to<JsonObject>();
+        entries[field->key(j)] = value;
+        changes++;
+      }
+      continue;
+    }
+
+    bool changed = field->type == KORRA_TWIN_FIELD_STRING ? strncmp((const char *)src, (char *)dst, field->size) != 0
+                                                          : memcmp(src, dst, field->size) != 0;
+    if (!changed) continue;
+    if (field->type == KORRA_TWIN_FIELD_STRING) {
+      snprintf((char *)dst, field->size, "%s", (const char *)src);
+    } else {
+      memcpy(dst, src, field->size);
+    }
+
+    const char *leaf;
+    JsonVariant node = parent(patch, field, &leaf);
+    switch (field->type) {
+    case KORRA_TWIN_FIELD_BOOL:
+      node[leaf] = *(const bool *)src;
+      break;
+    case KORRA_TWIN_FIELD_UINT16:
+      node[leaf] = *(const uint16_t *)src;
+      break;
+    case KORRA_TWIN_FIELD_UINT32:
+      node[leaf] = *(const uint32_t *)src;
+      break;
+    case KORRA_TWIN_FIELD_FLOAT:
+      node[leaf] = *(const float *)src;
+      break;
+    case KORRA_TWIN_FIELD_STRING:
+      node[leaf] = (const char *)src;
+      break;
+    default:
+      break;
+    }
+    changes++;
+  }
+  return changes;
+}
@@ -0,0 +1,88 @@
+#ifndef KORRA_CLOUD_TWIN_H_
+#define KORRA_CLOUD_TWIN_H_
+
+#include "korra_config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ArduinoJson.h>
+
+/** Most keys from the root of the twin to a field. */
+#define KORRA_TWIN_FIELD_DEPTH 3
+
+enum korra_twin_field_type {
+  KORRA_TWIN_FIELD_BOOL = 0,
+  KORRA_TWIN_FIELD_UINT16,
+  KORRA_TWIN_FIELD_UINT32,
+  KORRA_TWIN_FIELD_FLOAT,
+
+  /** A NULL terminated char array, truncated when read if longer. */
+  KORRA_TWIN_FIELD_STRING,
+
+  /** An array of `uint32_t` reported as an object whose keys come from `key`. */
+  KORRA_TWIN_FIELD_UINT32_ARRAY,
+};
+
+struct korra_twin_field {
+  /** Keys from the root of the twin section to the field, unused entries are NULL. */
+  const char *path[KORRA_TWIN_FIELD_DEPTH];
+
+  /** The type of the field. */
+  enum korra_twin_field_type type;
+
+  /** Offset of the field in its struct. */
+  size_t offset;
+
+  /** Size of the field in bytes. */
+  size_t size;
+
+  /** Key for each entry of an array (only for `KORRA_TWIN_FIELD_UINT32_ARRAY`). */
+  const char *(*key)(uint8_t index);
+};
+
+/**
+ * Declare a field of a struct, the type is one of `enum korra_twin_field_type` without the prefix.
+ * e.g. KORRA_TWIN_FIELD(struct korra_device_twin_reported, STRING, network.kind, "network", "kind")
+ */
+#define KORRA_TWIN_FIELD(strukt, type, member, ...)                                                                    \
+  {{__VA_ARGS__}, KORRA_TWIN_FIELD_##type, offsetof(strukt, member), sizeof(((strukt *)0)->member), NULL}
+
+/**
+ * Declare an array field of a struct whose entries are keyed by `key_fn`.
+ */
+#define KORRA_TWIN_FIELD_ARRAY(strukt, member, key_fn, ...)                                                            \
+  {{__VA_ARGS__}, KORRA_TWIN_FIELD_UINT32_ARRAY, offsetof(strukt, member), sizeof(((strukt *)0)->member), key_fn}
+
+/**
+ * This class maps between twin JSON and structs using a table of field descriptors,
+ * so that a field is declared once and reading, comparing and patching all follow from it.
+ */
+class KorraCloudTwin {
+public:
+  /**
+   * Set the fields present in the JSON, others are left untouched.
+   *
+   * @param fields The descriptors.
+   * @param count The number of descriptors.
+   * @param json The JSON of the twin section.
+   * @param dest The struct to populate.
+   */
+  static void read(const struct korra_twin_field *fields, size_t count, const JsonVariantConst &json, void *dest);
+
+  /**
+   * Compare two structs and write the fields that differ to a JSON patch.
+   * The changed values are copied into `current` so that it matches `next` afterwards.
+   *
+   * @param fields The descriptors.
+   * @param count The number of descriptors.
+   * @param next The struct with the new values.
+   * @param current The struct with the values last reported.
+   * @param patch The JSON object to write the changes to.
+   * @return The number of values that changed.
+   */
+  static size_t diff(const struct korra_twin_field *fields, size_t count, const void *next, void *current,
+                     JsonVariant patch);
+};
+
+#endif // KORRA_CLOUD_TWIN_H_
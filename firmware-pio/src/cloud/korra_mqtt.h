@@ -0,0 +1,21 @@
+#ifndef KORRA_MQTT_H_
+#define KORRA_MQTT_H_
+
+#include "korra_config.h"
+
+#ifdef CONFIG_BOARD_HAS_INTERNET
+
+// The hub talks MQTT through one of the backends below, both expose the same methods.
+// ESP-IDF's esp-mqtt runs in its own task and queues outbound messages, while ArduinoMqttClient
+// runs on the main loop over our own TLS client (with session resumption and the TLS profiles).
+#ifdef CONFIG_HUB_MQTT_ESP
+#include "korra_mqtt_esp.h"
+typedef KorraMqttEsp KorraMqtt;
+#else
+#include "korra_mqtt_arduino.h"
+typedef KorraMqttArduino KorraMqtt;
+#endif // CONFIG_HUB_MQTT_ESP
+
+#endif // CONFIG_BOARD_HAS_INTERNET
+
+#endif // KORRA_MQTT_H_
@@ -0,0 +1,62 @@
+#include "korra_mqtt_arduino.h"
+
+#if defined(CONFIG_BOARD_HAS_INTERNET) && !defined(CONFIG_HUB_MQTT_ESP)
+
+KorraMqttArduino *KorraMqttArduino::_instance = NULL;
+
+static void on_mqtt_message_callback(int size) {
+  KorraMqttArduino::instance()->on_mqtt_message(size);
+}
+
+KorraMqttArduino::KorraMqttArduino(KorraTlsClient &client) : client(client), mqtt(client) {
+  _instance = this;
+}
+
+KorraMqttArduino::~KorraMqttArduino() {
+  _instance = NULL;
+}
+
+void KorraMqttArduino::set_tls_credentials(mbedtls_x509_crt *trust_store, const struct korra_der_buffer *cert,
+                                           const struct korra_der_buffer *key) {
+  client.set_trust_store(trust_store);
+  client.set_certificate(cert);
+  client.set_private_key(key);
+}
+
+void KorraMqttArduino::configure(const char *id, const char *username, uint16_t keep_alive_sec, bool clean_session) {
+  mqtt.setId(id);
+  mqtt.setTxPayloadSize(512); // defaults to 256
+  mqtt.setCleanSession(clean_session);
+  mqtt.setKeepAliveInterval(keep_alive_sec * 1000);
+  mqtt.setUsernamePassword(username, "" /* password (library throws when NULL) */);
+  mqtt.onMessage(on_mqtt_message_callback);
+}
+
+bool KorraMqttArduino::connect(const char *host, uint16_t port) {
+  return mqtt.connect(host, port) == 1;
+}
+
+bool KorraMqttArduino::subscribe(const char *topic, uint8_t qos) {
+  return mqtt.subscribe(topic, qos) == 1;
+}
+
+bool KorraMqttArduino::publish(const char *topic, const uint8_t *payload, size_t payload_len, uint8_t qos) {
+  // passing the size streams the payload instead of buffering it, so it is not limited by the TX payload size
+  mqtt.beginMessage(topic, payload_len, /* retain */ false, qos, /* dup */ false);
+  mqtt.write(payload, payload_len);
+  return mqtt.endMessage() == 1;
+}
+
+void KorraMqttArduino::on_mqtt_message(int size) {
+  // Keep the String alive until the function ends since we depend on it.
+  // Converting direct with c_str(), discards the string but we need it.
+  String topic = mqtt.messageTopic();
+
+  // read payload
+  char payload[size + 1] = {0};
+  mqtt.readBytes(payload, size);
+
+  if (message_callback != NULL) message_callback(topic.c_str(), payload, size);
+}
+
+#endif // CONFIG_BOARD_HAS_INTERNET && !CONFIG_HUB_MQTT_ESP
@@ -0,0 +1,133 @@
+#ifndef KORRA_MQTT_ARDUINO_H_
+#define KORRA_MQTT_ARDUINO_H_
+
+#include "korra_config.h"
+
+#ifdef CONFIG_BOARD_HAS_INTERNET
+
+#include <ArduinoMqttClient.h>
+
+#include "tls/korra_tls_client.h"
+
+/**
+ * This class is the MQTT backend built on ArduinoMqttClient.
+ * Everything happens on the calling task, so `poll()` must be called often for messages to be received.
+ */
+class KorraMqttArduino {
+public:
+  /**
+   * Creates a new instance of the KorraMqttArduino class.
+   * Please note that only one instance of the class can be initialized at the same time.
+   *
+   * @param client The secure TCP client to use for communication.
+   */
+  KorraMqttArduino(KorraTlsClient &client);
+
+  /**
+   * Cleanup resources created and managed by the KorraMqttArduino class.
+   */
+  ~KorraMqttArduino();
+
+  /**
+   * Set the credentials used for the secure connection.
+   * The values are not copied and must remain valid for as long as the client is used.
+   *
+   * @param trust_store The parsed root CA certificates.
+   * @param cert The device certificate in DER form.
+   * @param key The device private key in DER form.
+   */
+  void set_tls_credentials(mbedtls_x509_crt *trust_store, const struct korra_der_buffer *cert,
+                           const struct korra_der_buffer *key);
+
+  /**
+   * Set the session options. Must be called before connecting.
+   * The values are not copied and must remain valid for as long as the client is used.
+   *
+   * @param id The client identifier.
+   * @param username The username (the password is always empty).
+   * @param keep_alive_sec The keep alive interval in seconds.
+   * @param clean_session Whether the server should discard the previous session.
+   */
+  void configure(const char *id, const char *username, uint16_t keep_alive_sec, bool clean_session);
+
+  /**
+   * Connect to the server. Blocks until connected or failed.
+   *
+   * @return `true` if connected, `false` otherwise.
+   */
+  bool connect(const char *host, uint16_t port);
+
+  /**
+   * Check if the connection is established.
+   */
+  inline bool connected() { return mqtt.connected(); }
+
+  /**
+   * Disconnect from the server.
+   */
+  inline void stop() { mqtt.stop(); }
+
+  /**
+   * Get the error of the last connection attempt.
+   */
+  inline int connect_error() { return mqtt.connectError(); }
+
+  /**
+   * Subscribe to a topic (filter).
+   */
+  bool subscribe(const char *topic, uint8_t qos);
+
+  /**
+   * Publish a message. The payload is streamed so it is not limited by the TX payload size.
+   *
+   * @return `true` if the message was sent, `false` otherwise.
+   */
+  bool publish(const char *topic, const uint8_t *payload, size_t payload_len, uint8_t qos);
+
+  /**
+   * Process incoming messages and keep the connection alive.
+   * Received messages are passed to the message callback from within this call.
+   */
+  inline void poll() { mqtt.poll(); }
+
+  /**
+   * Registers callback that will be called for each message received.
+   * The topic and payload are NULL terminated and only valid during the call.
+   *
+   * @param callback The callback to register.
+   */
+  inline void onMessage(void (*callback)(const char *topic, const char *payload, size_t payload_len)) {
+    message_callback = callback;
+  }
+
+  /**
+   * Registers callback that will be called for each message received but not delivered.
+   * Messages are delivered as they are read on the calling task, so this backend never calls it.
+   *
+   * @param callback The callback to register.
+   */
+  inline void onDropped(void (*callback)(const char *topic)) {}
+
+  /**
+   * Returns existing instance (singleton) of the KorraMqttArduino class.
+   * It may be a null pointer if the KorraMqttArduino object was never constructed or it was destroyed.
+   */
+  inline static KorraMqttArduino *instance() { return _instance; }
+
+  /**
+   * Please do not call this method from outside the `KorraMqttArduino` class
+   */
+  void on_mqtt_message(int size);
+
+private:
+  KorraTlsClient &client;
+  MqttClient mqtt;
+  void (*message_callback)(const char *topic, const char *payload, size_t payload_len) = NULL;
+
+  /// Living instance of the KorraMqttArduino class. It can be NULL.
+  static KorraMqttArduino *_instance;
+};
+
+#endif // CONFIG_BOARD_HAS_INTERNET
+
+#endif // KORRA_MQTT_ARDUINO_H_
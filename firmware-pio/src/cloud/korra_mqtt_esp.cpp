@@ -0,0 +1,237 @@
+#include <Arduino.h>
+
+#include "korra_mqtt_esp.h"
+
+#if defined(CONFIG_BOARD_HAS_INTERNET) && defined(CONFIG_HUB_MQTT_ESP)
+
+#define MQTT_CONNECT_TIMEOUT_MS 20000
+// room for as many commands (8) and pending direct methods (4) as the hub keeps, plus twin messages
+#define MQTT_INBOX_LENGTH 16
+#define MQTT_INBOX_WAIT_MS 2000
+#define MQTT_DROPPED_LENGTH 8
+
+static const int MQTT_CONNECTED_BIT = BIT0;
+static const int MQTT_DISCONNECTED_BIT = BIT1;
+
+struct inbox_message {
+  char *topic;
+  char *payload;
+  size_t payload_len;
+};
+
+static void mqtt_event_handler(void *args, esp_event_base_t base, int32_t event_id, void *event_data) {
+  ((KorraMqttEsp *)args)->handle_event((esp_mqtt_event_handle_t)event_data);
+}
+
+KorraMqttEsp::KorraMqttEsp() {
+}
+
+KorraMqttEsp::~KorraMqttEsp() {
+  if (client) {
+    esp_mqtt_client_destroy(client);
+    client = NULL;
+  }
+
+  free_pending();
+
+  if (inbox) {
+    struct inbox_message msg;
+    while (xQueueReceive(inbox, &msg, 0) == pdTRUE) {
+      free(msg.topic);
+      free(msg.payload);
+    }
+    vQueueDelete(inbox);
+    inbox = NULL;
+  }
+
+  if (dropped) {
+    char *topic;
+    while (xQueueReceive(dropped, &topic, 0) == pdTRUE) free(topic);
+    vQueueDelete(dropped);
+    dropped = NULL;
+  }
+
+  if (events) {
+    vEventGroupDelete(events);
+    events = NULL;
+  }
+}
+
+void KorraMqttEsp::set_tls_credentials(mbedtls_x509_crt *trust_store, const struct korra_der_buffer *cert,
+                                       const struct korra_der_buffer *key) {
+  // esp-mqtt verifies against the esp-tls global CA store which is what the trust store is
+  this->trust_store = trust_store;
+  this->cert = cert;
+  this->key = key;
+}
+
+void KorraMqttEsp::configure(const char *id, const char *username, uint16_t keep_alive_sec, bool clean_session) {
+  // the client holds the values it was created with, the next connect creates it again
+  if (client) {
+    stop();
+    esp_mqtt_client_destroy(client);
+    client = NULL;
+  }
+  this->id = id;
+  this->username = username;
+  this->keep_alive_sec = keep_alive_sec;
+  this->clean_session = clean_session;
+}
+
+bool KorraMqttEsp::connect(const char *host, uint16_t port) {
+  if (!events) events = xEventGroupCreate();
+  if (!inbox) inbox = xQueueCreate(MQTT_INBOX_LENGTH, sizeof(struct inbox_message));
+  if (!dropped) dropped = xQueueCreate(MQTT_DROPPED_LENGTH, sizeof(char *));
+  if (!events || !inbox || !dropped) {
+    Serial.println("Unable to create MQTT event group or inbox");
+    return false;
+  }
+  if (!trust_store) {
+    Serial.println("MQTT connection refused, there is no trust store to verify the server");
+    return false;
+  }
+
+  if (!client) {
+    esp_mqtt_client_config_t config = {};
+    config.broker.address.hostname = host;
+    config.broker.address.port = port;
+    config.broker.address.transport = MQTT_TRANSPORT_OVER_SSL;
+    config.broker.verification.use_global_ca_store = true;
+    config.credentials.client_id = id;
+    config.credentials.username = username;
+    if (cert && key) {
+      // lengths are given so the DER values are used as they are
+      config.credentials.authentication.certificate = (const char *)cert->data;
+      config.credentials.authentication.certificate_len = cert->len;
+      config.credentials.authentication.key = (const char *)key->data;
+      config.credentials.authentication.key_len = key->len;
+    }
+    config.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+    config.session.keepalive = keep_alive_sec;
+    config.session.disable_clean_session = !clean_session;
+    config.network.disable_auto_reconnect = true; // reconnection is driven by the hub, like the other backend
+
+    client = esp_mqtt_client_init(&config);
+    if (!client) {
+      Serial.println("Unable to create MQTT client");
+      return false;
+    }
+    esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, mqtt_event_handler, this);
+  }
+
+  xEventGroupClearBits(events, MQTT_CONNECTED_BIT | MQTT_DISCONNECTED_BIT);
+  last_error = 0;
+  esp_err_t err = started ? esp_mqtt_client_reconnect(client) : esp_mqtt_client_start(client);
+  if (err != ESP_OK) {
+    last_error = err;
+    return false;
+  }
+  started = true;
+
+  xEventGroupWaitBits(events, MQTT_CONNECTED_BIT | MQTT_DISCONNECTED_BIT, /* clear */ pdFALSE, /* all */ pdFALSE,
+                      pdMS_TO_TICKS(MQTT_CONNECT_TIMEOUT_MS));
+  return connected();
+}
+
+void KorraMqttEsp::stop() {
+  if (client && started) {
+    esp_mqtt_client_stop(client);
+    started = false;
+  }
+  is_connected = false;
+}
+
+bool KorraMqttEsp::subscribe(const char *topic, uint8_t qos) {
+  if (!client) return false;
+  return esp_mqtt_client_subscribe_single(client, topic, qos) >= 0;
+}
+
+bool KorraMqttEsp::publish(const char *topic, const uint8_t *payload, size_t payload_len, uint8_t qos) {
+  if (!client || !connected()) return false;
+  // queued in the outbox and sent from the MQTT task, QoS 0 included (store = true)
+  return esp_mqtt_client_enqueue(client, topic, (const char *)payload, payload_len, qos, /* retain */ 0,
+                                 /* store */ true) >= 0;
+}
+
+void KorraMqttEsp::poll() {
+  if (!inbox) return;
+
+  struct inbox_message msg;
+  while (xQueueReceive(inbox, &msg, 0) == pdTRUE) {
+    if (message_callback != NULL) message_callback(msg.topic, msg.payload, msg.payload_len);
+    free(msg.topic);
+    free(msg.payload);
+  }
+
+  char *topic;
+  while (xQueueReceive(dropped, &topic, 0) == pdTRUE) {
+    if (dropped_callback != NULL) dropped_callback(topic);
+    free(topic);
+  }
+}
+
+void KorraMqttEsp::handle_event(esp_mqtt_event_handle_t event) {
+  switch (event->event_id) {
+  case MQTT_EVENT_CONNECTED:
+    is_connected = true;
+    xEventGroupSetBits(events, MQTT_CONNECTED_BIT);
+    break;
+  case MQTT_EVENT_DISCONNECTED:
+    is_connected = false;
+    xEventGroupSetBits(events, MQTT_DISCONNECTED_BIT);
+    break;
+  case MQTT_EVENT_ERROR:
+    if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+      last_error = event->error_handle->connect_return_code;
+    } else if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
+      last_error = event->error_handle->esp_tls_last_esp_err;
+    }
+    break;
+  case MQTT_EVENT_DATA: {
+    // the first part carries the topic and the total length
+    if (event->current_data_offset == 0) {
+      free_pending();
+      pending_topic = (char *)calloc(1, event->topic_len + 1);
+      pending_payload = (char *)calloc(1, event->total_data_len + 1);
+      if (!pending_topic || !pending_payload) {
+        Serial.printf("Unable to allocate %d bytes for MQTT message\n", event->total_data_len);
+        free_pending();
+        break;
+      }
+      memcpy(pending_topic, event->topic, event->topic_len);
+    }
+    if (!pending_payload) break; // the first part was dropped
+    memcpy(pending_payload + event->current_data_offset, event->data, event->data_len);
+    if (event->current_data_offset + event->data_len < event->total_data_len) break; // more parts to come
+
+    struct inbox_message msg = {pending_topic, pending_payload, (size_t)event->total_data_len};
+    // esp-mqtt has already acknowledged QoS 1 messages, the loop is given a while to make room before giving up
+    if (xQueueSend(inbox, &msg, pdMS_TO_TICKS(MQTT_INBOX_WAIT_MS)) == pdTRUE) {
+      pending_topic = pending_payload = NULL; // now owned by the inbox
+    } else if (xQueueSend(dropped, &pending_topic, 0) == pdTRUE) {
+      Serial.printf("MQTT inbox full, turning down message on topic '%s'\n", pending_topic);
+      pending_topic = NULL; // now owned by the dropped queue
+      free_pending();
+    } else {
+      Serial.printf("MQTT inbox full, dropping message on topic '%s'\n", pending_topic);
+      free_pending();
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void KorraMqttEsp::free_pending() {
+  if (pending_topic) {
+    free(pending_topic);
+    pending_topic = NULL;
+  }
+  if (pending_payload) {
+    free(pending_payload);
+    pending_payload = NULL;
+  }
+}
+
+#endif // CONFIG_BOARD_HAS_INTERNET && CONFIG_HUB_MQTT_ESP
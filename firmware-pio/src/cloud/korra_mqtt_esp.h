@@ -0,0 +1,145 @@
+#ifndef KORRA_MQTT_ESP_H_
+#define KORRA_MQTT_ESP_H_
+
+#include "korra_config.h"
+
+#ifdef CONFIG_BOARD_HAS_INTERNET
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
+
+#include <mqtt_client.h>
+
+#include "credentials/korra_credentials.h"
+
+/**
+ * This class is the MQTT backend built on ESP-IDF's esp-mqtt.
+ * The connection is handled in its own task and outbound messages are queued (outbox) so publishing does not block.
+ * Received messages are queued by the MQTT task as their events arrive and handed over in `poll()`, which the hub
+ * calls on every `maintain()`, so that callbacks still run on the main loop and need no locking. The MQTT task waits
+ * for a while when the queue is full. A message that still does not fit has already been acknowledged to the server,
+ * so its topic is handed over instead (see `onDropped()`) for the sender to be told.
+ */
+class KorraMqttEsp {
+public:
+  /**
+   * Creates a new instance of the KorraMqttEsp class.
+   */
+  KorraMqttEsp();
+
+  /**
+   * Cleanup resources created and managed by the KorraMqttEsp class.
+   */
+  ~KorraMqttEsp();
+
+  /**
+   * Set the credentials used for the secure connection.
+   * The values are not copied and must remain valid for as long as the client is used.
+   *
+   * @param trust_store The parsed root CA certificates, must be the esp-tls global CA store.
+   * @param cert The device certificate in DER form.
+   * @param key The device private key in DER form.
+   */
+  void set_tls_credentials(mbedtls_x509_crt *trust_store, const struct korra_der_buffer *cert,
+                           const struct korra_der_buffer *key);
+
+  /**
+   * Set the session options. Must be called before connecting.
+   * The values are not copied and must remain valid for as long as the client is used.
+   *
+   * @param id The client identifier.
+   * @param username The username (the password is always empty).
+   * @param keep_alive_sec The keep alive interval in seconds.
+   * @param clean_session Whether the server should discard the previous session.
+   */
+  void configure(const char *id, const char *username, uint16_t keep_alive_sec, bool clean_session);
+
+  /**
+   * Connect to the server. Blocks until connected or failed.
+   *
+   * @return `true` if connected, `false` otherwise.
+   */
+  bool connect(const char *host, uint16_t port);
+
+  /**
+   * Check if the connection is established.
+   */
+  inline bool connected() { return is_connected; }
+
+  /**
+   * Disconnect from the server.
+   */
+  void stop();
+
+  /**
+   * Get the error of the last connection attempt.
+   */
+  inline int connect_error() { return last_error; }
+
+  /**
+   * Subscribe to a topic (filter).
+   */
+  bool subscribe(const char *topic, uint8_t qos);
+
+  /**
+   * Queue a message for publishing.
+   *
+   * @return `true` if the message was queued, `false` otherwise.
+   */
+  bool publish(const char *topic, const uint8_t *payload, size_t payload_len, uint8_t qos);
+
+  /**
+   * Pass the messages received since the last call to the message callback.
+   */
+  void poll();
+
+  /**
+   * Registers callback that will be called for each message received.
+   * The topic and payload are NULL terminated and only valid during the call.
+   *
+   * @param callback The callback to register.
+   */
+  inline void onMessage(void (*callback)(const char *topic, const char *payload, size_t payload_len)) {
+    message_callback = callback;
+  }
+
+  /**
+   * Registers callback that will be called for each message received but not delivered because the queue was full.
+   * The topic is NULL terminated and only valid during the call.
+   *
+   * @param callback The callback to register.
+   */
+  inline void onDropped(void (*callback)(const char *topic)) { dropped_callback = callback; }
+
+  /**
+   * Please do not call this method from outside the `KorraMqttEsp` class
+   */
+  void handle_event(esp_mqtt_event_handle_t event);
+
+private:
+  esp_mqtt_client_handle_t client = NULL;
+  bool started = false;
+  const char *id = NULL, *username = NULL;
+  uint16_t keep_alive_sec = 60;
+  bool clean_session = true;
+  mbedtls_x509_crt *trust_store = NULL;
+  const struct korra_der_buffer *cert = NULL, *key = NULL;
+  void (*message_callback)(const char *topic, const char *payload, size_t payload_len) = NULL;
+  void (*dropped_callback)(const char *topic) = NULL;
+
+  volatile bool is_connected = false;
+  volatile int last_error = 0;
+  EventGroupHandle_t events = NULL;
+  QueueHandle_t inbox = NULL, dropped = NULL;
+
+  // messages larger than the receive buffer arrive in parts and are joined here (MQTT task only)
+  char *pending_topic = NULL, *pending_payload = NULL;
+
+private:
+  void free_pending();
+};
+
+#endif // CONFIG_BOARD_HAS_INTERNET
+
+#endif // KORRA_MQTT_ESP_H_
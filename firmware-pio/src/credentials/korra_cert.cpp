@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/x509.h>
+#include <mbedtls/x509_crt.h>
+
+#include "korra_cert.h"
+
+int korra_cert_generate(const char *devid, const size_t devid_len, const char *not_before, const char *not_after,
+                        uint8_t *cert_der, size_t *cert_der_len, uint8_t *key_der, size_t *key_der_len) {
+  mbedtls_pk_context key;
+  mbedtls_x509write_cert crt;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context ctr_drbg;
+  int ret;
+
+  // make seed based on tag and device id to ensure more randomness
+  char seed[sizeof("keygen-") + 20 + devid_len];
+  snprintf(seed, sizeof(seed), "keygen-device-%s", devid);
+
+  mbedtls_pk_init(&key);
+  mbedtls_x509write_crt_init(&crt);
+  mbedtls_ctr_drbg_init(&ctr_drbg);
+  mbedtls_entropy_init(&entropy);
+
+  ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)seed, strlen(seed));
+
+  // Generate EC key pair (secp256r1)
+  if (ret == 0) ret = mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
+  if (ret == 0) {
+    ret = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(key), mbedtls_ctr_drbg_random, &ctr_drbg);
+  }
+
+  // DER is written at the end of the buffer, move it to the start
+  if (ret == 0) ret = mbedtls_pk_write_key_der(&key, key_der, *key_der_len);
+  if (ret > 0) {
+    memmove(key_der, key_der + *key_der_len - ret, ret);
+    *key_der_len = ret;
+    ret = 0;
+  }
+
+  // Set certificate parameters
+  unsigned char serial[MBEDTLS_X509_RFC5280_MAX_SERIAL_LEN] = {0};
+  size_t serial_len = 1;
+  serial[0] = 1; /* your previous serial “1” */
+  mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
+  mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
+  if (ret == 0) ret = mbedtls_x509write_crt_set_serial_raw(&crt, serial, serial_len);
+  if (ret == 0) ret = mbedtls_x509write_crt_set_validity(&crt, not_before, not_after);
+  mbedtls_x509write_crt_set_subject_key(&crt, &key);
+  mbedtls_x509write_crt_set_issuer_key(&crt, &key); // Self-signed
+
+  // Subject and issuer name (CN = device_id)
+  char subject[sizeof("CN=") + devid_len + 1];
+  snprintf(subject, sizeof(subject), "CN=%s", devid);
+  if (ret == 0) ret = mbedtls_x509write_crt_set_subject_name(&crt, subject);
+  if (ret == 0) ret = mbedtls_x509write_crt_set_issuer_name(&crt, subject);
+
+  // Write certificate to DER (at the end of the buffer, move it to the start)
+  if (ret == 0) {
+    ret = mbedtls_x509write_crt_der(&crt, cert_der, *cert_der_len, mbedtls_ctr_drbg_random, &ctr_drbg);
+    if (ret > 0) {
+      memmove(cert_der, cert_der + *cert_der_len - ret, ret);
+      *cert_der_len = ret;
+      ret = 0;
+    }
+  }
+
+  // Clean up
+  mbedtls_pk_free(&key);
+  mbedtls_x509write_crt_free(&crt);
+  mbedtls_ctr_drbg_free(&ctr_drbg);
+  mbedtls_entropy_free(&entropy);
+  return ret;
+}
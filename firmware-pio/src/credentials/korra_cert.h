@@ -0,0 +1,24 @@
+#ifndef KORRA_CERT_H
+#define KORRA_CERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Generate a secp256r1 key and a self-signed certificate for it with the device ID as the common name.
+ * Only mbedtls is used so that it can also be built on the host (see `bench/`).
+ *
+ * @param devid The device ID.
+ * @param devid_len The length of the device ID.
+ * @param not_before Start of the validity in the form YYYYMMDDhhmmss.
+ * @param not_after End of the validity in the form YYYYMMDDhhmmss.
+ * @param cert_der Where to write the certificate in DER form.
+ * @param cert_der_len The size of `cert_der`, updated to the length of the certificate.
+ * @param key_der Where to write the private key in DER form.
+ * @param key_der_len The size of `key_der`, updated to the length of the key.
+ * @return zero on success, otherwise an mbedtls error code.
+ */
+int korra_cert_generate(const char *devid, const size_t devid_len, const char *not_before, const char *not_after,
+                        uint8_t *cert_der, size_t *cert_der_len, uint8_t *key_der, size_t *key_der_len);
+
+#endif /* KORRA_CERT_H */
@@ -3,6 +3,19 @@
 
 #include <Preferences.h>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include <mbedtls/x509_crt.h>
+
+struct korra_der_buffer {
+  /** The DER encoded bytes. */
+  const uint8_t *data;
+
+  /** The number of bytes. */
+  size_t len;
+};
+
 class KorraCredentials {
 public:
   /**
@@ -21,6 +34,8 @@ public:
   /**
    * Initializes the credentials logic.
    * This should be called once at the beginning of the program.
+   * When the device certificate and key do not exist, they are generated in a background task.
+   * Use `ready()` to know when they are available.
    *
    * @param devid The device ID.
    * @param devid_len The length of the device ID.
@@ -33,29 +48,61 @@ public:
   void clear();
 
   /**
-   * Get the root CA certificates
-   * @return the root CA certificates
+   * Check if the device certificate and key are available.
+   * Generated values are saved to the preferences by the first call that finds them ready, so it must be made from
+   * the task that owns the preferences.
+   *
+   * @param timeout_ms Milliseconds to wait for them to be available, zero to return immediately.
+   * @return `true` if available, `false` otherwise.
    */
-  const char *root_ca_certs();
+  bool ready(uint32_t timeout_ms = 0);
 
   /**
-   * Get the device certificate without the private key
-   * @return the device certificate
-   * @note This should only be used to print to allow copying for provisioning setup.
+   * Get the root CA certificates parsed into a trust store shared by all TLS users.
+   * The store is parsed once, on the first call, and must not be modified.
+   * It is the esp-tls global CA store so `esp_http_client` can use it via `use_global_ca_store`.
+   *
+   * @return the trust store or `NULL` if it could not be created
    */
-  const char *device_cert();
+  mbedtls_x509_crt *trust_store();
 
   /**
    * Get the device certificate without the private key
-   * @return the device key
+   * @return the device certificate in DER form, empty when missing
+   * @note This should only be used in the transport client.
+   */
+  const struct korra_der_buffer *device_cert();
+
+  /**
+   * Get the device private key
+   * @return the device key in DER form, empty when missing
    * @note This should only be used in the transport client.
    */
-  const char *device_key();
+  const struct korra_der_buffer *device_key();
+
+  /**
+   * Print the device certificate in PEM form to allow copying for provisioning setup.
+   * The PEM is only created for printing and freed right after.
+   */
+  void print_device_cert();
+
+  /**
+   * Please do not call this method from outside the `KorraCredentials` class
+   */
+  void generate();
 
 private:
   Preferences &prefs;
-  char *devcert, *devkey;
-  size_t devcert_len, devkey_len;
+  const char *devid = NULL;
+  size_t devid_len = 0;
+  struct korra_der_buffer devcert = {0}, devkey = {0};
+  volatile bool unsaved = false; // generated values yet to be saved
+  EventGroupHandle_t events = NULL;
+  mbedtls_x509_crt *store = NULL;
+
+private:
+  bool migrate();
+  void load(const char *key, struct korra_der_buffer *dest);
 };
 
 #endif /* KORRA_CREDENTIALS_H */
@@ -10,8 +10,13 @@
 #include "credentials/korra_credentials.h"
 #include "internet/korra_internet.h"
 #include "mdns/korra_mdns.h"
+#include "metrics/korra_boot.h"
+#include "metrics/korra_metrics.h"
+#include "metrics/korra_tasks.h"
 #include "ota/korra_ota.h"
+#include "ota/korra_ota_peer.h"
 #include "time/korra_time.h"
+#include "tls/korra_tls_client.h"
 
 static Preferences prefs;
 
@@ -23,30 +28,87 @@ static WiFiUDP udp_client;
 static KorraMdns mdns(udp_client);
 static KorraTime timing(udp_client);
 
+#define MAINTAIN_PERIOD_MS 500
+#define OTA_PROGRESS_PERIOD_MS (15 * 1000)
+#define OTA_PEER_DISCOVERY_MS (6 * 1000) // a little longer than the mDNS discovery
+#define OTA_RETRY_MIN_MS (60 * 1000)      // wait before trying a failed update again, doubled each time
+#define OTA_RETRY_MAX_MS (60 * 60 * 1000)
+#define OTA_PEER_JITTER_MAX_MS (5 * 60 * 1000) // most time to wait for a neighbour to have an update before downloading
+#define OTA_SHARE_IDLE_MS (3 * 60 * 1000)      // reboot into a new image once no neighbour asked for it in this long
+#define REBOOT_DRAIN_MS (30 * 1000)      // most time to wait for pending messages before a planned reboot
+
+// on-demand sampling via direct methods, limited so that it cannot replace the baseline sampling
+#define SAMPLE_NOW_MIN_INTERVAL_MS (10 * 1000)
+#define BURST_COOLDOWN_MS (60 * 1000)
+#define BURST_MAX_SAMPLES 30
+#define BURST_MAX_INTERVAL_SEC 10
+// a burst responds once its last sample is taken, which must be before the caller stops waiting. That is the
+// responseTimeoutInSeconds of the invocation, 30 seconds unless set (up to 300), so callers wanting longer bursts
+// must set it and pass the same value as "timeout" in the payload.
+#define BURST_DEFAULT_TIMEOUT_SEC 30
+#define BURST_MAX_TIMEOUT_SEC 300
+#define BURST_TIMEOUT_MARGIN_SEC 5 // for the last sample and the response to reach the hub
+
+// default period for updating the reported properties of the twin
+#define TWIN_UPDATE_PERIOD_SEC 3600
+
 static Timer<> timer;
-static WiFiClientSecure tcp_client_provisioning;
-static KorraCloudProvisioning provisioning(tcp_client_provisioning, prefs, timer);
+static KorraCloudProvisioning provisioning(prefs, timer); // creates its own client only while needed
 
-static WiFiClientSecure tcp_client_hub; // each client can only open one socket so we cannot share
-static KorraCloudHub hub(tcp_client_hub);
+#ifdef CONFIG_HUB_MQTT_ESP
+static KorraMqtt hub_mqtt; // esp-mqtt creates its own connection
+#else
+static KorraTlsClient tcp_client_hub; // each client can only open one socket so we cannot share
+static KorraMqtt hub_mqtt(tcp_client_hub);
+#endif // CONFIG_HUB_MQTT_ESP
+static KorraCloudHub hub(hub_mqtt);
 
 static KorraOta ota;
+static KorraOtaPeer ota_peer;
+static struct korra_ota_info ota_inf; // waiting for peers to answer before the update starts
+static unsigned long ota_retry_ms = OTA_RETRY_MIN_MS;
+static bool ota_retry_scheduled = false;
+static bool ota_peer_waited = false; // waited for a neighbour to download the update first
 
 static struct korra_sensors_data sensors_data;
 static char devid[(sizeof(uint64_t) * 2) + 1]; // the efuse is a 64-bit integer (64 bit -> 8 bytes -> 16 hex chars)
 static size_t devid_len;
+static bool tls_clients_ready = false;
+static unsigned long sample_now_last = 0, burst_last = 0;
+static int burst_rid = -1; // the burst in progress, -1 when none
+static uint8_t burst_remaining = 0;
+static JsonDocument burst_doc;
+static uint32_t sampling_period_sec = CONFIG_SENSORS_READ_PERIOD_SECONDS;
+static uint32_t twin_period_sec = TWIN_UPDATE_PERIOD_SEC;
+static uint32_t metrics_period_sec = CONFIG_METRICS_REPORT_PERIOD_SECONDS;
+static Timer<>::Task collect_data_task, update_device_twin_task, report_metrics_task;
 
 KorraActuator actuator;
 
+static void setup_tls_clients();
 static bool maintain(void *);
 static bool collect_data(void *);
 static bool maintain_ota(void *);
+static bool find_ota_peers(void *);
+static bool report_ota_progress(void *);
+static bool start_ota(void *);
 static bool reboot_timer(void *);
+static bool drain_and_reboot(void *);
 static bool update_device_twin(void *);
-static void device_twin_updated(struct korra_device_twin *twin, bool initial);
-static int device_direct_method_invoked(const char *method_name, const JsonVariantConst &payload);
+static bool report_metrics(void *);
+static void device_twin_updated(struct korra_device_twin *twin, uint8_t changed, bool initial);
+static void direct_method_reboot(int rid, const JsonVariantConst &payload);
+static void direct_method_sample_now(int rid, const JsonVariantConst &payload);
+static void direct_method_burst(int rid, const JsonVariantConst &payload);
+static bool burst_sample(void *);
+static int cloud_command(const char *name, const JsonVariantConst &payload, JsonDocument &result);
+static void set_sampling_period(uint32_t period_sec);
+static void apply_sampling(const struct korra_device_twin_sampling *sampling);
+static void reschedule(Timer<>::Task *task, uint32_t *current_sec, uint32_t period_sec, Timer<>::handler_t handler);
 
 static int shell_command_info(int argc, char **argv);
+static int shell_command_metrics(int argc, char **argv);
+static int shell_command_tasks(int argc, char **argv);
 static int shell_command_reboot(int argc, char **argv);
 static int shell_command_prefs_clear(int argc, char **argv);
 static int shell_command_device_cred_clear(int argc, char **argv);
@@ -57,12 +119,17 @@ static int shell_command_wifi_cred_set_personal(int argc, char **argv);
 static int shell_command_wifi_cred_set_ent(int argc, char **argv);
 
 void setup() {
-  delay(3000); // allow time for the serial monitor to connect
+  KorraBoot::mark(KORRA_BOOT_PHASE_SETUP);
+  Serial.begin(9600);
+
+#ifdef CONFIG_BOOT_SERIAL_WAIT_MS
+  // allow time for the serial monitor to connect (stops waiting as soon as it does)
+  while (!Serial && millis() < CONFIG_BOOT_SERIAL_WAIT_MS) delay(10);
+#endif // CONFIG_BOOT_SERIAL_WAIT_MS
 
   uint64_t raw_devid = ESP.getEfuseMac();
   devid_len = snprintf(devid, sizeof(devid), "%llx", (unsigned long long)raw_devid);
 
-  Serial.begin(9600);
   Serial.printf("*** Running on ESP-IDF %s ***\n", esp_get_idf_version());
   Serial.printf("*** Booting Korra %s build v%s (%s) ***\n", CONFIG_APP_NAME, APP_VERSION_STRING,
                 STRINGIFY(APP_BUILD_VERSION));
@@ -72,55 +139,74 @@ void setup() {
     Serial.println("Could not initialize preferences :-(");
     while (true);
   }
+  KorraBoot::mark(KORRA_BOOT_PHASE_PREFERENCES);
+
+  // setup networking first, association then happens in the background while the rest of the setup runs
+  internet.begin();
+  internet.maintain();
+  timing.begin(6 * 3600 /* 6 hours, in seconds */);
+  KorraBoot::mark(KORRA_BOOT_PHASE_INTERNET_BEGIN);
 
   // https://www.arduino.cc/reference/en/language/functions/analog-io/analogreference/
   // no need to set the reference voltage on ESP32-S3 because it offers reads in millivolts
   analogReadResolution(12); // change to 12-bit resolution
 
   sensors.begin();
+  KorraBoot::mark(KORRA_BOOT_PHASE_SENSORS);
 
-  // setup networking
-  internet.begin();
-  timing.begin(6 * 3600 /* 6 hours, in seconds */);
-
-  // prepare credentials
+  // prepare credentials (generated in the background if missing, the TLS clients are set up once ready)
   credentials.begin(devid, devid_len);
-  const char *root_ca_certs = credentials.root_ca_certs();
-  const char *devcert = credentials.device_cert();
-  const char *devkey = credentials.device_key();
-  Serial.printf("Device certificate to use for provisioning:\n%s\n", devcert);
 
   // setup cloud (provisioning)
-  tcp_client_provisioning.setCACert(root_ca_certs);
-  tcp_client_provisioning.setCertificate(devcert);
-  tcp_client_provisioning.setPrivateKey(devkey);
   provisioning.begin(devid, devid_len);
 
   // setup cloud (hub)
-  tcp_client_hub.setCACert(root_ca_certs);
-  tcp_client_hub.setCertificate(devcert);
-  tcp_client_hub.setPrivateKey(devkey);
   hub.onDeviceTwinUpdated(device_twin_updated);
-  hub.onDirectMethodInvoked(device_direct_method_invoked);
+  hub.onCommand(cloud_command);
+  hub.add_direct_method("reboot", direct_method_reboot);
+  hub.add_direct_method("sample_now", direct_method_sample_now);
+  hub.add_direct_method("burst", direct_method_burst);
   hub.begin();
 
   // setup OTA
-  ota.begin(root_ca_certs);
+  ota.onReboot([]() {
+    update_device_twin(NULL); // report the reboot with whatever else is pending
+    return hub.drain();
+  });
+  ota.onShare([]() {
+    // neighbours still waiting for the update find it here, the reboot is once they have stopped asking
+    const esp_partition_t *partition;
+    uint32_t length;
+    const char *hash;
+    if (!ota_peer.started() || !ota.staged_image(&partition, &length, &hash)) return true;
+    ota_peer.share(partition, length, hash);
+    return (millis() - ota_peer.active_at()) > OTA_SHARE_IDLE_MS;
+  });
+  ota.begin(credentials.trust_store());
 
   // setup actuator
-  actuator.onActuated([](const struct korra_actuation *value) { hub.push(value); });
+  actuator.onActuating([](uint16_t duration) { ota.hold(KORRA_OTA_HOLD_ACTUATION, true); });
+  actuator.onActuated([](const struct korra_actuation *value) {
+    ota.hold(KORRA_OTA_HOLD_ACTUATION, false);
+    hub.push(value);
+  });
   actuator.begin();
 
   // setup timers
-  timer.every(500, maintain);
-  timer.every((CONFIG_SENSORS_READ_PERIOD_SECONDS * 1000), collect_data);
-  timer.every((3600 * 1000) /* 1 hour, in millis */, update_device_twin);
+  timer.every(MAINTAIN_PERIOD_MS, maintain);
+  collect_data_task = timer.every((sampling_period_sec * 1000), collect_data);
+  update_device_twin_task = timer.every((twin_period_sec * 1000), update_device_twin);
   timer.every(1000, maintain_ota);
+  timer.every(OTA_PROGRESS_PERIOD_MS, report_ota_progress);
+  report_metrics_task = timer.every((metrics_period_sec * 1000), report_metrics);
   timer.every(24 * 60 * 60 * 1000, reboot_timer); // reboot every 24 hours to address potential memory leaks and
                                                   // resource exhaustion observed during long uptime
 
   // setup shell
   shell.addCommand(F("info"), shell_command_info);
+  shell.addCommand(F("metrics"), shell_command_metrics);
+  shell.addCommand(F("tasks"), shell_command_tasks);
+  shell.addCommand(F("top"), shell_command_tasks);
   shell.addCommand(F("reboot"), shell_command_reboot);
   shell.addCommand(F("prefs-clear"), shell_command_prefs_clear);
   shell.addCommand(F("device-cred-clear"), shell_command_device_cred_clear);
@@ -130,6 +216,8 @@ void setup() {
   shell.addCommand(F("wifi-cred-set-personal <ssid> <passphrase>"), shell_command_wifi_cred_set_personal);
   shell.addCommand(F("wifi-cred-set-ent <ssid> <identity> <username> <password>"), shell_command_wifi_cred_set_ent);
   shell.attach(Serial);
+
+  KorraBoot::mark(KORRA_BOOT_PHASE_SETUP_END);
 }
 
 void loop() {
@@ -137,18 +225,66 @@ void loop() {
   shell.executeIfInput();
 }
 
+static void setup_tls_clients() {
+  mbedtls_x509_crt *trust_store = credentials.trust_store();
+  const struct korra_der_buffer *devcert = credentials.device_cert();
+  const struct korra_der_buffer *devkey = credentials.device_key();
+  credentials.print_device_cert();
+
+  provisioning.set_tls_credentials(trust_store, devcert, devkey);
+
+  hub_mqtt.set_tls_credentials(trust_store, devcert, devkey);
+#ifndef CONFIG_HUB_MQTT_ESP
+#ifdef CONFIG_TLS_PROFILE_LOW_MEMORY
+  tcp_client_hub.set_profile(KORRA_TLS_PROFILE_LOW_MEMORY);
+#endif // CONFIG_TLS_PROFILE_LOW_MEMORY
+  tcp_client_hub.set_session_resumption(true, /* persist */ true); // reconnects are frequent, provisioning is not
+#endif // CONFIG_HUB_MQTT_ESP
+}
+
 static bool maintain(void *) {
+  // record how far off the period we are, the timer is cooperative so long tasks delay it
+  static unsigned long last_run = 0;
+  unsigned long now = millis();
+  if (last_run != 0) {
+    long elapsed = (long)(now - last_run);
+    KorraMetrics::record(KORRA_METRICS_HISTOGRAM_MAINTAIN_JITTER, abs(elapsed - MAINTAIN_PERIOD_MS));
+  }
+  last_run = now;
+
+  // set up the TLS clients once the device credentials are available
+  if (!tls_clients_ready && credentials.ready()) {
+    setup_tls_clients();
+    tls_clients_ready = true;
+    KorraBoot::mark(KORRA_BOOT_PHASE_CREDENTIALS);
+  }
+
   internet.maintain();
   if (!internet.connected()) return true; // true to repeat the action, false to stop
+  KorraBoot::mark(KORRA_BOOT_PHASE_INTERNET_CONNECTED);
 
+  mdns.set_firmware_hash(ota_peer.hash());
   mdns.maintain(internet.props());
+
+  // share firmware with neighbours once the running one has proven itself
+  if (!ota_peer.started() && !ota.verifying()) ota_peer.begin(KORRA_MDNS_SERVICE_PORT);
   timing.maintain();
 
+  // the cloud needs the device credentials which may still be generating in the background
+  if (!tls_clients_ready) return true; // true to repeat the action, false to stop
+
   // cloud maintenance
   provisioning.maintain();
   struct korra_cloud_provisioning_info *pi = provisioning.info();
   if (!pi->valid) return true; // true to repeat the action, false to stop
+  KorraBoot::mark(KORRA_BOOT_PHASE_PROVISIONED);
   hub.maintain(pi);
+  if (hub.connected()) {
+    KorraBoot::mark(KORRA_BOOT_PHASE_HUB_CONNECTED);
+
+    // send the first telemetry as soon as we can instead of waiting for a whole period
+    if (!KorraBoot::complete()) collect_data(NULL);
+  }
 
   // actuator maintenance
   actuator.maintain();
@@ -168,17 +304,82 @@ static bool collect_data(void *) {
 
   hub.push(&sensors_data);        // update the hub
   actuator.update(&sensors_data); // update the actuator
+  KorraBoot::mark(KORRA_BOOT_PHASE_FIRST_TELEMETRY);
 
   return true; // true to repeat the action, false to stop
 }
 
 static bool maintain_ota(void *) {
+  ota.hold(KORRA_OTA_HOLD_HUB, hub.busy()); // give way to messages waiting to go out
   ota.maintain();
+
+  // an update that failed (e.g. the network was down for longer than the download retries) is tried again for as
+  // long as the twin asks for another version, backing off each time
+  struct korra_ota_progress progress;
+  ota.progress(&progress);
+  if (!ota_retry_scheduled && ota_inf.version != 0 && ota_inf.version != APP_VERSION_NUMBER &&
+      strcmp(progress.status, "failed") == 0) {
+    Serial.printf("Trying the firmware update again in %lu sec\n", ota_retry_ms / 1000);
+    timer.in(ota_retry_ms, find_ota_peers);
+    ota_retry_ms = MIN(ota_retry_ms * 2, (unsigned long)OTA_RETRY_MAX_MS);
+    ota_retry_scheduled = true;
+  }
   return true; // true to repeat the action, false to stop
 }
 
+static bool report_ota_progress(void *) {
+  // report the progress of downloads and each change of state
+  static char last_status[sizeof(((struct korra_ota_progress *)0)->status)] = "idle";
+  struct korra_ota_progress progress;
+  ota.progress(&progress);
+  bool changed = strcmp(progress.status, last_status) != 0;
+  if (!changed && strcmp(progress.status, "downloading") != 0) return true; // true to repeat the action, false to stop
+  strcpy(last_status, progress.status);
+
+  return update_device_twin(NULL); // true to repeat the action, false to stop
+}
+
+static bool find_ota_peers(void *) {
+  mdns.discover();
+  timer.in(OTA_PEER_DISCOVERY_MS, start_ota);
+  return false; // true to repeat the action, false to stop
+}
+
+static bool start_ota(void *) {
+  ota_retry_scheduled = false;
+  ota_inf.peer[0] = '\0'; // the peer may be gone since the last attempt
+  IPAddress ip;
+  uint16_t port;
+  if (mdns.find_peer(ota_inf.hash, &ip, &port)) {
+    snprintf(ota_inf.peer, sizeof(ota_inf.peer), KORRA_OTA_PEER_URL_FORMAT, ip.toString().c_str(), port, ota_inf.hash);
+  } else if (!ota_peer_waited) {
+    // the whole fleet gets the twin change together, waiting a random while lets the first to download the update
+    // share it with the others instead of all of them downloading it from the internet
+    ota_peer_waited = true;
+    unsigned long delay_ms = random(OTA_PEER_JITTER_MAX_MS);
+    Serial.printf("No neighbour has the firmware update yet, looking again in %lu sec\n", delay_ms / 1000);
+    timer.in(delay_ms, find_ota_peers);
+    return false; // true to repeat the action, false to stop
+  }
+  ota.update(&ota_inf);
+  return false; // true to repeat the action, false to stop
+}
+
 static bool reboot_timer(void *) {
+  // readings held back for batching and queued messages would be lost, send them first
+  Serial.println("Rebooting once pending messages are sent ...");
+  timer.every(500, drain_and_reboot);
+  return false; // true to repeat the action, false to stop
+}
+
+static bool drain_and_reboot(void *) {
+  static unsigned long started = millis();
+  if (!hub.drain() && (millis() - started) < REBOOT_DRAIN_MS) return true; // true to repeat the action, false to stop
+
+  Serial.println("Rebooting ...");
+  Serial.flush();
   esp_restart();
+  return false; // true to repeat the action, false to stop
 }
 
 static bool update_device_twin(void *) {
@@ -192,28 +393,61 @@ static bool update_device_twin(void *) {
   props.firmware.version.value = APP_VERSION_NUMBER;
   snprintf((char *)props.firmware.version.semver, sizeof(props.firmware.version.semver), APP_VERSION_STRING);
 
+  // set the state of the firmware update
+  ota.progress(&(props.firmware.ota));
+
   // set the network props
   memcpy(&(props.network), internet.props(), sizeof(struct korra_network_props));
 
+  // set the periods in use
+  props.sampling.sensors = sampling_period_sec;
+  props.sampling.twin = twin_period_sec;
+  props.sampling.metrics = metrics_period_sec;
+
+  // set the boot times (only once complete so that partial values are not reported)
+  if (KorraBoot::complete()) memcpy(&(props.boot), KorraBoot::times(), sizeof(struct korra_boot_times));
+
   // push the update to the hub
   hub.update(&props);
 
   return true; // true to repeat the action, false to stop
 }
 
-static void device_twin_updated(struct korra_device_twin *twin, bool initial) {
+static bool report_metrics(void *) {
+  // check if hub is connected
+  if (!hub.connected()) return true; // true to repeat the action, false to stop
+
+  struct korra_metrics_snapshot snapshot = {0};
+  KorraMetrics::snapshot(&snapshot);
+  hub.push(&snapshot);
+
+  return true; // true to repeat the action, false to stop
+}
+
+static void device_twin_updated(struct korra_device_twin *twin, uint8_t changed, bool initial) {
   // set values in the actuator
-  actuator.set_config(&(twin->desired.actuator));
+  if (changed & KORRA_DEVICE_TWIN_SECTION_ACTUATOR) actuator.set_config(&(twin->desired.actuator));
+
+  // reschedule the periodic work
+  if (changed & KORRA_DEVICE_TWIN_SECTION_SAMPLING) apply_sampling(&(twin->desired.sampling));
+
+  // when and how fast firmware is downloaded, also applies to a download in progress
+  if (changed & KORRA_DEVICE_TWIN_SECTION_FIRMWARE) ota.set_schedule(&(twin->desired.firmware.schedule));
 
   // check for firmware updates
-  if ((twin->desired.firmware.version.value && twin->desired.firmware.version.value != APP_VERSION_NUMBER)) {
+  if ((changed & KORRA_DEVICE_TWIN_SECTION_FIRMWARE) && twin->desired.firmware.version.value &&
+      twin->desired.firmware.version.value != APP_VERSION_NUMBER) {
     Serial.printf("We have a new firmware version: %s (%d)\n", twin->desired.firmware.version.semver,
                   twin->desired.firmware.version.value);
 
-    // initialize the firmware update
-    struct korra_ota_info ota_inf = {0};
-    ota.populate(twin->desired.firmware.url, twin->desired.firmware.hash, twin->desired.firmware.signature, &ota_inf);
-    ota.update(&ota_inf);
+    // initialize the firmware update, once neighbours had the chance to say they have it
+    memset(&ota_inf, 0, sizeof(ota_inf));
+    ota.populate(twin->desired.firmware.version.value, twin->desired.firmware.url, twin->desired.firmware.manifest,
+                 twin->desired.firmware.hash, twin->desired.firmware.signature, twin->desired.firmware.chunk_size,
+                 twin->desired.firmware.format, twin->desired.firmware.base, &ota_inf);
+    ota_retry_ms = OTA_RETRY_MIN_MS;
+    ota_peer_waited = false;
+    find_ota_peers(NULL);
     return;
   }
 
@@ -227,17 +461,134 @@ static void device_twin_updated(struct korra_device_twin *twin, bool initial) {
   }
 }
 
-static int device_direct_method_invoked(const char *method_name, const JsonVariantConst &payload) {
-  if (strcmp(method_name, "reboot") == 0) {
-    Serial.println("Scheduling device reboot in 10 sec as requested by the cloud.");
-    timer.in(10 * 1000, [](void *) -> bool {
-      Serial.println("Rebooting device as requested by the cloud.");
-      esp_restart();
-      return false; // true to repeat the action, false to stop
-    });
-    return 200; // method executed successfully
+static void direct_method_reboot(int rid, const JsonVariantConst &payload) {
+  Serial.println("Scheduling device reboot in 10 sec as requested by the cloud.");
+  timer.in(10 * 1000, reboot_timer);
+  hub.respond(rid, 200); // method executed successfully
+}
+
+static void direct_method_sample_now(int rid, const JsonVariantConst &payload) {
+  JsonDocument doc;
+  if (sample_now_last != 0 && (millis() - sample_now_last) < SAMPLE_NOW_MIN_INTERVAL_MS) {
+    doc["error"] = "too many requests";
+    doc["retry_after"] = (SAMPLE_NOW_MIN_INTERVAL_MS - (millis() - sample_now_last) + 999) / 1000;
+    hub.respond(rid, 429, doc);
+    return;
   }
-  return 404; // method not found
+  sample_now_last = millis();
+
+  // read into a separate struct, the actuator keeps working off the regular samples
+  struct korra_sensors_data data = {0};
+  sensors.read(&data);
+  hub.push(&data);
+
+  hub.populate_sensors(doc.to<JsonObject>(), &data);
+  hub.respond(rid, 200, doc);
+}
+
+static void direct_method_burst(int rid, const JsonVariantConst &payload) {
+  // payload -> {"count": 10, "interval": 2, "timeout": 30} (interval and timeout in seconds)
+  JsonDocument doc;
+  int count = payload["count"] | 10;
+  int interval = payload["interval"] | 1;
+  int timeout = payload["timeout"] | BURST_DEFAULT_TIMEOUT_SEC;
+  if (count < 1 || count > BURST_MAX_SAMPLES || interval < 1 || interval > BURST_MAX_INTERVAL_SEC ||
+      timeout > BURST_MAX_TIMEOUT_SEC || ((count - 1) * interval) > (timeout - BURST_TIMEOUT_MARGIN_SEC)) {
+    doc["error"] = "invalid count, interval or timeout";
+    hub.respond(rid, 400, doc);
+    return;
+  }
+  if (burst_rid != -1 || (burst_last != 0 && (millis() - burst_last) < BURST_COOLDOWN_MS)) {
+    doc["error"] = "too many requests";
+    hub.respond(rid, 429, doc);
+    return;
+  }
+
+  Serial.printf("Starting a burst of %d samples every %d sec\n", count, interval);
+  burst_rid = rid;
+  burst_remaining = count;
+  burst_doc.clear();
+  burst_doc["interval"] = interval;
+  burst_doc["readings"].to<JsonArray>();
+
+  // the first sample is taken straight away, the response is sent once all are taken
+  if (burst_sample(NULL)) timer.every(interval * 1000, burst_sample);
+}
+
+static bool burst_sample(void *) {
+  struct korra_sensors_data data = {0};
+  sensors.read(&data);
+  hub.populate_sensors(burst_doc["readings"].add<JsonObject>(), &data);
+  if (--burst_remaining > 0) return true; // true to repeat the action, false to stop
+
+  hub.respond(burst_rid, 200, burst_doc);
+  burst_doc.clear();
+  burst_rid = -1;
+  burst_last = millis();
+  return false; // true to repeat the action, false to stop
+}
+
+static int cloud_command(const char *name, const JsonVariantConst &payload, JsonDocument &result) {
+  if (strcmp(name, "set_actuator") == 0) {
+    // payload -> {"enabled": true, "duration": 5, "equilibrium_time": 5, "target": 65}, missing values are kept
+    struct korra_actuator_config config = *actuator.config();
+    config.enabled = payload["enabled"] | config.enabled;
+    config.duration = CLAMP(payload["duration"] | config.duration, 5, 15);
+    config.equilibrium_time = CLAMP(payload["equilibrium_time"] | config.equilibrium_time, 5, 60);
+    config.target = payload["target"] | config.target;
+    actuator.set_config(&config);
+    return 200;
+  }
+
+  if (strcmp(name, "set_sampling") == 0) {
+    // payload -> {"period": 60} (seconds)
+    uint32_t period = payload["period"] | 0;
+    if (period == 0) return 400;
+    set_sampling_period(period);
+    result["period"] = sampling_period_sec;
+    return 200;
+  }
+
+  if (strcmp(name, "flush_backlog") == 0) {
+    hub.flush_backlog();
+    return 200;
+  }
+
+  if (strcmp(name, "diagnostic") == 0) {
+    report_metrics(NULL); // the full snapshot goes as a metrics message
+    result["uptime"] = millis() / 1000;
+    result["free_heap"] = ESP.getFreeHeap();
+    result["min_free_heap"] = ESP.getMinFreeHeap();
+    result["network"] = internet.props()->kind;
+    return 200;
+  }
+
+  return 404; // command not found
+}
+
+static void set_sampling_period(uint32_t period_sec) {
+  period_sec = CLAMP(period_sec, KORRA_SAMPLING_SENSORS_MIN_SEC, KORRA_SAMPLING_SENSORS_MAX_SEC);
+  reschedule(&collect_data_task, &sampling_period_sec, period_sec, collect_data);
+  hub.set_sampling_period(sampling_period_sec);
+}
+
+static void apply_sampling(const struct korra_device_twin_sampling *sampling) {
+  // the values are clamped by the hub, zero means the default
+  set_sampling_period(sampling->sensors ? sampling->sensors : CONFIG_SENSORS_READ_PERIOD_SECONDS);
+  reschedule(&update_device_twin_task, &twin_period_sec, sampling->twin ? sampling->twin : TWIN_UPDATE_PERIOD_SEC,
+             update_device_twin);
+  reschedule(&report_metrics_task, &metrics_period_sec,
+             sampling->metrics ? sampling->metrics : CONFIG_METRICS_REPORT_PERIOD_SECONDS, report_metrics);
+}
+
+static void reschedule(Timer<>::Task *task, uint32_t *current_sec, uint32_t period_sec, Timer<>::handler_t handler) {
+  if (period_sec == *current_sec) return;
+
+  // the next run is a whole new period from now
+  Serial.printf("Period changed from %lu to %lu sec\n", (unsigned long)*current_sec, (unsigned long)period_sec);
+  *current_sec = period_sec;
+  timer.cancel(*task);
+  *task = timer.every((period_sec * 1000), handler);
 }
 
 static int shell_command_info(int argc, char **argv) // info
@@ -246,6 +597,23 @@ static int shell_command_info(int argc, char **argv) // info
   Serial.printf("Device ID: %s\n", devid);
   Serial.printf("Arduino Stack: %d of %d bytes free\n", uxTaskGetStackHighWaterMark(NULL),
                 getArduinoLoopTaskStackSize());
+  KorraBoot::print();
+
+  return EXIT_SUCCESS;
+}
+
+static int shell_command_metrics(int argc, char **argv) {
+  // command format: metrics
+
+  KorraMetrics::print();
+
+  return EXIT_SUCCESS;
+}
+
+static int shell_command_tasks(int argc, char **argv) {
+  // command format: tasks (or top)
+
+  KorraTasks::print();
 
   return EXIT_SUCCESS;
 }
@@ -4,10 +4,22 @@
 
 #ifdef CONFIG_BOARD_HAS_INTERNET
 
+#define DISCOVERY_TIMEOUT_MS (5 * 1000)
+#define TXT_FIRMWARE_KEY "ota="
+
+static KorraMdns *_instance;
+
+static void service_found(const char *type, MDNSServiceProtocol_t proto, const char *name, IPAddress ip,
+                          unsigned short port, const char *txt) {
+  if (_instance) _instance->on_service_found(name, ip, port, txt);
+}
+
 KorraMdns::KorraMdns(UDP &client) : mdns(client) {
+  _instance = this;
 }
 
 KorraMdns::~KorraMdns() {
+  _instance = NULL;
 }
 
 void KorraMdns::maintain(const struct korra_network_props *props) {
@@ -31,16 +43,73 @@ void KorraMdns::maintain(const struct korra_network_props *props) {
     // On mac "dns-sd -B _services._dns-sd._tcp local" will list all services, "dns-sd -B _korra" will list just the
     // ones for korra, and "dns-sd -L "Korra <mac>" _korra" will print the TXT for the particular device.
 #define SERVICE_NAME_FORMAT "Korra " FMT_LL_ADDR_6_LOWER_NO_COLONS "._korra"
-    size_t service_name_len = snprintf(NULL, 0, SERVICE_NAME_FORMAT, PRINT_LL_ADDR_6(props->mac_addr));
-    char service_name[service_name_len + 1] = {0};
     snprintf(service_name, sizeof(service_name), SERVICE_NAME_FORMAT, PRINT_LL_ADDR_6(props->mac_addr));
-    mdns.addServiceRecord(service_name, 7007, MDNSServiceProtocol_t::MDNSServiceTCP, "\x05id=01");
+    add_service();
+    mdns.setServiceFoundCallback(service_found);
 
     setup = true;
     Serial.println("Setting up mDNS is complete");
   }
 
+  // the record is replaced to change its TXT
+  if (firmware_hash_changed) {
+    mdns.removeServiceRecord(KORRA_MDNS_SERVICE_PORT, MDNSServiceProtocol_t::MDNSServiceTCP);
+    add_service();
+    firmware_hash_changed = false;
+  }
+
   mdns.run();
 }
 
+void KorraMdns::add_service() {
+  // the shared firmware goes after the id -> "\x05id=01\x44ota={hash}"
+  char txt[1 + sizeof("id=01") - 1 + 1 + sizeof(TXT_FIRMWARE_KEY) - 1 + sizeof(firmware_hash)] = "\x05id=01";
+  if (strlen(firmware_hash) > 0) {
+    size_t len = strlen(txt);
+    txt[len] = (char)(strlen(TXT_FIRMWARE_KEY) + strlen(firmware_hash));
+    snprintf(txt + len + 1, sizeof(txt) - len - 1, TXT_FIRMWARE_KEY "%s", firmware_hash);
+  }
+  mdns.addServiceRecord(service_name, KORRA_MDNS_SERVICE_PORT, MDNSServiceProtocol_t::MDNSServiceTCP, txt);
+}
+
+void KorraMdns::set_firmware_hash(const char *hash) {
+  if (hash == NULL) hash = "";
+  if (strcmp(hash, firmware_hash) == 0) return;
+  strncpy(firmware_hash, hash, sizeof(firmware_hash) - 1);
+  firmware_hash_changed = setup; // otherwise it goes in with the first registration
+}
+
+void KorraMdns::discover() {
+  if (!setup || mdns.isDiscoveringService()) return;
+  peers_count = 0;
+  mdns.startDiscoveringService("_korra", MDNSServiceProtocol_t::MDNSServiceTCP, DISCOVERY_TIMEOUT_MS);
+}
+
+bool KorraMdns::find_peer(const char *hash, IPAddress *ip, uint16_t *port) {
+  for (uint8_t i = 0; i < peers_count; i++) {
+    if (strcasecmp(peers[i].hash, hash) != 0) continue;
+    *ip = peers[i].ip;
+    *port = peers[i].port;
+    return true;
+  }
+  return false;
+}
+
+void KorraMdns::on_service_found(const char *name, IPAddress ip, unsigned short port, const char *txt) {
+  // the end of discovery is signalled without a name
+  if (name == NULL || txt == NULL || peers_count >= KORRA_MDNS_PEERS_MAX) return;
+
+  const char *found = strstr(txt, TXT_FIRMWARE_KEY);
+  if (found == NULL) return;
+  found += strlen(TXT_FIRMWARE_KEY);
+  if (strspn(found, "0123456789abcdefABCDEF") < 64) return;
+
+  struct peer *peer = &(peers[peers_count++]);
+  peer->ip = ip;
+  peer->port = port;
+  memcpy(peer->hash, found, 64);
+  peer->hash[64] = '\0';
+  Serial.printf("Found firmware peer %s at %s:%d\n", name, ip.toString().c_str(), port);
+}
+
 #endif // BOARD_HAS_INTERNET
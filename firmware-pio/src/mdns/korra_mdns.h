@@ -10,8 +10,17 @@
 
 #include "internet/korra_network_shared.h"
 
+/** Port of the service, also where the firmware is shared with peers. */
+#define KORRA_MDNS_SERVICE_PORT 7007
+
+/** Most peers remembered from discovery. */
+#define KORRA_MDNS_PEERS_MAX 8
+
 /**
  * This class is a wrapper for the service discovery via mDNS/Bonjour.
+ *
+ * The TXT record of the service also carries the hash of the firmware shared by the device (see `KorraOtaPeer`) so
+ * that neighbours can find a copy on the LAN.
  */
 class KorraMdns {
 public:
@@ -34,9 +43,49 @@ public:
    */
   void maintain(const struct korra_network_props *props);
 
+  /**
+   * Set the hash of the firmware shared with peers, advertised in the TXT record.
+   *
+   * @param hash The SHA-256 hash in hex, `NULL` when nothing is shared.
+   */
+  void set_firmware_hash(const char *hash);
+
+  /**
+   * Start looking for peers, the results are available from `find_peer()` once they answer (a few seconds).
+   */
+  void discover();
+
+  /**
+   * Find a peer sharing a firmware.
+   *
+   * @param hash The SHA-256 hash in hex of the firmware.
+   * @param ip Where to write the address of the peer.
+   * @param port Where to write the port of the peer.
+   * @return `true` if a peer was found, `false` otherwise.
+   */
+  bool find_peer(const char *hash, IPAddress *ip, uint16_t *port);
+
+  /**
+   * Please do not call this method from outside the `KorraMdns` class
+   */
+  void on_service_found(const char *name, IPAddress ip, unsigned short port, const char *txt);
+
 private:
   MDNS mdns;
   bool setup = false;
+  char service_name[sizeof("Korra 000000000000._korra")] = {0};
+  char firmware_hash[64 + 1] = {0};
+  bool firmware_hash_changed = false;
+
+  struct peer {
+    IPAddress ip;
+    uint16_t port;
+    char hash[64 + 1];
+  } peers[KORRA_MDNS_PEERS_MAX];
+  uint8_t peers_count = 0;
+
+private:
+  void add_service();
 };
 
 #endif // BOARD_HAS_INTERNET
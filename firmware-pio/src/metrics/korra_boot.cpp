@@ -0,0 +1,48 @@
+#include <Arduino.h>
+
+#include "korra_boot.h"
+
+static const char *phase_names[KORRA_BOOT_PHASE_COUNT] = {
+    "setup",              // KORRA_BOOT_PHASE_SETUP
+    "preferences",        // KORRA_BOOT_PHASE_PREFERENCES
+    "internet_begin",     // KORRA_BOOT_PHASE_INTERNET_BEGIN
+    "sensors",            // KORRA_BOOT_PHASE_SENSORS
+    "setup_end",          // KORRA_BOOT_PHASE_SETUP_END
+    "credentials",        // KORRA_BOOT_PHASE_CREDENTIALS
+    "internet_connected", // KORRA_BOOT_PHASE_INTERNET_CONNECTED
+    "provisioned",        // KORRA_BOOT_PHASE_PROVISIONED
+    "hub_connected",      // KORRA_BOOT_PHASE_HUB_CONNECTED
+    "first_telemetry",    // KORRA_BOOT_PHASE_FIRST_TELEMETRY
+};
+
+static struct korra_boot_times boot_times = {0};
+
+void KorraBoot::mark(enum korra_boot_phase phase) {
+  if (boot_times.phases[phase] != 0) return;
+
+  // millis() starts counting before setup() so a phase is never reached at zero, but guard it anyway
+  boot_times.phases[phase] = MAX(millis(), 1UL);
+  if (phase == KORRA_BOOT_PHASE_FIRST_TELEMETRY) print();
+}
+
+bool KorraBoot::reached(enum korra_boot_phase phase) {
+  return boot_times.phases[phase] != 0;
+}
+
+const struct korra_boot_times *KorraBoot::times() {
+  return &boot_times;
+}
+
+void KorraBoot::print() {
+  for (uint8_t i = 0; i < KORRA_BOOT_PHASE_COUNT; i++) {
+    if (boot_times.phases[i] == 0) {
+      Serial.printf("Boot: %s: not reached\n", phase_names[i]);
+    } else {
+      Serial.printf("Boot: %s: %lu ms\n", phase_names[i], (unsigned long)boot_times.phases[i]);
+    }
+  }
+}
+
+const char *KorraBoot::name(enum korra_boot_phase phase) {
+  return phase_names[phase];
+}
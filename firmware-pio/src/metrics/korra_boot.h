@@ -0,0 +1,86 @@
+#ifndef KORRA_BOOT_H
+#define KORRA_BOOT_H
+
+#include <stdint.h>
+
+#include "korra_config.h"
+
+enum korra_boot_phase {
+  /** Entered `setup()`. */
+  KORRA_BOOT_PHASE_SETUP = 0,
+
+  /** Preferences are ready. */
+  KORRA_BOOT_PHASE_PREFERENCES,
+
+  /** Connection to the network has been requested. */
+  KORRA_BOOT_PHASE_INTERNET_BEGIN,
+
+  /** Sensors are ready. */
+  KORRA_BOOT_PHASE_SENSORS,
+
+  /** Left `setup()`. */
+  KORRA_BOOT_PHASE_SETUP_END,
+
+  /** Device credentials are ready (they are generated in the background when missing). */
+  KORRA_BOOT_PHASE_CREDENTIALS,
+
+  /** Connected to the network. */
+  KORRA_BOOT_PHASE_INTERNET_CONNECTED,
+
+  /** Provisioning info is available. */
+  KORRA_BOOT_PHASE_PROVISIONED,
+
+  /** Connected to the hub. */
+  KORRA_BOOT_PHASE_HUB_CONNECTED,
+
+  /** First telemetry has been sent. */
+  KORRA_BOOT_PHASE_FIRST_TELEMETRY,
+
+  KORRA_BOOT_PHASE_COUNT, // must be last
+};
+
+struct korra_boot_times {
+  /** Milliseconds since power-on when each phase was reached, zero when not yet reached. */
+  uint32_t phases[KORRA_BOOT_PHASE_COUNT];
+};
+
+/**
+ * This class records when each phase of the boot sequence was reached.
+ * Only the first time a phase is reached is recorded.
+ */
+class KorraBoot {
+public:
+  /**
+   * Record that a phase has been reached.
+   *
+   * @param phase The phase.
+   */
+  static void mark(enum korra_boot_phase phase);
+
+  /**
+   * Check if a phase has been reached.
+   *
+   * @param phase The phase.
+   */
+  static bool reached(enum korra_boot_phase phase);
+
+  /**
+   * Check if the boot sequence is complete (first telemetry has been sent).
+   */
+  inline static bool complete() { return reached(KORRA_BOOT_PHASE_FIRST_TELEMETRY); }
+
+  /**
+   * Get the times recorded for each phase.
+   */
+  static const struct korra_boot_times *times();
+
+  /**
+   * Print the times recorded to the serial output.
+   */
+  static void print();
+
+  /** Get the name of a phase as used in reports. */
+  static const char *name(enum korra_boot_phase phase);
+};
+
+#endif // KORRA_BOOT_H
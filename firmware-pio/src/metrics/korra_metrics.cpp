@@ -0,0 +1,136 @@
+#include <Arduino.h>
+
+#include "korra_metrics.h"
+
+static const char *counter_names[KORRA_METRICS_COUNTER_COUNT] = {
+    "bytes_sent",              // KORRA_METRICS_COUNTER_BYTES_SENT
+    "bytes_received",          // KORRA_METRICS_COUNTER_BYTES_RECEIVED
+    "messages_sent",           // KORRA_METRICS_COUNTER_MESSAGES_SENT
+    "messages_received",       // KORRA_METRICS_COUNTER_MESSAGES_RECEIVED
+    "publish_failures",        // KORRA_METRICS_COUNTER_PUBLISH_FAILURES
+    "hub_reconnects",          // KORRA_METRICS_COUNTER_HUB_RECONNECTS
+    "actuations",              // KORRA_METRICS_COUNTER_ACTUATIONS
+    "tls_resumption_attempts", // KORRA_METRICS_COUNTER_TLS_RESUMPTION_ATTEMPTS
+    "tls_resumption_hits",     // KORRA_METRICS_COUNTER_TLS_RESUMPTION_HITS
+    "outbox_dropped",          // KORRA_METRICS_COUNTER_OUTBOX_DROPPED
+    "ota_retries",             // KORRA_METRICS_COUNTER_OTA_RETRIES
+};
+
+static const char *gauge_names[KORRA_METRICS_GAUGE_COUNT] = {
+    "free_heap",                 // KORRA_METRICS_GAUGE_FREE_HEAP
+    "min_free_heap",             // KORRA_METRICS_GAUGE_MIN_FREE_HEAP
+    "max_alloc_heap",            // KORRA_METRICS_GAUGE_MAX_ALLOC_HEAP
+    "credentials_generation_ms", // KORRA_METRICS_GAUGE_CREDENTIALS_GENERATION
+    "tls_profile",               // KORRA_METRICS_GAUGE_TLS_PROFILE
+    "outbox_length",             // KORRA_METRICS_GAUGE_OUTBOX_LENGTH
+    "budget_daily",              // KORRA_METRICS_GAUGE_BUDGET_DAILY
+    "budget_messages",           // KORRA_METRICS_GAUGE_BUDGET_MESSAGES
+    "budget_chunks",             // KORRA_METRICS_GAUGE_BUDGET_CHUNKS
+    "budget_batch",              // KORRA_METRICS_GAUGE_BUDGET_BATCH
+};
+
+static const char *histogram_names[KORRA_METRICS_HISTOGRAM_COUNT] = {
+    "tls_handshake_ms",         // KORRA_METRICS_HISTOGRAM_TLS_HANDSHAKE
+    "tls_handshake_resumed_ms", // KORRA_METRICS_HISTOGRAM_TLS_HANDSHAKE_RESUMED
+    "tls_heap_peak_kb",         // KORRA_METRICS_HISTOGRAM_TLS_HEAP_PEAK
+    "publish_ms",               // KORRA_METRICS_HISTOGRAM_PUBLISH
+    "maintain_jitter_ms",       // KORRA_METRICS_HISTOGRAM_MAINTAIN_JITTER
+    "sensors_read_ms",          // KORRA_METRICS_HISTOGRAM_SENSORS_READ
+};
+
+// recording may happen from other tasks (e.g. OTA) so a spinlock keeps updates consistent
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t counters[KORRA_METRICS_COUNTER_COUNT] = {0};
+static int32_t gauges[KORRA_METRICS_GAUGE_COUNT] = {0};
+static struct korra_metrics_histogram_data histograms[KORRA_METRICS_HISTOGRAM_COUNT] = {0};
+
+void KorraMetrics::increment(enum korra_metrics_counter id, uint32_t value) {
+  portENTER_CRITICAL(&mux);
+  counters[id] += value;
+  portEXIT_CRITICAL(&mux);
+}
+
+void KorraMetrics::set(enum korra_metrics_gauge id, int32_t value) {
+  portENTER_CRITICAL(&mux);
+  gauges[id] = value;
+  portEXIT_CRITICAL(&mux);
+}
+
+void KorraMetrics::record(enum korra_metrics_histogram id, uint32_t value) {
+  // the bucket is the position of the highest set bit, which avoids searching through the bounds
+  uint8_t bucket = value == 0 ? 0 : (32 - __builtin_clz(value));
+  bucket = MIN(bucket, KORRA_METRICS_HISTOGRAM_BUCKETS - 1);
+
+  portENTER_CRITICAL(&mux);
+  struct korra_metrics_histogram_data *hist = &(histograms[id]);
+  if (hist->count == 0 || value < hist->min) hist->min = value;
+  if (value > hist->max) hist->max = value;
+  hist->count++;
+  hist->sum += value;
+  hist->buckets[bucket]++;
+  portEXIT_CRITICAL(&mux);
+}
+
+void KorraMetrics::snapshot(struct korra_metrics_snapshot *dest) {
+  set(KORRA_METRICS_GAUGE_FREE_HEAP, ESP.getFreeHeap());
+  set(KORRA_METRICS_GAUGE_MIN_FREE_HEAP, ESP.getMinFreeHeap());
+  set(KORRA_METRICS_GAUGE_MAX_ALLOC_HEAP, ESP.getMaxAllocHeap());
+
+  portENTER_CRITICAL(&mux);
+  memcpy(dest->counters, counters, sizeof(counters));
+  memcpy(dest->gauges, gauges, sizeof(gauges));
+  memcpy(dest->histograms, histograms, sizeof(histograms));
+  portEXIT_CRITICAL(&mux);
+
+  dest->uptime = millis() / 1000;
+  dest->tasks_count = KorraTasks::collect(dest->tasks, KORRA_TASKS_MAX);
+}
+
+void KorraMetrics::print() {
+  struct korra_metrics_snapshot snap = {0};
+  snapshot(&snap);
+
+  Serial.printf("Metrics: Uptime: %lu seconds\n", (unsigned long)snap.uptime);
+  for (uint8_t i = 0; i < KORRA_METRICS_COUNTER_COUNT; i++) {
+    Serial.printf("Metrics: %s: %lu\n", counter_names[i], (unsigned long)snap.counters[i]);
+  }
+  for (uint8_t i = 0; i < KORRA_METRICS_GAUGE_COUNT; i++) {
+    Serial.printf("Metrics: %s: %ld\n", gauge_names[i], (long)snap.gauges[i]);
+  }
+  for (uint8_t i = 0; i < KORRA_METRICS_HISTOGRAM_COUNT; i++) {
+    const struct korra_metrics_histogram_data *hist = &(snap.histograms[i]);
+    if (hist->count == 0) {
+      Serial.printf("Metrics: %s: no values\n", histogram_names[i]);
+      continue;
+    }
+    Serial.printf("Metrics: %s: count=%lu min=%lu avg=%lu max=%lu\n", histogram_names[i], (unsigned long)hist->count,
+                  (unsigned long)hist->min, (unsigned long)(hist->sum / hist->count), (unsigned long)hist->max);
+    for (uint8_t b = 0; b < KORRA_METRICS_HISTOGRAM_BUCKETS; b++) {
+      if (hist->buckets[b] == 0) continue;
+      if (b == KORRA_METRICS_HISTOGRAM_BUCKETS - 1) {
+        Serial.printf("Metrics: %s: [>=%lu] %lu\n", histogram_names[i], (unsigned long)bucket_bound(b - 1),
+                      (unsigned long)hist->buckets[b]);
+      } else {
+        Serial.printf("Metrics: %s: [<%lu] %lu\n", histogram_names[i], (unsigned long)bucket_bound(b),
+                      (unsigned long)hist->buckets[b]);
+      }
+    }
+  }
+}
+
+const char *KorraMetrics::name(enum korra_metrics_counter id) {
+  return counter_names[id];
+}
+
+const char *KorraMetrics::name(enum korra_metrics_gauge id) {
+  return gauge_names[id];
+}
+
+const char *KorraMetrics::name(enum korra_metrics_histogram id) {
+  return histogram_names[id];
+}
+
+uint32_t KorraMetrics::bucket_bound(uint8_t bucket) {
+  if (bucket >= KORRA_METRICS_HISTOGRAM_BUCKETS - 1) return UINT32_MAX;
+  return 1UL << bucket;
+}
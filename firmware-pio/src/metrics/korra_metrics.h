@@ -0,0 +1,198 @@
+#ifndef KORRA_METRICS_H
+#define KORRA_METRICS_H
+
+#include <stdint.h>
+
+#include "korra_config.h"
+#include "korra_tasks.h"
+
+/**
+ * Number of buckets in each histogram.
+ * Bucket 0 holds zero, bucket `i` holds values in `[2^(i-1), 2^i)` and the last bucket holds everything above.
+ */
+#define KORRA_METRICS_HISTOGRAM_BUCKETS 16
+
+enum korra_metrics_counter {
+  /** Bytes published to the hub (topic and payload). */
+  KORRA_METRICS_COUNTER_BYTES_SENT = 0,
+
+  /** Bytes received from the hub (topic and payload). */
+  KORRA_METRICS_COUNTER_BYTES_RECEIVED,
+
+  /** Messages published to the hub. */
+  KORRA_METRICS_COUNTER_MESSAGES_SENT,
+
+  /** Messages received from the hub. */
+  KORRA_METRICS_COUNTER_MESSAGES_RECEIVED,
+
+  /** Messages that could not be published. */
+  KORRA_METRICS_COUNTER_PUBLISH_FAILURES,
+
+  /** Connections to the hub made after the first one. */
+  KORRA_METRICS_COUNTER_HUB_RECONNECTS,
+
+  /** Times the actuator was activated. */
+  KORRA_METRICS_COUNTER_ACTUATIONS,
+
+  /** TLS connections that offered a cached session. */
+  KORRA_METRICS_COUNTER_TLS_RESUMPTION_ATTEMPTS,
+
+  /** TLS connections whose cached session was accepted by the server. */
+  KORRA_METRICS_COUNTER_TLS_RESUMPTION_HITS,
+
+  /** Outbound messages dropped because their queue was full or they could not be published. */
+  KORRA_METRICS_COUNTER_OUTBOX_DROPPED,
+
+  /** Firmware download requests retried after a failure. */
+  KORRA_METRICS_COUNTER_OTA_RETRIES,
+
+  KORRA_METRICS_COUNTER_COUNT, // must be last
+};
+
+enum korra_metrics_gauge {
+  /** Free heap in bytes. */
+  KORRA_METRICS_GAUGE_FREE_HEAP = 0,
+
+  /** Lowest free heap in bytes since boot. */
+  KORRA_METRICS_GAUGE_MIN_FREE_HEAP,
+
+  /** Largest block that can be allocated from the heap in bytes. */
+  KORRA_METRICS_GAUGE_MAX_ALLOC_HEAP,
+
+  /** Milliseconds taken to generate the device credentials, zero when they were loaded. */
+  KORRA_METRICS_GAUGE_CREDENTIALS_GENERATION,
+
+  /** The TLS profile in use (see `enum korra_tls_profile`). */
+  KORRA_METRICS_GAUGE_TLS_PROFILE,
+
+  /** Outbound messages waiting to be published. */
+  KORRA_METRICS_GAUGE_OUTBOX_LENGTH,
+
+  /** Chunks (of 4 KB) the hub allows per UTC day, zero for no limit. */
+  KORRA_METRICS_GAUGE_BUDGET_DAILY,
+
+  /** Messages sent to the hub in the current UTC day. */
+  KORRA_METRICS_GAUGE_BUDGET_MESSAGES,
+
+  /** Chunks (of 4 KB) sent to the hub in the current UTC day. */
+  KORRA_METRICS_GAUGE_BUDGET_CHUNKS,
+
+  /** Readings packed into each telemetry message to stay within the budget. */
+  KORRA_METRICS_GAUGE_BUDGET_BATCH,
+
+  KORRA_METRICS_GAUGE_COUNT, // must be last
+};
+
+enum korra_metrics_histogram {
+  /** Milliseconds taken by full TLS handshakes. */
+  KORRA_METRICS_HISTOGRAM_TLS_HANDSHAKE = 0,
+
+  /** Milliseconds taken by TLS handshakes that resumed a cached session. */
+  KORRA_METRICS_HISTOGRAM_TLS_HANDSHAKE_RESUMED,
+
+  /** Most heap (in KB) used by a TLS connection during its handshake. */
+  KORRA_METRICS_HISTOGRAM_TLS_HEAP_PEAK,
+
+  /** Milliseconds taken to publish a message. */
+  KORRA_METRICS_HISTOGRAM_PUBLISH,
+
+  /** Milliseconds by which the maintenance loop deviated from its period. */
+  KORRA_METRICS_HISTOGRAM_MAINTAIN_JITTER,
+
+  /** Milliseconds taken to read the sensors. */
+  KORRA_METRICS_HISTOGRAM_SENSORS_READ,
+
+  KORRA_METRICS_HISTOGRAM_COUNT, // must be last
+};
+
+struct korra_metrics_histogram_data {
+  /** Number of values recorded. */
+  uint32_t count;
+
+  /** Sum of the values recorded. */
+  uint64_t sum;
+
+  /** Smallest value recorded. */
+  uint32_t min;
+
+  /** Largest value recorded. */
+  uint32_t max;
+
+  /** Number of values recorded in each bucket. */
+  uint32_t buckets[KORRA_METRICS_HISTOGRAM_BUCKETS];
+};
+
+struct korra_metrics_snapshot {
+  /** Seconds since boot. */
+  uint32_t uptime;
+
+  uint32_t counters[KORRA_METRICS_COUNTER_COUNT];
+  int32_t gauges[KORRA_METRICS_GAUGE_COUNT];
+  struct korra_metrics_histogram_data histograms[KORRA_METRICS_HISTOGRAM_COUNT];
+
+  /** Number of valid entries in `tasks`. */
+  size_t tasks_count;
+  struct korra_task_info tasks[KORRA_TASKS_MAX];
+};
+
+/**
+ * This class is the registry for runtime metrics.
+ * Recording is constant time and safe to call from any task, so it can be used in hot paths.
+ * Values are cumulative since boot.
+ */
+class KorraMetrics {
+public:
+  /**
+   * Increment a counter.
+   *
+   * @param id The counter.
+   * @param value The amount to add.
+   */
+  static void increment(enum korra_metrics_counter id, uint32_t value = 1);
+
+  /**
+   * Set the value of a gauge.
+   *
+   * @param id The gauge.
+   * @param value The current value.
+   */
+  static void set(enum korra_metrics_gauge id, int32_t value);
+
+  /**
+   * Record a value in a histogram.
+   *
+   * @param id The histogram.
+   * @param value The value to record.
+   */
+  static void record(enum korra_metrics_histogram id, uint32_t value);
+
+  /**
+   * Take a consistent copy of all the metrics.
+   * Gauges for the heap and the task statistics are sampled at this point.
+   *
+   * @param dest The destination of the copy.
+   */
+  static void snapshot(struct korra_metrics_snapshot *dest);
+
+  /**
+   * Print a snapshot to the serial output.
+   */
+  static void print();
+
+  /** Get the name of a counter as used in reports. */
+  static const char *name(enum korra_metrics_counter id);
+
+  /** Get the name of a gauge as used in reports. */
+  static const char *name(enum korra_metrics_gauge id);
+
+  /** Get the name of a histogram as used in reports. */
+  static const char *name(enum korra_metrics_histogram id);
+
+  /**
+   * Get the exclusive upper bound of a histogram bucket.
+   * The last bucket has no upper bound and returns `UINT32_MAX`.
+   */
+  static uint32_t bucket_bound(uint8_t bucket);
+};
+
+#endif // KORRA_METRICS_H
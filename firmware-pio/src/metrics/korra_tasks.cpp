@@ -0,0 +1,64 @@
+#include <Arduino.h>
+
+#include "korra_tasks.h"
+
+size_t KorraTasks::collect(struct korra_task_info *dest, size_t max) {
+#if configUSE_TRACE_FACILITY
+  UBaseType_t count = uxTaskGetNumberOfTasks();
+  TaskStatus_t *statuses = (TaskStatus_t *)malloc(count * sizeof(TaskStatus_t));
+  if (statuses == NULL) {
+    Serial.printf("Unable to allocate %d bytes for task statuses\n", (int)(count * sizeof(TaskStatus_t)));
+    return 0;
+  }
+
+  // this is what vTaskGetRunTimeStats uses, but we want the values and not the formatted table
+  uint32_t runtime = 0;
+  count = uxTaskGetSystemState(statuses, count, &runtime);
+
+  // the run time is counted per core, so the total is shared among them
+  uint64_t total_runtime = (uint64_t)runtime * portNUM_PROCESSORS;
+
+  size_t collected = 0;
+  for (UBaseType_t i = 0; i < count && collected < max; i++) {
+    const TaskStatus_t *status = &(statuses[i]);
+    struct korra_task_info *info = &(dest[collected++]);
+    memset(info, 0, sizeof(struct korra_task_info));
+    snprintf(info->name, sizeof(info->name), "%s", status->pcTaskName);
+    info->priority = status->uxCurrentPriority;
+    info->stack_free = status->usStackHighWaterMark; // ESP-IDF measures the stack in bytes
+
+    BaseType_t core = xTaskGetCoreID(status->xHandle);
+    info->core = core == tskNO_AFFINITY ? -1 : core;
+
+#if configGENERATE_RUN_TIME_STATS
+    info->cpu = total_runtime > 0 ? (int8_t)(((uint64_t)status->ulRunTimeCounter * 100) / total_runtime) : 0;
+#else
+    info->cpu = -1;
+#endif // configGENERATE_RUN_TIME_STATS
+  }
+
+  free(statuses);
+  return collected;
+#else
+  return 0;
+#endif // configUSE_TRACE_FACILITY
+}
+
+void KorraTasks::print() {
+  struct korra_task_info tasks[KORRA_TASKS_MAX];
+  size_t count = collect(tasks, KORRA_TASKS_MAX);
+  if (count == 0) {
+    Serial.println("Task statistics are not available");
+    return;
+  }
+
+  Serial.printf("%-*s %4s %4s %10s %4s\n", configMAX_TASK_NAME_LEN, "Task", "Prio", "Core", "Stack Free", "CPU");
+  for (size_t i = 0; i < count; i++) {
+    const struct korra_task_info *info = &(tasks[i]);
+    char core[4] = "any", cpu[5] = "n/a";
+    if (info->core >= 0) snprintf(core, sizeof(core), "%d", info->core);
+    if (info->cpu >= 0) snprintf(cpu, sizeof(cpu), "%d%%", info->cpu);
+    Serial.printf("%-*s %4d %4s %10lu %4s\n", configMAX_TASK_NAME_LEN, info->name, info->priority, core,
+                  (unsigned long)info->stack_free, cpu);
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef KORRA_TASKS_H
+#define KORRA_TASKS_H
+
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "korra_config.h"
+
+/** Maximum number of tasks collected, extra tasks are ignored. */
+#define KORRA_TASKS_MAX 24
+
+struct korra_task_info {
+  /** The name of the task. */
+  char name[configMAX_TASK_NAME_LEN + 1];
+
+  /** The priority of the task. */
+  uint8_t priority;
+
+  /** The core the task is pinned to, `-1` when it can run on any. */
+  int8_t core;
+
+  /** Smallest amount of stack (in bytes) that has remained free since the task started. */
+  uint32_t stack_free;
+
+  /** Share of the CPU time (in percent) used since boot, `-1` when run time stats are not available. */
+  int8_t cpu;
+};
+
+/**
+ * This class is a wrapper for the FreeRTOS task statistics.
+ * It lists every task with its stack high-water mark, CPU usage and core affinity.
+ */
+class KorraTasks {
+public:
+  /**
+   * Collect information about the running tasks.
+   *
+   * @param dest The destination array.
+   * @param max The number of elements in the destination array.
+   * @return The number of tasks collected.
+   */
+  static size_t collect(struct korra_task_info *dest, size_t max);
+
+  /**
+   * Print the running tasks to the serial output.
+   */
+  static void print();
+};
+
+#endif // KORRA_TASKS_H
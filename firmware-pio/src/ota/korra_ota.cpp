@@ -1,15 +1,20 @@
 #include <Arduino.h>
+#include <ArduinoJson.h>
+#include <app_version.h>
 #include <esp_system.h>
 
 #include "korra_ota.h"
+#include "metrics/korra_boot.h"
+#include "metrics/korra_metrics.h"
 
 /**
- * This file borrows heavily from
+ * This file started from
  * https://github.com/espressif/arduino-esp32/blob/ac961f671abd5ae1da0a15fd4bee71ed807c2cf3/libraries/Update/src/HttpsOTAUpdate.cpp
  * https://github.com/espressif/arduino-esp32/blob/ac961f671abd5ae1da0a15fd4bee71ed807c2cf3/libraries/Update/src/HttpsOTAUpdate.h
  *
  * However, we cannot use it directly because the HTTP headers are large when pulling from GitHub releases and we need
  * set bigger values for `buffer_size_tx` and `buffer_size` in `esp_http_client_config_t`.
+ * The download is also our own instead of `esp_https_ota()` so that it can be done in ranges and resumed.
  */
 
 #include <freertos/FreeRTOS.h>
@@ -17,10 +22,67 @@
 #include <freertos/task.h>
 
 #include "esp32-hal-log.h"
-#include "esp_http_client.h"
-#include "esp_https_ota.h"
+#include "esp_app_format.h"
+#include "esp_ota_ops.h"
+#include "esp_rom_crc.h"
+#include "rom/miniz.h"
 
-#define OTA_TASK_STACK_SIZE 9216
+#include <mbedtls/asn1write.h>
+#include <mbedtls/ecdsa.h>
+#include <mbedtls/pk.h>
+#include <ota_signing_key.h>
+
+#ifndef CONFIG_OTA_HEALTH_TIMEOUT_SEC
+#define CONFIG_OTA_HEALTH_TIMEOUT_SEC (10 * 60) // a new image rolls back unless healthy within this time of booting
+#endif
+
+#ifndef CONFIG_OTA_TASK_PRIORITY
+#define CONFIG_OTA_TASK_PRIORITY 1 // same as the loop task so that the hub is not starved
+#endif
+
+#ifndef CONFIG_OTA_TASK_STACK_SIZE
+#define CONFIG_OTA_TASK_STACK_SIZE 9216 // use the `tasks` shell command to check the high-water mark before changing
+#endif
+
+#define PREFERENCES_NAMESPACE_OTA "korra-ota"
+
+#define PREFERENCES_KEY_OTA_URL "ota-url"       // checksum of the URL being downloaded
+#define PREFERENCES_KEY_OTA_OFFSET "ota-offset" // bytes written so far
+#define PREFERENCES_KEY_OTA_SIZE "ota-size"     // size of the image
+
+#define PREFERENCES_KEY_OTA_MANIFEST "ota-manifest"   // checksum of the manifest URL and hash that last checked out
+#define PREFERENCES_KEY_OTA_ETAG "ota-etag"           // ETag of that manifest
+#define PREFERENCES_KEY_OTA_STAGED "ota-staged"       // checksum of the hash of the image staged in the next partition
+#define PREFERENCES_KEY_OTA_STAGED_AT "ota-staged-at" // address of that partition
+#define PREFERENCES_KEY_OTA_FAILED "ota-failed"       // checksum of the hash of the image that last failed verification
+
+#define OTA_SECTOR_SIZE 4096 // flash is erased in sectors
+#define OTA_BUFFER_SIZE 4096 // also the largest manifest
+#define OTA_MAX_RETRIES 5 // consecutive failed requests before giving up (the download resumes on the next update)
+#define OTA_MAX_REDIRECTS 3
+#define OTA_PEER_MAX_RETRIES 2 // failed requests to a peer before downloading from the internet instead
+#define OTA_MIN_VALID_TIME 1704067200 // 2024-01-01, anything earlier means the time is not synced yet
+#define OTA_REBOOT_DRAIN_MS (30 * 1000) // most time to wait for pending messages before restarting after an update
+#define OTA_SHARE_MAX_MS (15 * 60 * 1000) // most time to share a new image with peers before restarting into it
+
+// Delta images are zlib compressed operations that rebuild the image from the running one. Each operation is a code
+// followed by little-endian 32-bit numbers: 'A' {length} {bytes} adds bytes, 'C' {length} {offset} copies a range.
+#define OTA_DELTA_ADD 'A'
+#define OTA_DELTA_COPY 'C'
+
+struct korra_ota_stream {
+  tinfl_decompressor inflator;
+  uint8_t *dict;      // window of the last 32 KB decompressed which is also where the output is written
+  size_t dict_offset; // where the next output goes in the window
+  bool done;          // the end of the compressed data was reached
+
+  // the delta operation being applied
+  const esp_partition_t *base; // the running image
+  uint8_t header[9];           // code and numbers of the operation
+  uint8_t header_len;          // bytes of the header collected so far
+  uint32_t remaining;          // bytes of the operation not yet written
+  uint8_t scratch[1024];       // bytes copied from the running image
+};
 
 static esp_http_client_config_t config;
 static EventGroupHandle_t ota_status = NULL; // check for ota status
@@ -31,56 +93,36 @@ static const int OTA_UPDATING_BIT = BIT1;
 static const int OTA_SUCCESS_BIT = BIT2;
 static const int OTA_FAIL_BIT = BIT3;
 
+// total size of the image from the Content-Range of the last response, zero when absent
+static uint32_t response_total = 0;
+
+// ETag of the last response, empty when absent
+static char response_etag[64 + 1];
+
+static portMUX_TYPE holds_mux = portMUX_INITIALIZER_UNLOCKED;
+
 esp_err_t http_event_handler(esp_http_client_event_t *event) {
-  // switch (event->event_id) {
-  // case esp_http_client_event_id_t::HTTP_EVENT_ERROR:
-  //   Serial.println("Http Event Error");
-  //   break;
-  // case esp_http_client_event_id_t::HTTP_EVENT_ON_CONNECTED:
-  //   Serial.println("Http Event On Connected");
-  //   break;
-  // case esp_http_client_event_id_t::HTTP_EVENT_HEADER_SENT:
-  //   Serial.println("Http Event Header Sent");
-  //   break;
-  // case esp_http_client_event_id_t::HTTP_EVENT_ON_HEADER:
-  //   Serial.printf("Http Event On Header, key=%s, value=%s\n", event->header_key, event->header_value);
-  //   break;
-  // case esp_http_client_event_id_t::HTTP_EVENT_ON_DATA:
-  //   break;
-  // case esp_http_client_event_id_t::HTTP_EVENT_ON_FINISH:
-  //   Serial.println("Http Event On Finish");
-  //   break;
-  // case esp_http_client_event_id_t::HTTP_EVENT_DISCONNECTED:
-  //   Serial.println("Http Event Disconnected");
-  //   break;
-  // }
+  if (event->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(event->header_key, "Content-Range") == 0) {
+    // Content-Range -> bytes {first}-{last}/{total}
+    const char *slash = strchr(event->header_value, '/');
+    if (slash != NULL) response_total = strtoul(slash + 1, NULL, 10);
+  } else if (event->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(event->header_key, "ETag") == 0) {
+    strncpy(response_etag, event->header_value, sizeof(response_etag) - 1); // a truncated one never matches
+  }
   return ESP_OK;
 }
 
+// The Arduino core marks a new image valid as soon as it boots unless told that we verify it ourselves
+bool verifyRollbackLater() {
+  return true;
+}
+
+static uint32_t crc_of(const char *value, uint32_t crc = 0) {
+  return esp_rom_crc32_le(crc, (const uint8_t *)value, strlen(value));
+}
+
 void https_ota_task(void *param) {
-  if (ota_status) {
-    xEventGroupSetBits(ota_status, OTA_UPDATING_BIT);
-    xEventGroupClearBits(ota_status, OTA_IDLE_BIT);
-  }
-  esp_https_ota_config_t cfg;
-  cfg.http_config = (const esp_http_client_config_t *)param;
-  cfg.http_client_init_cb = NULL;
-  cfg.bulk_flash_erase = false;      // Erase entire flash partition during initialization
-  cfg.partial_http_download = false; // Enable Firmware image to be downloaded over multiple HTTP requests
-  cfg.max_http_request_size = 0;     // Maximum request size for partial HTTP download
-
-  esp_err_t ret = esp_https_ota((const esp_https_ota_config_t *)&cfg);
-  if (ret == ESP_OK) {
-    if (ota_status) {
-      xEventGroupClearBits(ota_status, OTA_UPDATING_BIT);
-      xEventGroupSetBits(ota_status, OTA_SUCCESS_BIT);
-    }
-  } else {
-    if (ota_status) {
-      xEventGroupClearBits(ota_status, OTA_UPDATING_BIT);
-      xEventGroupSetBits(ota_status, OTA_FAIL_BIT);
-    }
-  }
+  ((KorraOta *)param)->download();
   vTaskDelete(NULL);
 }
 
@@ -90,27 +132,75 @@ KorraOta::KorraOta() {
 KorraOta::~KorraOta() {
 }
 
-void KorraOta::begin(const char *ca_cert) {
-  this->ca_cert = ca_cert;
+void KorraOta::begin(mbedtls_x509_crt *trust_store) {
+  this->trust_store = trust_store;
+
+  // the download task keeps its progress in a handle of its own, the shared one is only used from the loop
+  if (!prefs.begin(PREFERENCES_NAMESPACE_OTA, /* readonly */ false)) {
+    Serial.println("Could not open the firmware update preferences, downloads will not resume");
+  }
+
+  // an image booting for the first time after an update has to pass the health check (see maintain)
+  esp_ota_img_states_t state;
+  pending_verify = esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+                   state == ESP_OTA_IMG_PENDING_VERIFY;
+  if (pending_verify) {
+    Serial.printf("Firmware is new, it rolls back unless healthy within %d seconds\n", CONFIG_OTA_HEALTH_TIMEOUT_SEC);
+  }
 }
 
 void KorraOta::update(const struct korra_ota_info *value) {
+  if (current_status() == https_ota_status::HTTPS_OTA_STATUS_UPDATING) {
+    Serial.println("Firmware update already in progress");
+    return;
+  }
+  if (current_status() == https_ota_status::HTTPS_OTA_STATUS_SUCCESS) {
+    Serial.println("Firmware update already written, waiting to reboot");
+    return;
+  }
+
+  if (pending_verify) {
+    // the next partition holds the image we would roll back to
+    Serial.println("Cannot update firmware before the running one passes its health check");
+    return;
+  }
+
   memcpy(&info, value, sizeof(struct korra_ota_info));
   if (strlen(info.url) == 0) {
     Serial.println("Cannot initiate firmware update from empty URL");
     return;
   }
+  if (strlen(info.hash) != 64) {
+    Serial.println("Cannot initiate firmware update without a SHA-256 hash");
+    return;
+  }
+  if (info.format == KORRA_OTA_FORMAT_DELTA && info.base != APP_VERSION_NUMBER) {
+    Serial.printf("Cannot apply a firmware delta made for version %lu on %lu\n", (unsigned long)info.base,
+                  (unsigned long)APP_VERSION_NUMBER);
+    return;
+  }
+  info.chunk_size = info.chunk_size ? info.chunk_size : KORRA_OTA_CHUNK_SIZE_DEFAULT;
+  info.chunk_size = CLAMP(info.chunk_size, KORRA_OTA_CHUNK_SIZE_MIN, KORRA_OTA_CHUNK_SIZE_MAX);
+  info.chunk_size = info.chunk_size / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
   Serial.println("Starting firmware update ...");
   Serial.printf("URL: %s\n", info.url);
+  if (strlen(info.manifest) > 0) Serial.printf("Manifest: %s\n", info.manifest);
+  if (strlen(info.peer) > 0) Serial.printf("Peer: %s\n", info.peer);
   Serial.printf("Hash: %s\n", info.hash);
   Serial.printf("Signature: %s\n", info.signature);
+  Serial.printf("Chunk size: %lu bytes\n", (unsigned long)info.chunk_size);
+  Serial.printf("Format: %s\n", info.format == KORRA_OTA_FORMAT_DELTA  ? "delta"
+                                 : info.format == KORRA_OTA_FORMAT_ZLIB ? "zlib"
+                                                                         : "raw");
   printed_fail = false;
 
-  // TODO: figure out how to check hash and signature
-  // https://docs.espressif.com/projects/esp-idf/en/stable/esp32/api-reference/system/esp_https_ota.html#signature-verification
+  if (!trust_store) {
+    Serial.println("Cannot initiate firmware update without root certificates");
+    return;
+  }
 
   config.url = info.url;
-  config.cert_pem = ca_cert;
+  config.use_global_ca_store = true; // the trust store is the global one, so nothing is parsed again
   config.skip_cert_common_name_check = false;
   config.event_handler = http_event_handler;
   // config.buffer_size = 2048;
@@ -124,17 +214,50 @@ void KorraOta::update(const struct korra_ota_info *value) {
     xEventGroupSetBits(ota_status, OTA_IDLE_BIT);
   }
 
-  if (xTaskCreate(&https_ota_task, "https_ota_task", OTA_TASK_STACK_SIZE, &config, 5, NULL) != pdPASS) {
+  // a twin delivered again must not download what the next partition already holds
+  if (staged()) return;
+
+  set_status(OTA_UPDATING_BIT);
+  if (xTaskCreate(&https_ota_task, "https_ota_task", CONFIG_OTA_TASK_STACK_SIZE, this, CONFIG_OTA_TASK_PRIORITY,
+                  NULL) != pdPASS) {
     log_e("Couldn't create ota task\n");
+    set_status(OTA_FAIL_BIT);
   }
 }
 
 void KorraOta::maintain() {
+  // healthy means connected to the internet, then the hub and sending telemetry
+  if (pending_verify) {
+    if (KorraBoot::reached(KORRA_BOOT_PHASE_INTERNET_CONNECTED) && KorraBoot::reached(KORRA_BOOT_PHASE_HUB_CONNECTED) &&
+        KorraBoot::reached(KORRA_BOOT_PHASE_FIRST_TELEMETRY)) {
+      Serial.println("Firmware passed the health check");
+      esp_ota_mark_app_valid_cancel_rollback();
+      pending_verify = false;
+    } else if (millis() > CONFIG_OTA_HEALTH_TIMEOUT_SEC * 1000UL) {
+      Serial.println("Firmware failed the health check, rolling back ...");
+      Serial.flush();
+      esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+  }
+
   const enum https_ota_status status = current_status();
   if (status == https_ota_status::HTTPS_OTA_STATUS_SUCCESS) {
-    Serial.println("Firmware written successfully. Rebooting in 5 sec ...");
-    delay(5 * 1000);
-    esp_restart();
+    // neighbours getting the same update may download it from us first
+    if (staged_at == 0) staged_at = MAX(millis(), 1UL);
+    bool shared = share_callback == NULL || share_callback() || (millis() - staged_at) > OTA_SHARE_MAX_MS;
+    if (!shared) return;
+
+    // give what is pending a chance to go out first
+    if (reboot_requested_at == 0) {
+      Serial.println("Firmware written successfully. Rebooting once pending messages are sent ...");
+      reboot_requested_at = MAX(millis(), 1UL);
+    }
+    bool ready = reboot_callback == NULL || reboot_callback();
+    if (ready || (millis() - reboot_requested_at) > OTA_REBOOT_DRAIN_MS) {
+      Serial.println("Rebooting ...");
+      Serial.flush();
+      esp_restart();
+    }
   } else if (status == https_ota_status::HTTPS_OTA_STATUS_FAIL) {
     if (!printed_fail) {
       Serial.println("Firmware upgrade failed");
@@ -143,10 +266,651 @@ void KorraOta::maintain() {
   }
 }
 
-void KorraOta::populate(const char *url, const char *hash, const char *signature, struct korra_ota_info *dest) {
+bool KorraOta::staged_image(const esp_partition_t **partition, uint32_t *length, const char **hash) {
+  // the download task has finished with these once it has set the status
+  if (current_status() != https_ota_status::HTTPS_OTA_STATUS_SUCCESS) return false;
+  *partition = this->partition;
+  *length = written;
+  *hash = info.hash;
+  return true;
+}
+
+void KorraOta::set_schedule(const struct korra_ota_schedule *value) {
+  struct korra_ota_schedule next = *value;
+  next.max_rate = next.max_rate ? MAX(next.max_rate, (uint32_t)KORRA_OTA_MAX_RATE_MIN) : KORRA_OTA_MAX_RATE_DEFAULT;
+  next.window_start %= 24;
+  next.window_end %= 24;
+  schedule = next; // read by the download task, a torn read only lasts one chunk
+  Serial.printf("Firmware downloads at up to %lu bytes/sec between %02d:00 and %02d:00 UTC\n",
+                (unsigned long)next.max_rate, next.window_start, next.window_end);
+}
+
+void KorraOta::hold(enum korra_ota_hold reason, bool held) {
+  portENTER_CRITICAL(&holds_mux);
+  holds = held ? (holds | reason) : (holds & ~reason);
+  portEXIT_CRITICAL(&holds_mux);
+}
+
+void KorraOta::progress(struct korra_ota_progress *dest) {
+  const enum https_ota_status status = current_status();
+  const char *name = "idle";
+  if (pending_verify) name = "verifying";
+  else if (status == https_ota_status::HTTPS_OTA_STATUS_UPDATING) name = paused ? "paused" : "downloading";
+  else if (status == https_ota_status::HTTPS_OTA_STATUS_SUCCESS) name = "rebooting";
+  else if (status == https_ota_status::HTTPS_OTA_STATUS_FAIL) name = "failed";
+  memset(dest, 0, sizeof(struct korra_ota_progress));
+  strncpy(dest->status, name, sizeof(dest->status) - 1);
+  dest->bytes = progress_bytes;
+  dest->total = progress_total;
+  if (status != https_ota_status::HTTPS_OTA_STATUS_UPDATING || paused) return;
+
+  // the rate only counts what was downloaded in this attempt
+  unsigned long elapsed = millis() - progress_started;
+  if (elapsed > 0 && progress_bytes > progress_base) {
+    dest->rate = ((uint64_t)(progress_bytes - progress_base) * 1000) / elapsed;
+  }
+  if (dest->rate > 0 && progress_total > progress_bytes) dest->eta = (progress_total - progress_bytes) / dest->rate;
+}
+
+void KorraOta::populate(uint32_t version, const char *url, const char *manifest, const char *hash,
+                        const char *signature, uint32_t chunk_size, const char *format, uint32_t base,
+                        struct korra_ota_info *dest) {
+  dest->version = version;
   memcpy(dest->url, url, MIN((int)sizeof(dest->url), (int)strlen(url)));
+  memcpy(dest->manifest, manifest, MIN((int)sizeof(dest->manifest), (int)strlen(manifest)));
   memcpy(dest->hash, hash, MIN((int)sizeof(dest->hash), (int)strlen(hash)));
   memcpy(dest->signature, signature, MIN((int)sizeof(dest->signature), (int)strlen(signature)));
+  dest->chunk_size = chunk_size;
+  dest->format = strcmp(format, "delta") == 0   ? KORRA_OTA_FORMAT_DELTA
+                 : strcmp(format, "zlib") == 0 ? KORRA_OTA_FORMAT_ZLIB
+                                               : KORRA_OTA_FORMAT_RAW;
+  dest->base = base;
+}
+
+void KorraOta::download() {
+  partition = esp_ota_get_next_update_partition(NULL);
+  if (partition == NULL) {
+    Serial.println("No partition to write the firmware update to");
+    set_status(OTA_FAIL_BIT);
+    return;
+  }
+  buffer = (uint8_t *)malloc(OTA_BUFFER_SIZE);
+  if (buffer == NULL) {
+    Serial.printf("Unable to allocate %d bytes for firmware download\n", OTA_BUFFER_SIZE);
+    set_status(OTA_FAIL_BIT);
+    return;
+  }
+  if (!check_manifest()) {
+    free(buffer);
+    buffer = NULL;
+    set_status(OTA_FAIL_BIT);
+    return;
+  }
+  if (info.format != KORRA_OTA_FORMAT_RAW) {
+    stream = (struct korra_ota_stream *)malloc(sizeof(struct korra_ota_stream));
+    if (stream != NULL) stream->dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (stream == NULL || stream->dict == NULL) {
+      Serial.printf("Unable to allocate %d bytes for firmware decompression\n",
+                    (int)(sizeof(struct korra_ota_stream) + TINFL_LZ_DICT_SIZE));
+      if (stream != NULL) free(stream);
+      stream = NULL;
+      free(buffer);
+      buffer = NULL;
+      set_status(OTA_FAIL_BIT);
+      return;
+    }
+    stream->base = esp_ota_get_running_partition();
+  }
+
+  // a peer on the LAN serves the raw image, the internet is the fallback
+  source = strlen(info.peer) > 0 ? info.peer : info.url;
+  format = source == info.peer ? KORRA_OTA_FORMAT_RAW : info.format;
+  config.url = source;
+
+  // whatever was staged is about to be overwritten
+  prefs.remove(PREFERENCES_KEY_OTA_STAGED);
+  prefs.remove(PREFERENCES_KEY_OTA_STAGED_AT);
+
+  // the hash covers the whole image, what an earlier download wrote is read back once and the rest is hashed as
+  // it is written
+  mbedtls_sha256_init(&sha);
+  restart();
+
+  // resume a download of the same URL, from the start of its sector because more of the sector may have been
+  // written after the offset was saved and flash cannot be written twice without erasing
+  uint32_t url_crc = esp_rom_crc32_le(0, (const uint8_t *)source, strlen(source));
+  uint32_t offset = 0, total = 0;
+  if (format == KORRA_OTA_FORMAT_RAW && prefs.getUInt(PREFERENCES_KEY_OTA_URL, 0) == url_crc) {
+    offset = prefs.getUInt(PREFERENCES_KEY_OTA_OFFSET, 0) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+    total = prefs.getUInt(PREFERENCES_KEY_OTA_SIZE, 0);
+    if (offset > 0) {
+      Serial.printf("Resuming firmware download at %lu of %lu bytes\n", (unsigned long)offset, (unsigned long)total);
+    }
+  } else {
+    clear_progress();
+    prefs.putUInt(PREFERENCES_KEY_OTA_URL, url_crc);
+  }
+  written = erased = offset;
+  progress_bytes = progress_base = offset;
+  progress_total = total;
+  bool ok = hash_written(offset);
+
+  esp_http_client_handle_t client = ok ? esp_http_client_init(&config) : NULL;
+  ok = client != NULL;
+  uint8_t retries = 0;
+  while (ok) {
+    while (ok && (total == 0 || offset < total)) {
+      if (wait()) esp_http_client_close(client); // the kept-alive connection is likely gone by now
+      if (fetch(client, &offset, &total)) {
+        retries = 0;
+        continue;
+      }
+
+      // start over on a new connection to the original URL (redirect targets may expire)
+      esp_http_client_close(client);
+      if (++retries > OTA_PEER_MAX_RETRIES && source == info.peer) {
+        // a raw image from the internet is the same bytes so it carries on, anything else starts over
+        Serial.println("Firmware peer is unavailable, downloading from the internet");
+        source = info.url;
+        if (info.format != format) {
+          format = info.format;
+          offset = total = 0;
+          restart();
+        }
+        save_progress(offset, total);
+        prefs.putUInt(PREFERENCES_KEY_OTA_URL, esp_rom_crc32_le(0, (const uint8_t *)source, strlen(source)));
+        retries = 0;
+      }
+      esp_http_client_set_url(client, source);
+      if (retries > OTA_MAX_RETRIES) {
+        Serial.printf("Firmware download stopped at %lu of %lu bytes\n", (unsigned long)offset, (unsigned long)total);
+        ok = false;
+        break;
+      }
+
+      // the first retry is immediate since the server may simply have closed a kept-alive connection
+      KorraMetrics::increment(KORRA_METRICS_COUNTER_OTA_RETRIES);
+      if (retries > 1) vTaskDelay(pdMS_TO_TICKS(1000 << retries));
+    }
+    if (ok && format != KORRA_OTA_FORMAT_RAW && (!stream->done || stream->remaining > 0 || stream->header_len > 0)) {
+      Serial.println("Compressed firmware image ended early");
+      ok = false;
+    }
+    if (!ok) break;
+
+    // an image that does not match is erased so that nothing of it can ever be booted
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    if (verify(digest)) break;
+    esp_partition_erase_range(partition, 0, erased);
+    clear_progress();
+    if (source == info.url) {
+      prefs.putUInt(PREFERENCES_KEY_OTA_FAILED, crc_of(info.hash)); // the same image would only fail again
+      ok = false;
+      break;
+    }
+
+    // the peer is not authenticated so a bad image from it says nothing about the release, the internet decides
+    Serial.println("Firmware from peer is not valid, downloading from the internet");
+    source = info.url;
+    format = info.format;
+    offset = total = 0;
+    retries = 0;
+    restart();
+    prefs.putUInt(PREFERENCES_KEY_OTA_URL, esp_rom_crc32_le(0, (const uint8_t *)source, strlen(source)));
+    esp_http_client_close(client);
+    esp_http_client_set_url(client, source);
+  }
+  if (client != NULL) esp_http_client_cleanup(client);
+  mbedtls_sha256_free(&sha);
+  if (stream != NULL) {
+    free(stream->dict);
+    free(stream);
+    stream = NULL;
+  }
+  free(buffer);
+  buffer = NULL;
+
+  // setting the boot partition validates the image written
+  if (ok) {
+    esp_err_t err = esp_ota_set_boot_partition(partition);
+    if (err != ESP_OK) {
+      Serial.printf("Firmware image is not valid: %s\n", esp_err_to_name(err));
+      ok = false;
+    } else {
+      prefs.putUInt(PREFERENCES_KEY_OTA_STAGED, crc_of(info.hash));
+      prefs.putUInt(PREFERENCES_KEY_OTA_STAGED_AT, partition->address);
+    }
+    clear_progress();
+  }
+  set_status(ok ? OTA_SUCCESS_BIT : OTA_FAIL_BIT);
+}
+
+void KorraOta::restart() {
+  written = erased = 0;
+  progress_bytes = progress_base = 0;
+  progress_started = millis();
+  mbedtls_sha256_starts(&sha, /* is224 */ 0);
+  if (stream != NULL) {
+    tinfl_init(&stream->inflator);
+    stream->dict_offset = 0;
+    stream->done = false;
+    stream->header_len = 0;
+    stream->remaining = 0;
+  }
+}
+
+bool KorraOta::wait() {
+  if (holds == 0 && in_window()) return false;
+
+  // the time paused does not count towards the rate
+  unsigned long started = millis();
+  paused = true;
+  Serial.println("Firmware download paused");
+  while (holds != 0 || !in_window()) vTaskDelay(pdMS_TO_TICKS(1000));
+  progress_started += millis() - started;
+  paused = false;
+  Serial.println("Firmware download resumed");
+  return true;
+}
+
+bool KorraOta::in_window() {
+  const uint16_t start = schedule.window_start, end = schedule.window_end;
+  if (start == end) return true;
+
+  time_t now = time(NULL);
+  if (now < OTA_MIN_VALID_TIME) return false; // the window cannot be told without the time
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  if (start < end) return tm.tm_hour >= start && tm.tm_hour < end;
+  return tm.tm_hour >= start || tm.tm_hour < end; // the window spans midnight
+}
+
+bool KorraOta::hash_written(uint32_t length) {
+  for (uint32_t position = 0; position < length; position += OTA_BUFFER_SIZE) {
+    size_t len = MIN(length - position, (uint32_t)OTA_BUFFER_SIZE);
+    esp_err_t err = esp_partition_read(partition, position, buffer, len);
+    if (err != ESP_OK) {
+      Serial.printf("Failed to read firmware data at %lu bytes: %s\n", (unsigned long)position, esp_err_to_name(err));
+      return false;
+    }
+    mbedtls_sha256_update(&sha, buffer, len);
+  }
+  return true;
+}
+
+static bool hex_to_bytes(const char *hex, uint8_t *dest, size_t len) {
+  for (size_t i = 0; i < len * 2; i++) {
+    char c = hex[i];
+    uint8_t nibble;
+    if (c >= '0' && c <= '9') nibble = c - '0';
+    else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+    else return false;
+    dest[i / 2] = (i % 2) ? (dest[i / 2] | nibble) : (nibble << 4);
+  }
+  return true;
+}
+
+bool KorraOta::verify(const uint8_t *digest) {
+  uint8_t expected[32];
+  if (!hex_to_bytes(info.hash, expected, sizeof(expected)) || memcmp(digest, expected, sizeof(expected)) != 0) {
+    Serial.println("Firmware hash does not match");
+    return false;
+  }
+
+#ifdef OTA_SIGNING_KEY
+  // the signature is ECDSA P-256 over the hash, r and s concatenated in hex, which mbedtls wants in DER
+  // SEQUENCE { INTEGER r, INTEGER s } (written backwards from the end of the buffer)
+  uint8_t raw[64];
+  if (strlen(info.signature) != 128 || !hex_to_bytes(info.signature, raw, sizeof(raw))) {
+    Serial.println("Firmware signature is missing or malformed");
+    return false;
+  }
+
+  unsigned char der[MBEDTLS_ECDSA_MAX_SIG_LEN(256)];
+  unsigned char *p = der + sizeof(der);
+  mbedtls_mpi r, s;
+  mbedtls_pk_context key;
+  mbedtls_mpi_init(&r);
+  mbedtls_mpi_init(&s);
+  mbedtls_pk_init(&key);
+  int ret = mbedtls_mpi_read_binary(&r, raw, 32);
+  if (ret == 0) ret = mbedtls_mpi_read_binary(&s, raw + 32, 32);
+  int len = 0;
+  if (ret == 0) ret = len = mbedtls_asn1_write_mpi(&p, der, &s);
+  if (ret >= 0) len += ret = mbedtls_asn1_write_mpi(&p, der, &r);
+  if (ret >= 0) len += ret = mbedtls_asn1_write_len(&p, der, len);
+  if (ret >= 0) len += ret = mbedtls_asn1_write_tag(&p, der, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE);
+  if (ret >= 0) ret = mbedtls_pk_parse_public_key(&key, OTA_SIGNING_KEY, sizeof(OTA_SIGNING_KEY));
+  if (ret == 0) ret = mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, digest, 32, p, len);
+  mbedtls_pk_free(&key);
+  mbedtls_mpi_free(&s);
+  mbedtls_mpi_free(&r);
+  if (ret != 0) {
+    Serial.printf("Firmware signature is not valid: -0x%04x\n", -ret);
+    return false;
+  }
+#else
+  Serial.println("Firmware signature cannot be checked, this build has no signing key");
+  return false;
+#endif // OTA_SIGNING_KEY
+
+  return true;
+}
+
+bool KorraOta::open(esp_http_client_handle_t client, int64_t *length, int *status) {
+  for (uint8_t redirects = 0;; redirects++) {
+    response_total = 0;
+    response_etag[0] = '\0';
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+      Serial.printf("Failed to open HTTP connection: %s\n", esp_err_to_name(err));
+      return false;
+    }
+    *length = esp_http_client_fetch_headers(client);
+    *status = esp_http_client_get_status_code(client);
+    if (*status < 300 || *status == 304 || *status >= 400 || redirects >= OTA_MAX_REDIRECTS) return true;
+
+    // GitHub releases redirect to a storage URL, it is used for the following chunks too
+    esp_http_client_flush_response(client, NULL);
+    esp_http_client_set_redirection(client);
+  }
+}
+
+bool KorraOta::fetch(esp_http_client_handle_t client, uint32_t *offset, uint32_t *total) {
+  // request the next chunk -> Range: bytes={first}-{last}
+  uint32_t last = *offset + info.chunk_size - 1;
+  if (*total > 0) last = MIN(last, *total - 1);
+  char range[sizeof("bytes=4294967295-4294967295")];
+  snprintf(range, sizeof(range), "bytes=%lu-%lu", (unsigned long)*offset, (unsigned long)last);
+  esp_http_client_set_header(client, "Range", range);
+
+  int64_t length;
+  int status;
+  if (!open(client, &length, &status)) return false;
+
+  if (status == 200) {
+    // the server ignores ranges so the whole image is coming
+    if (*offset > 0) Serial.println("Server does not support ranges, downloading from the start");
+    *offset = 0;
+    *total = length > 0 ? length : 0;
+    restart();
+  } else if (status == 206) {
+    if (response_total == 0) {
+      Serial.println("Partial response without the size of the image");
+      return false;
+    }
+    if (*total > 0 && *total != response_total) {
+      // the image behind the URL has changed, what we have is of no use
+      Serial.println("Firmware image size changed, downloading from the start");
+      *offset = 0;
+      *total = response_total;
+      restart();
+      save_progress(*offset, *total);
+      esp_http_client_close(client);
+      return true;
+    }
+    *total = response_total;
+  } else {
+    Serial.printf("Unexpected HTTP status %d for firmware download\n", status);
+    return false;
+  }
+
+  bool ok = true;
+  int64_t received = 0;
+  unsigned long started = millis();
+  while (length < 0 || received < length) {
+    int len = esp_http_client_read(client, (char *)buffer, OTA_BUFFER_SIZE);
+    if (len < 0 || (len == 0 && !esp_http_client_is_complete_data_received(client))) {
+      Serial.printf("Failed to read firmware data at %lu bytes\n", (unsigned long)*offset);
+      ok = false;
+      break;
+    }
+    if (len == 0) break; // chunked response complete
+
+    ok = format == KORRA_OTA_FORMAT_RAW ? write(buffer, len) : inflate(buffer, len);
+    if (!ok) break;
+    *offset += len;
+    received += len;
+    progress_bytes = *offset;
+    progress_total = *total;
+
+    // throttle by reading no faster than the rate, the server then slows down to match
+    uint32_t due = (received * 1000) / schedule.max_rate;
+    uint32_t elapsed = millis() - started;
+    if (due > elapsed) vTaskDelay(pdMS_TO_TICKS(due - elapsed));
+  }
+  if (ok && status == 200) *total = *offset; // without ranges, one response has the whole image
+
+  save_progress(*offset, *total);
+  Serial.printf("Firmware download at %lu of %lu bytes\n", (unsigned long)*offset, (unsigned long)*total);
+  return ok;
+}
+
+bool KorraOta::check_manifest() {
+  const bool failed = prefs.getUInt(PREFERENCES_KEY_OTA_FAILED, 0) == crc_of(info.hash);
+  if (strlen(info.manifest) == 0) {
+    if (failed) Serial.println("Firmware image failed verification before, waiting for its manifest to change");
+    return !failed;
+  }
+
+  // only a manifest that checked out against the same URL and hash is asked for conditionally
+  const uint32_t manifest_crc = crc_of(info.hash, crc_of(info.manifest));
+  esp_http_client_config_t manifest_config = config;
+  manifest_config.url = info.manifest;
+  esp_http_client_handle_t client = esp_http_client_init(&manifest_config);
+  if (client == NULL) return false;
+  String etag = prefs.getUInt(PREFERENCES_KEY_OTA_MANIFEST, 0) == manifest_crc
+                    ? prefs.getString(PREFERENCES_KEY_OTA_ETAG, "")
+                    : String("");
+  if (etag.length() > 0) esp_http_client_set_header(client, "If-None-Match", etag.c_str());
+
+  int64_t length = 0;
+  int status = 0;
+  int len = 0;
+  bool ok = open(client, &length, &status);
+  if (ok && status == 200) {
+    // the manifest is small, anything that does not fit the buffer is not one
+    while (ok && len < OTA_BUFFER_SIZE) {
+      int n = esp_http_client_read(client, (char *)buffer + len, OTA_BUFFER_SIZE - len);
+      ok = n >= 0;
+      if (n <= 0) break;
+      len += n;
+    }
+    if (!ok || len >= OTA_BUFFER_SIZE) {
+      Serial.println("Failed to read firmware manifest");
+      ok = false;
+    }
+  } else if (ok && status != 304) {
+    Serial.printf("Unexpected HTTP status %d for firmware manifest\n", status);
+    ok = false;
+  }
+  esp_http_client_cleanup(client);
+  if (!ok) return false;
+
+  if (status == 304) {
+    Serial.println("Firmware manifest unchanged");
+    if (failed) Serial.println("Firmware image failed verification before, waiting for its manifest to change");
+    return !failed;
+  }
+
+  // {"version": {"value": 1792, "semver": "0.7.0"}, "size": 1234567, "hash": "5dbd...", "chunk_size": 65536}
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, (const char *)buffer, len);
+  if (error) {
+    Serial.printf("Failed to parse firmware manifest: %s\n", error.c_str());
+    return false;
+  }
+  const uint32_t version = doc["version"]["value"] | 0;
+  const uint32_t size = doc["size"] | 0;
+  const char *hash = doc["hash"] | "";
+  if (version != info.version || strcasecmp(hash, info.hash) != 0) {
+    Serial.printf("Firmware manifest is for version %lu (%s), not the update\n", (unsigned long)version, hash);
+    return false;
+  }
+  if (size == 0 || size > partition->size) {
+    Serial.printf("Firmware image of %lu bytes does not fit in the partition (%lu bytes)\n", (unsigned long)size,
+                  (unsigned long)partition->size);
+    return false;
+  }
+
+  // the chunks the release is best served in, when the twin leaves it to the default
+  const uint32_t chunk_size = doc["chunk_size"] | 0;
+  if (chunk_size > 0 && info.chunk_size == KORRA_OTA_CHUNK_SIZE_DEFAULT) {
+    info.chunk_size = CLAMP(chunk_size, KORRA_OTA_CHUNK_SIZE_MIN, KORRA_OTA_CHUNK_SIZE_MAX);
+    info.chunk_size = info.chunk_size / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+  }
+
+  // a changed manifest means the image was published again so it deserves another try
+  Serial.printf("Firmware manifest checked out: %lu bytes\n", (unsigned long)size);
+  prefs.putUInt(PREFERENCES_KEY_OTA_MANIFEST, manifest_crc);
+  prefs.putString(PREFERENCES_KEY_OTA_ETAG, response_etag);
+  prefs.remove(PREFERENCES_KEY_OTA_FAILED);
+  return true;
+}
+
+bool KorraOta::staged() {
+  const esp_partition_t *next = esp_ota_get_next_update_partition(NULL);
+  if (next == NULL || prefs.getUInt(PREFERENCES_KEY_OTA_STAGED, 0) != crc_of(info.hash) ||
+      prefs.getUInt(PREFERENCES_KEY_OTA_STAGED_AT, 0) != next->address) {
+    return false;
+  }
+
+  // the image left in the next partition after a rollback is the one that failed its health check
+  esp_ota_img_states_t state;
+  if (esp_ota_get_state_partition(next, &state) == ESP_OK &&
+      (state == ESP_OTA_IMG_INVALID || state == ESP_OTA_IMG_ABORTED)) {
+    Serial.println("Firmware image was rolled back before, not installing it again");
+    set_status(OTA_FAIL_BIT);
+    return true;
+  }
+
+  Serial.println("Firmware image is already staged, not downloading it again");
+  esp_err_t err = esp_ota_set_boot_partition(next);
+  if (err != ESP_OK) {
+    // something has become of it, download it again
+    Serial.printf("Staged firmware image is not valid: %s\n", esp_err_to_name(err));
+    return false;
+  }
+  set_status(OTA_SUCCESS_BIT);
+  return true;
+}
+
+bool KorraOta::inflate(const uint8_t *data, size_t len) {
+  // the output lands in the dictionary (the window of the last 32 KB) which wraps around
+  tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  while (!stream->done && (len > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT)) {
+    uint8_t *out = stream->dict + stream->dict_offset;
+    size_t in_len = len, out_len = TINFL_LZ_DICT_SIZE - stream->dict_offset;
+    status = tinfl_decompress(&stream->inflator, data, &in_len, stream->dict, out, &out_len,
+                              TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    data += in_len;
+    len -= in_len;
+    stream->dict_offset = (stream->dict_offset + out_len) & (TINFL_LZ_DICT_SIZE - 1);
+    if (out_len > 0 && !(format == KORRA_OTA_FORMAT_DELTA ? patch(out, out_len) : write(out, out_len))) {
+      return false;
+    }
+    if (status < TINFL_STATUS_DONE) {
+      Serial.printf("Failed to decompress firmware data: %d\n", status);
+      return false;
+    }
+    stream->done = status == TINFL_STATUS_DONE;
+  }
+  return true;
+}
+
+static uint32_t read_u32le(const uint8_t *src) {
+  return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+bool KorraOta::patch(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    if (stream->remaining == 0) {
+      // collect the code and numbers of the next operation
+      stream->header[stream->header_len++] = *data++;
+      len--;
+      const uint8_t code = stream->header[0];
+      if (code != OTA_DELTA_ADD && code != OTA_DELTA_COPY) {
+        Serial.printf("Unknown delta operation 0x%02x\n", code);
+        return false;
+      }
+      if (stream->header_len < (code == OTA_DELTA_COPY ? 9 : 5)) continue;
+      stream->header_len = 0;
+      stream->remaining = read_u32le(stream->header + 1);
+      if (code == OTA_DELTA_ADD) continue;
+
+      // copy from the running image
+      uint32_t source = read_u32le(stream->header + 5);
+      if (source + stream->remaining > stream->base->size) {
+        Serial.printf("Delta copies beyond the running image at %lu bytes\n", (unsigned long)source);
+        return false;
+      }
+      while (stream->remaining > 0) {
+        size_t n = MIN(stream->remaining, (uint32_t)sizeof(stream->scratch));
+        esp_err_t err = esp_partition_read(stream->base, source, stream->scratch, n);
+        if (err != ESP_OK) {
+          Serial.printf("Failed to read running image at %lu bytes: %s\n", (unsigned long)source, esp_err_to_name(err));
+          return false;
+        }
+        if (!write(stream->scratch, n)) return false;
+        source += n;
+        stream->remaining -= n;
+      }
+      continue;
+    }
+
+    // bytes of an addition
+    size_t n = MIN(len, (size_t)stream->remaining);
+    if (!write(data, n)) return false;
+    data += n;
+    len -= n;
+    stream->remaining -= n;
+  }
+  return true;
+}
+
+bool KorraOta::write(const uint8_t *data, size_t len) {
+  if (written == 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+    Serial.println("Downloaded data is not a firmware image");
+    return false;
+  }
+  if (written + len > partition->size) {
+    Serial.printf("Firmware image does not fit in the partition (%lu bytes)\n", (unsigned long)partition->size);
+    return false;
+  }
+  while (erased < written + len) {
+    esp_partition_erase_range(partition, erased, OTA_SECTOR_SIZE);
+    erased += OTA_SECTOR_SIZE;
+  }
+  esp_err_t err = esp_partition_write(partition, written, data, len);
+  if (err != ESP_OK) {
+    Serial.printf("Failed to write firmware data at %lu bytes: %s\n", (unsigned long)written, esp_err_to_name(err));
+    return false;
+  }
+  mbedtls_sha256_update(&sha, data, len);
+  written += len;
+  return true;
+}
+
+void KorraOta::save_progress(uint32_t offset, uint32_t total) {
+  // the decompressor state is not kept so only raw images resume after a restart
+  if (format != KORRA_OTA_FORMAT_RAW) return;
+
+  prefs.putUInt(PREFERENCES_KEY_OTA_OFFSET, offset);
+  prefs.putUInt(PREFERENCES_KEY_OTA_SIZE, total);
+}
+
+void KorraOta::clear_progress() {
+  prefs.remove(PREFERENCES_KEY_OTA_URL);
+  prefs.remove(PREFERENCES_KEY_OTA_OFFSET);
+  prefs.remove(PREFERENCES_KEY_OTA_SIZE);
+}
+
+void KorraOta::set_status(int bit) {
+  if (!ota_status) return;
+  xEventGroupClearBits(ota_status, OTA_IDLE_BIT | OTA_UPDATING_BIT | OTA_SUCCESS_BIT | OTA_FAIL_BIT);
+  xEventGroupSetBits(ota_status, bit);
 }
 
 const enum KorraOta::https_ota_status KorraOta::current_status() {
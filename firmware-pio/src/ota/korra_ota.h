@@ -3,12 +3,96 @@
 
 #include "korra_config.h"
 
+#include <Preferences.h>
+#include <esp_http_client.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+#include "credentials/korra_credentials.h"
+
+// Bounds (in bytes) of the size of each ranged request, multiples of the flash sector size
+#define KORRA_OTA_CHUNK_SIZE_DEFAULT (64 * 1024)
+#define KORRA_OTA_CHUNK_SIZE_MIN (4 * 1024)
+#define KORRA_OTA_CHUNK_SIZE_MAX (512 * 1024)
+
+// Bounds (in bytes per second) of the download rate, leaving room on the radio for the hub
+#define KORRA_OTA_MAX_RATE_DEFAULT (32 * 1024)
+#define KORRA_OTA_MAX_RATE_MIN (1 * 1024)
+
+enum korra_ota_format {
+  /** The image as built. */
+  KORRA_OTA_FORMAT_RAW = 0,
+
+  /** The image compressed with zlib, decompressed as it is written. */
+  KORRA_OTA_FORMAT_ZLIB,
+
+  /** zlib compressed operations that rebuild the image from the running one (see `base`). */
+  KORRA_OTA_FORMAT_DELTA,
+};
+
 struct korra_ota_info {
-  char url[256 + 1];       // firmware binary URL
-  char hash[64 + 1];       // SHA-256 hash in hex
-  char signature[128 + 1]; // Signature (e.g., base64 or hex)
+  uint32_t version;             // version of the image
+  char url[256 + 1];            // firmware binary URL
+  char manifest[256 + 1];       // URL of the manifest describing the image, checked before downloading when set
+  char hash[64 + 1];            // SHA-256 hash in hex
+  char signature[128 + 1];      // ECDSA P-256 signature of the hash (r then s) in hex
+  uint32_t chunk_size;          // bytes per ranged request, zero for the default
+  enum korra_ota_format format; // how the image at the URL is encoded
+  uint32_t base;                // version of the running image a delta is made against
+  char peer[128 + 1];           // URL of the raw image on a peer in the LAN, tried before `url` when set
+};
+
+struct korra_ota_schedule {
+  uint32_t max_rate;     // bytes per second, zero for the default
+  uint16_t window_start; // hour of the day (UTC) from which downloads may run
+  uint16_t window_end;   // hour of the day (UTC) at which downloads stop, the same as the start for any time
 };
 
+/** Reasons for holding a download back, as flags. */
+enum korra_ota_hold {
+  /** The actuator is running. */
+  KORRA_OTA_HOLD_ACTUATION = 1 << 0,
+
+  /** The hub has messages ready to be sent. */
+  KORRA_OTA_HOLD_HUB = 1 << 1,
+};
+
+struct korra_ota_progress {
+  char status[11 + 1]; // idle, downloading, paused, rebooting, failed or verifying (the running image after an update)
+  uint32_t bytes;      // bytes downloaded
+  uint32_t total;      // bytes to download, zero until known
+  uint32_t rate;       // bytes per second since the download started
+  uint32_t eta;        // seconds left, zero when unknown
+};
+
+/**
+ * This class downloads firmware updates into the next OTA partition.
+ *
+ * The image is fetched with HTTP range requests of `chunk_size` bytes and written straight to flash.
+ * The offset reached is kept in the preferences (a namespace of its own) so that a download interrupted by a
+ * disconnection or a restart continues from where it stopped instead of from the first byte.
+ *
+ * The SHA-256 hash is computed as the image is written and, together with the signature, checked before the partition
+ * is made bootable. An image that fails the check is erased. A build without a signing key refuses every image.
+ *
+ * Compressed and delta images are decompressed on the fly, they cannot resume after a restart since the state of the
+ * decompressor is not kept.
+ *
+ * Downloads are throttled to `max_rate`, only run within the rollout window and pause between chunks while held
+ * (see `hold()`) so that they do not get in the way of monitoring.
+ *
+ * A peer that already has the image (see `KorraOtaPeer`) is preferred over the internet when one is known, the
+ * download carries on from the internet when the peer cannot be reached and starts over from it when the image from the
+ * peer fails the check. Only an image from the internet that fails the check is refused for good. A new image can be
+ * shared with peers for a while before rebooting into it (see `onShare()`).
+ *
+ * When there is a manifest (see `scripts/firmware.ts`), it is fetched first, conditionally on the ETag of the last one
+ * that checked out, and nothing is downloaded unless it agrees with the update. An image already staged in the next
+ * partition is not downloaded again, neither is one that failed verification until its manifest changes.
+ *
+ * After an update, the new image has to prove itself healthy (connected to the hub and sent telemetry) within
+ * `CONFIG_OTA_HEALTH_TIMEOUT_SEC` of booting, otherwise the bootloader rolls back to the previous one.
+ */
 class KorraOta {
 public:
   /**
@@ -25,13 +109,14 @@ public:
   /**
    * Setup the process (does not begin any update)
    *
-   * @param ca_cert Root certificates
+   * @param trust_store Parsed root certificates, must be the esp-tls global CA store
    */
-  void begin(const char *ca_cert);
+  void begin(mbedtls_x509_crt *trust_store);
 
   /**
    * Start the firmware update process.
    * This should be called once we have ascertained that we have an update.
+   * A previous download of the same URL is resumed.
    *
    * @param value update info
    */
@@ -43,15 +128,96 @@ public:
    */
   void maintain();
 
+  /**
+   * Set when and how fast downloads run, applies to the download in progress too.
+   *
+   * @param value The schedule.
+   */
+  void set_schedule(const struct korra_ota_schedule *value);
+
+  /**
+   * Hold the download back, or let it continue. It pauses before its next chunk until all reasons are cleared.
+   * This method can be called from any task.
+   *
+   * @param reason The reason, one of `enum korra_ota_hold`.
+   * @param held `true` to hold, `false` to release.
+   */
+  void hold(enum korra_ota_hold reason, bool held);
+
+  /**
+   * Check if the running image is new and yet to pass its health check.
+   */
+  inline bool verifying() { return pending_verify; }
+
+  /**
+   * Get the state of the firmware update.
+   *
+   * @param dest Where to write the state.
+   */
+  void progress(struct korra_ota_progress *dest);
+
+  /**
+   * Registers callback that will be called repeatedly, after a successful update and before restarting, until it
+   * returns `true` or a timeout elapses. It is the opportunity to send what is pending.
+   *
+   * @param callback The callback to register, returning `true` when ready for the restart.
+   */
+  inline void onReboot(bool (*callback)(void)) { reboot_callback = callback; }
+
+  /**
+   * Registers callback that will be called repeatedly, after a successful update and before the reboot callback, until
+   * it returns `true` or a timeout elapses. It is the opportunity to share the new image with peers (see
+   * `staged_image()`).
+   *
+   * @param callback The callback to register, returning `true` when done sharing.
+   */
+  inline void onShare(bool (*callback)(void)) { share_callback = callback; }
+
+  /**
+   * Get the image written by a successful update, verified and waiting for the reboot.
+   *
+   * @param partition Where to write the partition holding the image.
+   * @param length Where to write the length of the image.
+   * @param hash Where to write the SHA-256 hash of the image in hex.
+   * @return `true` if there is such an image, `false` otherwise.
+   */
+  bool staged_image(const esp_partition_t **partition, uint32_t *length, const char **hash);
+
   /**
    * Populate an instance of `struct korra_ota_info`.
    */
-  void populate(const char *url, const char *hash, const char *signature, struct korra_ota_info *dest);
+  void populate(uint32_t version, const char *url, const char *manifest, const char *hash, const char *signature,
+                uint32_t chunk_size, const char *format, uint32_t base, struct korra_ota_info *dest);
+
+  /**
+   * Please do not call this method from outside the `KorraOta` class
+   */
+  void download();
 
 private:
-  const char *ca_cert;
+  Preferences prefs; // own handle (see `begin()`), the loop only reads it while no download runs
+  mbedtls_x509_crt *trust_store = NULL;
   struct korra_ota_info info;
   bool printed_fail;
+  bool (*reboot_callback)(void) = NULL;
+  bool (*share_callback)(void) = NULL;
+  unsigned long reboot_requested_at = 0;
+  unsigned long staged_at = 0; // when a successful update was first seen, sharing it is limited from then
+  bool pending_verify = false; // the running image is on trial
+  uint32_t progress_bytes = 0, progress_total = 0;
+  uint32_t progress_base = 0; // bytes that were already there when the download started
+  unsigned long progress_started = 0;
+  struct korra_ota_schedule schedule = {.max_rate = KORRA_OTA_MAX_RATE_DEFAULT};
+  volatile uint8_t holds = 0;
+  volatile bool paused = false;
+  uint8_t *buffer = NULL;
+  mbedtls_sha256_context sha;
+  const esp_partition_t *partition = NULL;
+  uint32_t written = 0;                   // bytes of the image written to the partition
+  uint32_t erased = 0;                    // sectors are erased just before they are first written
+  struct korra_ota_stream *stream = NULL; // decompression state, NULL for raw images
+  const char *source = NULL;              // where the image is being downloaded from (`info.url` or `info.peer`)
+  enum korra_ota_format format;           // encoding of the image at the source
 
 private:
   enum https_ota_status {
@@ -62,6 +228,21 @@ private:
     HTTPS_OTA_STATUS_ERR
   };
   const enum https_ota_status current_status();
+  void set_status(int bit);
+  bool open(esp_http_client_handle_t client, int64_t *length, int *status);
+  bool fetch(esp_http_client_handle_t client, uint32_t *offset, uint32_t *total);
+  bool check_manifest();
+  bool staged();
+  void restart();
+  bool wait();
+  bool in_window();
+  bool inflate(const uint8_t *data, size_t len);
+  bool patch(const uint8_t *data, size_t len);
+  bool write(const uint8_t *data, size_t len);
+  bool hash_written(uint32_t length);
+  bool verify(const uint8_t *digest);
+  void save_progress(uint32_t offset, uint32_t total);
+  void clear_progress();
 };
 
 #endif // KORRA_OTA_H
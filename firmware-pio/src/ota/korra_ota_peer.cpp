@@ -0,0 +1,185 @@
+#include <Arduino.h>
+
+#include "korra_ota_peer.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "esp_image_format.h"
+#include "esp_ota_ops.h"
+
+#include <mbedtls/sha256.h>
+
+#ifndef CONFIG_OTA_PEER_TASK_STACK_SIZE
+#define CONFIG_OTA_PEER_TASK_STACK_SIZE 6144 // check the high-water mark with the `tasks` shell command
+#endif
+
+#define PEER_BUFFER_SIZE 1024
+#define PEER_IDLE_TIMEOUT_MS (5 * 1000) // kept-alive connections are closed after this long without a request
+#define PEER_PATH_PREFIX "/firmware/"
+#define PEER_LINE_MAX 256   // longest request line or header, longer ones close the connection
+#define PEER_HEADERS_MAX 32 // most headers in a request
+
+// reads a line without its ending, returns its length or -1 when idle, closed or longer than `size - 1`
+static int read_line(WiFiClient &client, char *dest, size_t size) {
+  size_t len = client.readBytesUntil('\n', dest, size);
+  if (len == 0 || len == size) return -1;
+  if (dest[len - 1] == '\r') len--;
+  dest[len] = '\0';
+  return len;
+}
+
+static void ota_peer_task(void *param) {
+  ((KorraOtaPeer *)param)->serve();
+  vTaskDelete(NULL);
+}
+
+KorraOtaPeer::KorraOtaPeer() {
+}
+
+KorraOtaPeer::~KorraOtaPeer() {
+}
+
+void KorraOtaPeer::begin(uint16_t port) {
+  if (started()) return;
+  this->port = port;
+
+  if (xTaskCreate(&ota_peer_task, "ota_peer_task", CONFIG_OTA_PEER_TASK_STACK_SIZE, this, 1, NULL) != pdPASS) {
+    log_e("Couldn't create ota peer task\n");
+  }
+}
+
+void KorraOtaPeer::serve() {
+  if (!hash_image()) return;
+  ready = true;
+  Serial.printf("Sharing firmware %s (%lu bytes) with peers on port %d\n", running.hash, (unsigned long)running.len,
+                port);
+
+  // one peer at a time is enough, the others retry
+  WiFiServer server(port);
+  server.begin();
+  while (true) {
+    WiFiClient client = server.accept();
+    if (!client) {
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+    handle(client);
+    client.stop();
+  }
+}
+
+void KorraOtaPeer::share(const esp_partition_t *partition, uint32_t length, const char *hash) {
+  if (staged_ready || partition == NULL || strlen(hash) != 64) return;
+
+  // the serving task only looks at it once ready is set
+  staged.partition = partition;
+  staged.len = length;
+  snprintf(staged.hash, sizeof(staged.hash), "%s", hash);
+  last_active = millis();
+  staged_ready = true;
+  Serial.printf("Sharing new firmware %s (%lu bytes) with peers\n", staged.hash, (unsigned long)staged.len);
+}
+
+const struct KorraOtaPeer::image *KorraOtaPeer::find(const char *hash) {
+  if (staged_ready && strncmp(hash, staged.hash, 64) == 0) return &staged;
+  if (ready && strncmp(hash, running.hash, 64) == 0) return &running;
+  return NULL;
+}
+
+bool KorraOtaPeer::hash_image() {
+  // the partition is larger than the image, its length comes from the image headers
+  const esp_partition_t *partition = esp_ota_get_running_partition();
+  const esp_partition_pos_t position = {.offset = partition->address, .size = partition->size};
+  esp_image_metadata_t metadata;
+  if (esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &position, &metadata) != ESP_OK) {
+    Serial.println("Unable to read the length of the running firmware image");
+    return false;
+  }
+  running.partition = partition;
+  running.len = metadata.image_len;
+
+  uint8_t *buffer = (uint8_t *)malloc(PEER_BUFFER_SIZE);
+  if (buffer == NULL) return false;
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, /* is224 */ 0);
+  bool ok = true;
+  for (uint32_t offset = 0; ok && offset < running.len; offset += PEER_BUFFER_SIZE) {
+    size_t len = MIN(running.len - offset, (uint32_t)PEER_BUFFER_SIZE);
+    ok = esp_partition_read(partition, offset, buffer, len) == ESP_OK;
+    if (ok) mbedtls_sha256_update(&sha, buffer, len);
+  }
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  free(buffer);
+  if (!ok) {
+    Serial.println("Unable to read the running firmware image");
+    return false;
+  }
+
+  for (uint8_t i = 0; i < sizeof(digest); i++) snprintf(running.hash + (i * 2), 3, "%02x", digest[i]);
+  return true;
+}
+
+void KorraOtaPeer::handle(WiFiClient &client) {
+  client.setTimeout(PEER_IDLE_TIMEOUT_MS / 1000);
+
+  // requests on the same connection are answered one after the other
+  char line[PEER_LINE_MAX];
+  while (client.connected()) {
+    // request line -> GET /firmware/{hash} HTTP/1.1
+    if (read_line(client, line, sizeof(line)) < 0) return; // idle for too long, closed or too long
+    const size_t prefix_len = strlen("GET " PEER_PATH_PREFIX);
+    const struct image *image = NULL;
+    if (strncmp(line, "GET " PEER_PATH_PREFIX, prefix_len) == 0 && strlen(line) >= prefix_len + 64) {
+      image = find(line + prefix_len);
+    }
+
+    // headers, only the range matters -> Range: bytes={first}-{last}
+    uint32_t first = 0, last = image ? image->len - 1 : 0;
+    bool ranged = false;
+    for (uint8_t headers = 0;; headers++) {
+      int len = read_line(client, line, sizeof(line));
+      if (len < 0 || headers >= PEER_HEADERS_MAX) {
+        client.print("HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+        return;
+      }
+      if (len == 0) break;
+      if (image != NULL && strncasecmp(line, "Range: bytes=", strlen("Range: bytes=")) == 0) {
+        unsigned long a = 0, b = last;
+        int parsed = sscanf(line + strlen("Range: bytes="), "%lu-%lu", &a, &b);
+        if (parsed >= 1 && a <= b && a < image->len) {
+          first = a;
+          last = MIN((uint32_t)b, image->len - 1);
+          ranged = true;
+        }
+      }
+    }
+
+    if (image == NULL) {
+      client.print("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+      continue;
+    }
+    last_active = millis();
+
+    const uint32_t length = last - first + 1;
+    if (ranged) {
+      client.printf("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %lu-%lu/%lu\r\n", (unsigned long)first,
+                    (unsigned long)last, (unsigned long)image->len);
+    } else {
+      client.print("HTTP/1.1 200 OK\r\n");
+    }
+    client.printf("Content-Type: application/octet-stream\r\nContent-Length: %lu\r\n\r\n", (unsigned long)length);
+
+    uint8_t buffer[PEER_BUFFER_SIZE];
+    for (uint32_t offset = first; offset <= last;) {
+      size_t len = MIN(last - offset + 1, (uint32_t)sizeof(buffer));
+      if (esp_partition_read(image->partition, offset, buffer, len) != ESP_OK) return;
+      if (client.write(buffer, len) != len) return;
+      offset += len;
+    }
+    last_active = millis();
+  }
+}
@@ -0,0 +1,92 @@
+#ifndef KORRA_OTA_PEER_H
+#define KORRA_OTA_PEER_H
+
+#include "korra_config.h"
+
+#include <WiFi.h>
+#include <esp_partition.h>
+
+// The path of the image on a peer -> http://{ip}:{port}/firmware/{hash}
+#define KORRA_OTA_PEER_URL_FORMAT "http://%s:%u/firmware/%s"
+
+/**
+ * This class shares firmware images with neighbouring devices over the LAN: the running one and, after a successful
+ * update, the new one waiting in the next partition (see `share()`). During a rollout the whole fleet gets the new
+ * version together, the first device to download it then passes it on before rebooting.
+ *
+ * Images are served over plain HTTP (with range requests, see `KorraOta`) at a path made of their SHA-256 hash.
+ * Peers only download one when the hash matches the one in their twin and check it like any other download, so
+ * nothing served here is trusted on its own. Neighbours learn of the hash through the mDNS service (see `KorraMdns`),
+ * the new image is advertised once there is one. Requests with overly long lines or too many headers are refused.
+ */
+class KorraOtaPeer {
+public:
+  /**
+   * Creates a new instance of the KorraOtaPeer class.
+   * Please note that only one instance of the class can be initialized at the same time.
+   */
+  KorraOtaPeer();
+
+  /**
+   * Cleanup resources created and managed by the KorraOtaPeer class.
+   */
+  ~KorraOtaPeer();
+
+  /**
+   * Start hashing the running image and then serving it.
+   * Only call this once the running image is known to be good.
+   *
+   * @param port The TCP port to serve on.
+   */
+  void begin(uint16_t port);
+
+  /**
+   * Check if serving has been started.
+   */
+  inline bool started() { return port != 0; }
+
+  /**
+   * Also serve an image that is verified and waiting in the next partition, it is advertised instead of the running
+   * one. Calling it again for the same image does nothing.
+   *
+   * @param partition The partition holding the image.
+   * @param length The length of the image.
+   * @param hash The SHA-256 hash of the image in hex.
+   */
+  void share(const esp_partition_t *partition, uint32_t length, const char *hash);
+
+  /**
+   * Get the hash of the image advertised in hex, or `NULL` while the running one is being hashed and there is no
+   * other to share.
+   */
+  inline const char *hash() { return staged_ready ? staged.hash : (ready ? running.hash : NULL); }
+
+  /**
+   * Get the time (in milliseconds since boot) an image was last requested or, if later, shared.
+   */
+  inline unsigned long active_at() { return last_active; }
+
+  /**
+   * Please do not call this method from outside the `KorraOtaPeer` class
+   */
+  void serve();
+
+private:
+  struct image {
+    const esp_partition_t *partition;
+    uint32_t len;
+    char hash[64 + 1];
+  };
+
+  uint16_t port = 0;
+  struct image running = {0}, staged = {0};
+  volatile bool ready = false, staged_ready = false; // set once the image is complete, it does not change after
+  volatile unsigned long last_active = 0;
+
+private:
+  bool hash_image();
+  void handle(WiFiClient &client);
+  const struct image *find(const char *hash);
+};
+
+#endif // KORRA_OTA_PEER_H
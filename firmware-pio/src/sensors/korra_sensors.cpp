@@ -1,6 +1,7 @@
 #include <Arduino.h>
 
 #include "korra_sensors.h"
+#include "metrics/korra_metrics.h"
 
 KorraSensors::KorraSensors() {
 }
@@ -15,6 +16,8 @@ void KorraSensors::begin() {
 }
 
 void KorraSensors::read(struct korra_sensors_data *dest) {
+  unsigned long started = millis();
+
 #ifdef CONFIG_APP_KIND_KEEPER
   TempAndHumidity th = dht.getTempAndHumidity();
   dest->temperature = th.temperature;
@@ -25,6 +28,8 @@ void KorraSensors::read(struct korra_sensors_data *dest) {
   read_moisture(&(dest->moisture));
   read_ph(&(dest->ph));
 #endif // CONFIG_APP_KIND_POT
+
+  KorraMetrics::record(KORRA_METRICS_HISTOGRAM_SENSORS_READ, millis() - started);
 }
 
 #ifdef CONFIG_APP_KIND_POT
@@ -0,0 +1,336 @@
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <esp_rom_crc.h>
+
+#include "korra_tls_client.h"
+#include "metrics/korra_metrics.h"
+
+#define TLS_HANDSHAKE_TIMEOUT_MS 15000
+
+#ifdef CONFIG_TLS_SESSION_RTC_SIZE
+#define TLS_SESSION_RTC_MAGIC 0x4b544c53 // KTLS
+
+// RTC memory is not cleared on restart (only on power loss) so the magic and checksum tell if the content is valid
+struct tls_session_rtc {
+  uint32_t magic;
+  uint32_t crc;
+  uint32_t len;
+  uint8_t data[CONFIG_TLS_SESSION_RTC_SIZE];
+};
+RTC_NOINIT_ATTR static struct tls_session_rtc session_rtc;
+#endif // CONFIG_TLS_SESSION_RTC_SIZE
+
+static int bio_send(void *ctx, const unsigned char *buf, size_t len) {
+  WiFiClient *client = (WiFiClient *)ctx;
+  if (!client->connected()) return MBEDTLS_ERR_SSL_CONN_EOF;
+  size_t written = client->write(buf, len);
+  if (written == 0) return MBEDTLS_ERR_SSL_WANT_WRITE;
+  return written;
+}
+
+static int bio_recv(void *ctx, unsigned char *buf, size_t len) {
+  WiFiClient *client = (WiFiClient *)ctx;
+  if (client->available() == 0) {
+    // nothing to read, mbedtls calls again later unless the connection is gone
+    return client->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_SSL_CONN_EOF;
+  }
+  int read = client->read(buf, len);
+  if (read <= 0) return MBEDTLS_ERR_SSL_WANT_READ;
+  return read;
+}
+
+static int verify_callback(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags) {
+  // only called during full handshakes, resumed sessions skip verification of the server certificate
+  *((bool *)ctx) = true;
+  return 0; // the result of the verification is still in flags
+}
+
+KorraTlsClient::KorraTlsClient() {
+  mbedtls_ssl_session_init(&session);
+}
+
+KorraTlsClient::~KorraTlsClient() {
+  stop();
+  mbedtls_ssl_session_free(&session);
+}
+
+void KorraTlsClient::set_trust_store(mbedtls_x509_crt *store) {
+  trust_store = store;
+}
+
+void KorraTlsClient::set_certificate(const struct korra_der_buffer *cert) {
+  this->cert = cert;
+}
+
+void KorraTlsClient::set_private_key(const struct korra_der_buffer *key) {
+  this->key = key;
+}
+
+void KorraTlsClient::set_profile(enum korra_tls_profile profile) {
+  this->profile = profile;
+}
+
+void KorraTlsClient::set_session_resumption(bool enabled, bool persist) {
+  resumption = enabled;
+  persist_session = enabled && persist;
+  if (!enabled) clear_session();
+}
+
+int KorraTlsClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip, port, TLS_HANDSHAKE_TIMEOUT_MS);
+}
+
+int KorraTlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout) {
+  if (started) stop();
+  if (!client.connect(ip, port, timeout)) return 0;
+  return handshake(ip.toString().c_str(), timeout);
+}
+
+int KorraTlsClient::connect(const char *host, uint16_t port) {
+  return connect(host, port, TLS_HANDSHAKE_TIMEOUT_MS);
+}
+
+int KorraTlsClient::connect(const char *host, uint16_t port, int32_t timeout) {
+  if (started) stop();
+  if (!client.connect(host, port, timeout)) return 0;
+  return handshake(host, timeout);
+}
+
+int KorraTlsClient::handshake(const char *host, int32_t timeout) {
+  // never talk to a server that cannot be verified, the credentials would go to whoever answers
+  if (trust_store == NULL) {
+    Serial.println("TLS connection refused, there is no trust store to verify the server");
+    client.stop();
+    return 0;
+  }
+
+  unsigned long started_ms = millis();
+  uint32_t heap_before = ESP.getFreeHeap(), heap_lowest = heap_before;
+  bool resuming = false;
+  int ret;
+
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_config_init(&conf);
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&ctr_drbg);
+  mbedtls_x509_crt_init(&own_cert);
+  mbedtls_pk_init(&own_key);
+  started = true; // from here on, stop() frees whatever was set up
+
+  ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0);
+  if (ret) goto fail;
+
+  ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ret) goto fail;
+  mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
+
+  ret = korra_tls_profile_apply(&conf, profile);
+  if (ret) goto fail;
+  KorraMetrics::set(KORRA_METRICS_GAUGE_TLS_PROFILE, profile);
+
+  // the trust store is shared and already parsed, only the device certificate is parsed per connection
+  mbedtls_ssl_conf_ca_chain(&conf, trust_store, NULL);
+  mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  verified = false;
+  mbedtls_ssl_conf_verify(&conf, verify_callback, &verified);
+
+  if (cert && cert->len && key && key->len) {
+    ret = mbedtls_x509_crt_parse_der(&own_cert, cert->data, cert->len);
+    if (ret) goto fail;
+    ret = mbedtls_pk_parse_key(&own_key, key->data, key->len, NULL, 0, mbedtls_ctr_drbg_random, &ctr_drbg);
+    if (ret) goto fail;
+    ret = mbedtls_ssl_conf_own_cert(&conf, &own_cert, &own_key);
+    if (ret) goto fail;
+  }
+
+  ret = mbedtls_ssl_setup(&ssl, &conf);
+  if (ret) goto fail;
+  ret = mbedtls_ssl_set_hostname(&ssl, host);
+  if (ret) goto fail;
+  mbedtls_ssl_set_bio(&ssl, &client, bio_send, bio_recv, NULL);
+
+  // offer the cached session, the server falls back to a full handshake if it no longer knows it
+  if (resumption && !session_valid && persist_session) session_valid = load_session();
+  if (resumption && session_valid) {
+    resuming = mbedtls_ssl_set_session(&ssl, &session) == 0;
+    if (resuming) KorraMetrics::increment(KORRA_METRICS_COUNTER_TLS_RESUMPTION_ATTEMPTS);
+  }
+
+  while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+    // sampled between handshake steps, so short-lived allocations within a step are missed
+    heap_lowest = MIN(heap_lowest, ESP.getFreeHeap());
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) goto fail;
+    if ((millis() - started_ms) > (unsigned long)timeout) {
+      Serial.println("TLS handshake timed out");
+      if (resuming) clear_session();
+      stop();
+      return 0;
+    }
+    delay(1);
+  }
+
+  heap_lowest = MIN(heap_lowest, ESP.getFreeHeap());
+  KorraMetrics::record(KORRA_METRICS_HISTOGRAM_TLS_HEAP_PEAK, (heap_before - heap_lowest) / 1024);
+
+  if (resuming && !verified) {
+    KorraMetrics::increment(KORRA_METRICS_COUNTER_TLS_RESUMPTION_HITS);
+    KorraMetrics::record(KORRA_METRICS_HISTOGRAM_TLS_HANDSHAKE_RESUMED, millis() - started_ms);
+  } else {
+    KorraMetrics::record(KORRA_METRICS_HISTOGRAM_TLS_HANDSHAKE, millis() - started_ms);
+  }
+
+  // keep the latest session (the server may have issued a new ticket)
+  if (resumption) save_session();
+  return 1;
+
+fail:
+  Serial.printf("TLS connection failed (mbedtls: -0x%04X)\n", -ret);
+  if (resuming) clear_session(); // do not offer a session that may be the cause
+  stop();
+  return 0;
+}
+
+size_t KorraTlsClient::write(uint8_t b) {
+  return write(&b, 1);
+}
+
+size_t KorraTlsClient::write(const uint8_t *buf, size_t size) {
+  if (!started) return 0;
+
+  size_t written = 0;
+  while (written < size) {
+    int ret = mbedtls_ssl_write(&ssl, buf + written, size - written);
+    if (ret > 0) {
+      written += ret;
+    } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      stop();
+      break;
+    }
+  }
+  return written;
+}
+
+int KorraTlsClient::available() {
+  if (!started) return 0;
+
+  // a zero length read processes any pending record so that the decrypted bytes can be counted
+  int ret = mbedtls_ssl_read(&ssl, NULL, 0);
+  if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    int pending = peeked >= 0 ? 1 : 0;
+    if (!pending) stop();
+    return pending;
+  }
+  return mbedtls_ssl_get_bytes_avail(&ssl) + (peeked >= 0 ? 1 : 0);
+}
+
+int KorraTlsClient::read() {
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int KorraTlsClient::read(uint8_t *buf, size_t size) {
+  if (size == 0) return 0;
+
+  int count = 0;
+  if (peeked >= 0) {
+    buf[0] = (uint8_t)peeked;
+    peeked = -1;
+    buf++;
+    size--;
+    count++;
+    if (size == 0 || !started || mbedtls_ssl_get_bytes_avail(&ssl) == 0) return count;
+  }
+  if (!started) return -1;
+
+  int ret = mbedtls_ssl_read(&ssl, buf, size);
+  if (ret > 0) return count + ret;
+  if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) stop();
+  return count > 0 ? count : -1;
+}
+
+int KorraTlsClient::peek() {
+  if (peeked >= 0) return peeked;
+  if (!available()) return -1;
+  uint8_t b;
+  if (read(&b, 1) != 1) return -1;
+  peeked = b;
+  return peeked;
+}
+
+void KorraTlsClient::flush() {
+  client.flush();
+}
+
+void KorraTlsClient::stop() {
+  if (started) {
+    if (client.connected()) mbedtls_ssl_close_notify(&ssl);
+    cleanup();
+    started = false;
+  }
+  peeked = -1;
+  client.stop();
+}
+
+uint8_t KorraTlsClient::connected() {
+  if (!started) return 0;
+  return client.connected() || peeked >= 0 || mbedtls_ssl_get_bytes_avail(&ssl) > 0;
+}
+
+void KorraTlsClient::cleanup() {
+  mbedtls_ssl_free(&ssl);
+  mbedtls_ssl_config_free(&conf);
+  mbedtls_x509_crt_free(&own_cert);
+  mbedtls_pk_free(&own_key);
+  mbedtls_ctr_drbg_free(&ctr_drbg);
+  mbedtls_entropy_free(&entropy);
+}
+
+void KorraTlsClient::save_session() {
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  session_valid = mbedtls_ssl_get_session(&ssl, &session) == 0;
+
+#ifdef CONFIG_TLS_SESSION_RTC_SIZE
+  if (!persist_session) return;
+  size_t len = 0;
+  session_rtc.magic = 0; // invalidate while writing
+  if (!session_valid) return;
+  int ret = mbedtls_ssl_session_save(&session, session_rtc.data, sizeof(session_rtc.data), &len);
+  if (ret) {
+    Serial.printf("Unable to keep TLS session in RTC memory, needs %d bytes (mbedtls: -0x%04X)\n", (int)len, -ret);
+    return;
+  }
+  session_rtc.len = len;
+  session_rtc.crc = esp_rom_crc32_le(0, session_rtc.data, len);
+  session_rtc.magic = TLS_SESSION_RTC_MAGIC;
+#endif // CONFIG_TLS_SESSION_RTC_SIZE
+}
+
+bool KorraTlsClient::load_session() {
+#ifdef CONFIG_TLS_SESSION_RTC_SIZE
+  if (session_rtc.magic != TLS_SESSION_RTC_MAGIC || session_rtc.len > sizeof(session_rtc.data)) return false;
+  if (session_rtc.crc != esp_rom_crc32_le(0, session_rtc.data, session_rtc.len)) return false;
+
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  if (mbedtls_ssl_session_load(&session, session_rtc.data, session_rtc.len) != 0) {
+    session_rtc.magic = 0;
+    return false;
+  }
+  Serial.println("Loaded TLS session from RTC memory");
+  return true;
+#else
+  return false;
+#endif // CONFIG_TLS_SESSION_RTC_SIZE
+}
+
+void KorraTlsClient::clear_session() {
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  session_valid = false;
+
+#ifdef CONFIG_TLS_SESSION_RTC_SIZE
+  if (persist_session) session_rtc.magic = 0;
+#endif // CONFIG_TLS_SESSION_RTC_SIZE
+}
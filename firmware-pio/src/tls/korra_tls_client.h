@@ -0,0 +1,123 @@
+#ifndef KORRA_TLS_CLIENT_H
+#define KORRA_TLS_CLIENT_H
+
+#include "korra_config.h"
+
+#include <Client.h>
+#include <WiFi.h>
+
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+#include "credentials/korra_credentials.h"
+#include "korra_tls_profile.h"
+
+/**
+ * This class is a TLS client that takes its credentials in DER form.
+ *
+ * `WiFiClientSecure` only accepts NULL terminated PEM which is base64 decoded and parsed on every connection.
+ * Here the DER buffers are handed to mbedtls directly and the PEM copies no longer need to live in RAM.
+ */
+class KorraTlsClient : public Client {
+public:
+  /**
+   * Creates a new instance of the KorraTlsClient class.
+   */
+  KorraTlsClient();
+
+  /**
+   * Cleanup resources created and managed by the KorraTlsClient class.
+   */
+  ~KorraTlsClient();
+
+  /**
+   * Set the trust store used to verify the server.
+   * The store is shared (not copied) and must remain valid for as long as the client is used.
+   * Connections are refused until it is set.
+   *
+   * @param store The parsed root CA certificates.
+   */
+  void set_trust_store(mbedtls_x509_crt *store);
+
+  /**
+   * Set the certificate presented to the server.
+   * The buffer is not copied and must remain valid for as long as the client is used.
+   *
+   * @param cert The certificate in DER form.
+   */
+  void set_certificate(const struct korra_der_buffer *cert);
+
+  /**
+   * Set the private key matching the certificate presented to the server.
+   * The buffer is not copied and must remain valid for as long as the client is used.
+   *
+   * @param key The private key in DER form.
+   */
+  void set_private_key(const struct korra_der_buffer *key);
+
+  /**
+   * Enable resumption of the TLS session on later connections, which skips the full handshake when the server accepts
+   * the cached session. The session is cached in RAM and, when `persist` is `true` and `CONFIG_TLS_SESSION_RTC_SIZE`
+   * is set, also in RTC memory so that it survives a restart. Only one client can persist its session.
+   *
+   * @param enabled Whether to resume sessions.
+   * @param persist Whether to keep the session in RTC memory.
+   */
+  void set_session_resumption(bool enabled, bool persist = false);
+
+  /**
+   * Set the profile used for later connections.
+   *
+   * @param profile The profile.
+   */
+  void set_profile(enum korra_tls_profile profile);
+
+  int connect(IPAddress ip, uint16_t port);
+  int connect(IPAddress ip, uint16_t port, int32_t timeout);
+  int connect(const char *host, uint16_t port);
+  int connect(const char *host, uint16_t port, int32_t timeout);
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buf, size_t size);
+  int available();
+  int read();
+  int read(uint8_t *buf, size_t size);
+  int peek();
+  void flush();
+  void stop();
+  uint8_t connected();
+  operator bool() { return connected(); }
+
+private:
+  WiFiClient client;
+  mbedtls_x509_crt *trust_store = NULL;
+  const struct korra_der_buffer *cert = NULL;
+  const struct korra_der_buffer *key = NULL;
+
+  bool started = false;
+  int peeked = -1;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config conf;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context ctr_drbg;
+  mbedtls_x509_crt own_cert;
+  mbedtls_pk_context own_key;
+
+  enum korra_tls_profile profile = KORRA_TLS_PROFILE_DEFAULT;
+  bool resumption = false;
+  bool persist_session = false;
+  bool session_valid = false;
+  bool verified = false;
+  mbedtls_ssl_session session;
+
+private:
+  int handshake(const char *host, int32_t timeout);
+  void cleanup();
+  void save_session();
+  bool load_session();
+  void clear_session();
+};
+
+#endif // KORRA_TLS_CLIENT_H
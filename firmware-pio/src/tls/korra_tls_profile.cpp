@@ -0,0 +1,24 @@
+#include "korra_tls_profile.h"
+
+// The hub (Azure) and GitHub serve RSA certificates while other endpoints may serve ECDSA ones, so both are offered.
+// Only ECDHE with AES-GCM is kept, which avoids loading the code and tables for the other ciphers.
+static const int low_memory_ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0, // must be last
+};
+
+int korra_tls_profile_apply(mbedtls_ssl_config *conf, enum korra_tls_profile profile) {
+  if (profile != KORRA_TLS_PROFILE_LOW_MEMORY) return 0;
+
+  mbedtls_ssl_conf_ciphersuites(conf, low_memory_ciphersuites);
+#ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+  // Azure (hub, DPS) and GitHub ignore the extension and still send records of up to 16 KB, the buffers are sized by
+  // the sdkconfig (see platformio.ini) and not by this
+  return mbedtls_ssl_conf_max_frag_len(conf, MBEDTLS_SSL_MAX_FRAG_LEN_4096);
+#else
+  return 0;
+#endif // MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+}
@@ -0,0 +1,27 @@
+#ifndef KORRA_TLS_PROFILE_H
+#define KORRA_TLS_PROFILE_H
+
+#include <mbedtls/ssl.h>
+
+enum korra_tls_profile {
+  /** mbedtls defaults, all enabled cipher suites and full size records. */
+  KORRA_TLS_PROFILE_DEFAULT = 0,
+
+  /**
+   * Offers only ECDHE suites with AES-GCM and asks for a 4 KB maximum fragment length.
+   * The servers we connect to ignore the latter, so on the devices the saving comes from the cipher list.
+   */
+  KORRA_TLS_PROFILE_LOW_MEMORY,
+};
+
+/**
+ * Apply a profile to a client configuration that has its defaults set.
+ * Only mbedtls is used so that it can also be built on the host (see `bench/`).
+ *
+ * @param conf The configuration.
+ * @param profile The profile.
+ * @return zero on success, otherwise an mbedtls error code.
+ */
+int korra_tls_profile_apply(mbedtls_ssl_config *conf, enum korra_tls_profile profile);
+
+#endif // KORRA_TLS_PROFILE_H
@@ -56,26 +56,32 @@ internal class KorraIotEventsConsumer(KorraDashboardClient dashboardClient, ILog
 
         if (type is KorraIotHubTelemetryType.Sensors)
         {
-            var sensors = new KorraTelemetrySensors
+            // a batch carries several readings, each forwarded on its own with an id derived from the message
+            var readings = incoming.Readings ?? [incoming];
+            for (var i = 0; i < readings.Count; i++)
             {
-                Id = telemetryId,
-                DeviceId = deviceId,
-                Created = new DateTimeOffset(incoming.Created, TimeSpan.Zero),
-                Received = enqueued?.ToUniversalTime(),
-                AppKind = appKind,
-                // we assume the units for this do not vary, otherwise we would need to convert
-                Temperature = incoming.Temperature?.Value,
-                Humidity = incoming.Humidity?.Value,
-                Moisture = incoming.Moisture?.Value,
-                PH = incoming.PH?.Value,
-            };
+                var reading = readings[i];
+                var sensors = new KorraTelemetrySensors
+                {
+                    Id = incoming.Readings is null ? telemetryId : $"{telemetryId}-{i}",
+                    DeviceId = deviceId,
+                    Created = new DateTimeOffset(reading.Created, TimeSpan.Zero),
+                    Received = enqueued?.ToUniversalTime(),
+                    AppKind = appKind,
+                    // we assume the units for this do not vary, otherwise we would need to convert
+                    Temperature = reading.Temperature?.Value,
+                    Humidity = reading.Humidity?.Value,
+                    Moisture = reading.Moisture?.Value,
+                    PH = reading.PH?.Value,
+                };
 
-            logger.LogInformation("Forwarding sensors telemetry from {DeviceId} (dated: {Created:o})", deviceId, sensors.Created);
-            if (logger.IsEnabled(LogLevel.Debug))
-            {
-                logger.LogDebug("{Telemetry}", JsonSerializer.Serialize(sensors, SC.Default.KorraTelemetrySensors));
+                logger.LogInformation("Forwarding sensors telemetry from {DeviceId} (dated: {Created:o})", deviceId, sensors.Created);
+                if (logger.IsEnabled(LogLevel.Debug))
+                {
+                    logger.LogDebug("{Telemetry}", JsonSerializer.Serialize(sensors, SC.Default.KorraTelemetrySensors));
+                }
+                await dashboardClient.SendAsync(sensors, cancellationToken);
             }
-            await dashboardClient.SendAsync(sensors, cancellationToken);
         }
         else if (type is KorraIotHubTelemetryType.Actuators)
         {
@@ -97,6 +103,16 @@ internal class KorraIotEventsConsumer(KorraDashboardClient dashboardClient, ILog
             }
             await dashboardClient.SendAsync(actuators, cancellationToken);
         }
+        else if (type is KorraIotHubTelemetryType.Metrics)
+        {
+            // metrics are for diagnostics, they are available in the hub (e.g. via routing) but not in the dashboard
+            logger.LogDebug("Skipping metrics telemetry from {DeviceId} (dated: {Created:o})", deviceId, incoming.Created);
+        }
+        else if (type is KorraIotHubTelemetryType.CommandAck)
+        {
+            // acknowledgements of cloud-to-device commands, the sender correlates them by message id
+            logger.LogDebug("Skipping command acknowledgement from {DeviceId}", deviceId);
+        }
         else
         {
             throw new NotSupportedException($"Unsupported telemetry type: {type}");
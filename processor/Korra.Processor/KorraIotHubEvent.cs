@@ -13,6 +13,7 @@ public record KorraIotHubEvent : IotHubEvent { }
 /// <param name="Humidity">Relative humidity (%)</param>
 /// <param name="Moisture">Percentage (%) of water in the soil</param>
 /// <param name="PH"></param>
+/// <param name="Readings">Sensor readings packed into one message when the device is saving its daily budget</param>
 public record KorraIotHubTelemetry(
     [property: JsonPropertyName("timestamp")] ulong Timestamp,
     [property: JsonPropertyName("created")] DateTime Created,
@@ -22,7 +23,8 @@ public record KorraIotHubTelemetry(
     [property: JsonPropertyName("moisture")] KorraIotHubTelemetrySensorValue? Moisture,
     [property: JsonPropertyName("ph")] KorraIotHubTelemetrySensorValue? PH,
     [property: JsonPropertyName("pump")] KorraIotHubTelemetryActuatorValue? Pump,
-    [property: JsonPropertyName("fan")] KorraIotHubTelemetryActuatorValue? Fan);
+    [property: JsonPropertyName("fan")] KorraIotHubTelemetryActuatorValue? Fan,
+    [property: JsonPropertyName("readings")] List<KorraIotHubTelemetry>? Readings);
 
 [JsonConverter(typeof(JsonStringEnumMemberConverter<KorraIotHubTelemetryAppKind>))]
 public enum KorraIotHubTelemetryAppKind
@@ -36,6 +38,8 @@ public enum KorraIotHubTelemetryType
 {
     [EnumMember(Value = "sensors")] Sensors,
     [EnumMember(Value = "actuators")] Actuators,
+    [EnumMember(Value = "metrics")] Metrics,
+    [EnumMember(Value = "command_ack")] CommandAck,
 }
 
 public record KorraIotHubTelemetryActuatorValue(